@@ -0,0 +1,115 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include <gtest_memleak_detector/gtest_memleak_detector_benchmark.h>
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+#include <crtdbg.h>
+
+#include <algorithm>    // std::max
+
+namespace {
+
+// Counters are only modified by the allocation hook which is invoked while
+// the CRT heap lock is held, so they do not need to be atomic.
+struct Counters
+{
+    int64_t allocs;
+    int64_t total_bytes;
+    int64_t current_bytes;
+    int64_t peak_bytes;
+};
+
+Counters counters;
+
+// Allocation bus subscriber, invoked after the detector which may fail the
+// request since it subscribes first.
+bool CountAllocation(void*, int nAllocType, void* pvData,
+    size_t nSize, int nBlockUse, long, const unsigned char*, int)
+{
+    // CRT internal blocks, e.g. locale data, are not part of the benchmark
+    if (_BLOCK_TYPE(nBlockUse) == _CRT_BLOCK)
+        return true;
+
+    const auto size = static_cast<int64_t>(nSize);
+    switch (nAllocType)
+    {
+    case _HOOK_ALLOC:
+        ++counters.allocs;
+        counters.total_bytes += size;
+        counters.current_bytes += size;
+        break;
+    case _HOOK_REALLOC:
+        ++counters.allocs;
+        counters.total_bytes += size;
+        counters.current_bytes += size;
+        if (pvData != nullptr)
+            counters.current_bytes -= static_cast<int64_t>(_msize_dbg(pvData, nBlockUse));
+        break;
+    case _HOOK_FREE:
+        if (pvData != nullptr)
+            counters.current_bytes -= static_cast<int64_t>(_msize_dbg(pvData, nBlockUse));
+        break;
+    default:
+        break;
+    }
+    counters.peak_bytes = (std::max)(counters.peak_bytes, counters.current_bytes);
+    return true;
+}
+
+} // anonymous namespace
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+gtest_memleak_detector::BenchmarkMemoryManager::BenchmarkMemoryManager() noexcept
+    : check_()
+    , leaked_blocks_(0)
+    , leaked_bytes_(0)
+{ }
+
+gtest_memleak_detector::BenchmarkMemoryManager::~BenchmarkMemoryManager() noexcept
+{
+	// Empty but required since ScopedLeakCheck is defined in another header
+}
+
+void gtest_memleak_detector::BenchmarkMemoryManager::Start()
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    leaked_blocks_ = 0;
+    leaked_bytes_ = 0;
+
+    // Leaks are counted when the check is destroyed, the check itself is 
+    // allocated before counting starts.
+    check_.reset(new ScopedLeakCheck([this](const Leak& leak)
+    {
+        ++leaked_blocks_;
+        leaked_bytes_ += static_cast<int64_t>(leak.size);
+        return true;
+    }));
+
+    counters = Counters();
+    (void)Subscribe(CountAllocation, nullptr);
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+void gtest_memleak_detector::BenchmarkMemoryManager::Stop(Result& result)
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    (void)Unsubscribe(CountAllocation, nullptr);
+    check_.reset();
+
+    result.num_allocs = counters.allocs;
+    result.total_allocated_bytes = counters.total_bytes;
+    result.max_bytes_used = counters.peak_bytes;
+    result.net_heap_growth = leaked_bytes_;
+#else
+    (void)result;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+int64_t gtest_memleak_detector::BenchmarkMemoryManager::LeakedBlocks() const noexcept
+{
+    return leaked_blocks_;
+}
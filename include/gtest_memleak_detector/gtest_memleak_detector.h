@@ -15,7 +15,10 @@
 #ifndef GTEST_MEMLEAK_DETECTOR_H
 #define GTEST_MEMLEAK_DETECTOR_H
 
+#include <cstdint>              // uint32_t
+#include <functional>           // std::function
 #include <memory>               // std::unique_ptr
+#include <vector>               // std::vector
 
 #pragma warning(push)
 #pragma warning(disable: 26812) // MSVC C26812: unscoped enum
@@ -33,6 +36,19 @@
   ::testing::UnitTest::GetInstance()->listeners().Append( \
     new gtest_memleak_detector::MemoryLeakDetectorListener(argc, argv)) 
 
+// Annotations for custom pool or arena allocators. Annotated allocations are
+// tracked as individual blocks so that leaks of pool objects are reported
+// even if the underlying memory chunk is owned by the pool.
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+#define GTEST_MEMLEAK_ANNOTATE_ALLOC(pool, ptr, size) \
+  ::gtest_memleak_detector::AnnotateAlloc((pool), (ptr), (size))
+#define GTEST_MEMLEAK_ANNOTATE_FREE(pool, ptr) \
+  ::gtest_memleak_detector::AnnotateFree((pool), (ptr))
+#else
+#define GTEST_MEMLEAK_ANNOTATE_ALLOC(pool, ptr, size) ((void)0)
+#define GTEST_MEMLEAK_ANNOTATE_FREE(pool, ptr) ((void)0)
+#endif
+
 #define GTEST_MEMLEAK_DETECTOR_MAIN \
 int main(int argc, char **argv) \
 { \
@@ -44,6 +60,23 @@ int main(int argc, char **argv) \
 
 namespace gtest_memleak_detector { 
 
+///////////////////////////////////////////////////////////////////////////////
+// Leak
+///////////////////////////////////////////////////////////////////////////////
+
+// A block allocated and not freed by the most recently checked test.
+struct Leak {
+	const void*   address;  // user pointer of the block
+	size_t        size;     // requested size in bytes
+	long          request;  // CRT allocation request no or annotation no
+	unsigned long thread;   // allocating thread id, 0 if not recorded
+	uint32_t      stack;    // call-site signature, 0 if not recorded
+	const void*   pool;     // pool of an annotated block, nullptr for heap
+};
+
+// Return false to stop the enumeration.
+using LeakCallback = std::function<bool(const Leak& leak)>;
+
 ///////////////////////////////////////////////////////////////////////////////
 // MemoryLeakDetectorListener
 ///////////////////////////////////////////////////////////////////////////////
@@ -69,15 +102,172 @@ public:
 		const ::testing::TestInfo& test_info) override;
 	void OnTestEnd(
 		const ::testing::TestInfo& test_info) override;
+	void OnTestSuiteEnd(
+		const ::testing::TestSuite& test_suite) override;
 	void OnTestProgramEnd(
 		const ::testing::UnitTest& unit_test) override;
 
 	static std::string MakeDatabaseFilePath(const char* binary_file_path);
 
+	// Enumerates blocks leaked by the most recently ended test, e.g. from 
+	// OnTestEnd of a derived listener, returns the number of visited leaks.
+	size_t ForEachLeak(const LeakCallback& callback) const;
+
 private:
 	std::unique_ptr<MemoryLeakDetector> impl_;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// ScopedLeakCheck
+///////////////////////////////////////////////////////////////////////////////
+
+// Checks for leaks between construction and destruction, e.g. around a single
+// iteration of a soak test or within a fuzz target. Leaks are reported as a
+// Google Test failure unless a callback is given. Checks may be nested, an 
+// enclosing check also reports leaks of nested checks.
+class ScopedLeakCheck {
+public:
+	ScopedLeakCheck() noexcept;
+	explicit ScopedLeakCheck(LeakCallback callback) noexcept;
+	~ScopedLeakCheck() noexcept;
+
+	ScopedLeakCheck(const ScopedLeakCheck&) = delete;
+	ScopedLeakCheck(ScopedLeakCheck&&) = delete;
+	ScopedLeakCheck& operator=(const ScopedLeakCheck&) = delete;
+	ScopedLeakCheck& operator=(ScopedLeakCheck&&) = delete;
+
+	// Enumerates blocks allocated since construction and not yet freed,
+	// most recent first, returns the number of visited leaks.
+	size_t ForEachLeak(const LeakCallback& callback) const;
+
+private:
+	void*        sentinel_;
+	LeakCallback callback_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Snapshot
+///////////////////////////////////////////////////////////////////////////////
+
+// Marks an allocation epoch to diff against another snapshot, e.g. before and
+// after handling requests in steady state. Taking a snapshot allocates a 
+// single small CRT block and does not visit existing blocks.
+class Snapshot {
+public:
+	Snapshot() noexcept;
+	Snapshot(Snapshot&& other) noexcept;
+	~Snapshot() noexcept;
+
+	Snapshot(const Snapshot&) = delete;
+	Snapshot& operator=(const Snapshot&) = delete;
+	Snapshot& operator=(Snapshot&&) = delete;
+
+	// Allocation request number of the snapshot, -1 if not available
+	long Epoch() const noexcept;
+
+private:
+	friend size_t Diff(const Snapshot& first, const Snapshot& last, 
+		const LeakCallback& callback);
+
+	void* sentinel_;
+};
+
+// Enumerates blocks allocated after snapshot first and before snapshot last
+// which are still alive, most recent first, returns the number of visited 
+// blocks. Cost is proportional to the number of such blocks rather than the
+// number of blocks on the heap.
+size_t Diff(const Snapshot& first, const Snapshot& last, 
+	const LeakCallback& callback);
+std::vector<Leak> Diff(const Snapshot& first, const Snapshot& last);
+
+///////////////////////////////////////////////////////////////////////////////
+// LeakContext
+///////////////////////////////////////////////////////////////////////////////
+
+// Identifies the test allocations are charged to. Capture a context when 
+// submitting work to an executor, thread pool or coroutine scheduler and 
+// enter it on the thread running the work so that its allocations are charged
+// to the submitting test. Allocations charged to another test than the one
+// running, e.g. by work outliving the test that submitted it, are excluded
+// from the leak check of the running test.
+class LeakContext {
+public:
+	// Context entered by the calling thread if any, otherwise the context of
+	// the running test.
+	static LeakContext Capture() noexcept;
+
+	// Enters a context on the calling thread for the lifetime of the scope at
+	// the cost of a thread-local pointer swap. Scopes may be nested and the
+	// context must outlive the scope.
+	class Scope {
+	public:
+		explicit Scope(const LeakContext& context) noexcept;
+		~Scope() noexcept;
+
+		Scope(const Scope&) = delete;
+		Scope(Scope&&) = delete;
+		Scope& operator=(const Scope&) = delete;
+		Scope& operator=(Scope&&) = delete;
+
+	private:
+		const LeakContext* previous_;
+	};
+
+	// Identifier of the test, 0 if captured while no test is running
+	unsigned long long Test() const noexcept;
+
+private:
+	explicit LeakContext(unsigned long long test) noexcept;
+
+	unsigned long long test_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocator annotations
+///////////////////////////////////////////////////////////////////////////////
+
+// Prefer GTEST_MEMLEAK_ANNOTATE_ALLOC and GTEST_MEMLEAK_ANNOTATE_FREE which
+// compile to nothing if memory leak detection is not available.
+void AnnotateAlloc(const void* pool, const void* ptr, size_t size) noexcept;
+void AnnotateFree(const void* pool, const void* ptr) noexcept;
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocation event bus
+///////////////////////////////////////////////////////////////////////////////
+
+// Invoked with the arguments of a CRT allocation hook, i.e. before a block is
+// allocated, reallocated or freed. Returning false fails the request and no
+// further subscribers are invoked. Subscribers must not allocate from the CRT
+// heap and must not subscribe or unsubscribe from within the callback.
+using AllocationSubscriber = bool (*)(void* context, int type, void* data,
+	size_t size, int block_use, long request, const unsigned char* file,
+	int line);
+
+// Registers a subscriber for allocation events of all threads, invoked in
+// order of subscription. Dispatch is lock-free and subscribers may be added
+// or removed at any time. Once Unsubscribe returns the subscriber is no 
+// longer invoked by any thread. Both return false if not available or if the
+// subscriber is already or not subscribed respectively.
+bool Subscribe(AllocationSubscriber subscriber, void* context);
+bool Unsubscribe(AllocationSubscriber subscriber, void* context);
+
+///////////////////////////////////////////////////////////////////////////////
+// Executors
+///////////////////////////////////////////////////////////////////////////////
+
+// Returns true if an executor, e.g. a thread pool, has no queued or running
+// work. Probes are polled by the thread ending a test and must neither 
+// allocate from the CRT heap nor register or unregister executors.
+using IdleProbe = bool (*)(void* context);
+
+// Registers an executor polled before a test is checked for leaks if enabled
+// with --memleak_quiescence, so that memory held by work still running on it
+// is not reported as leaking. Up to 16 executors may be registered. Both 
+// return false if not available or if the executor is already or not 
+// registered respectively.
+bool RegisterExecutor(IdleProbe probe, void* context);
+bool UnregisterExecutor(IdleProbe probe, void* context);
+
 } // namespace gtest_memleak_detector
 
 #endif // GTEST_MEMLEAK_DETECTOR_H
@@ -0,0 +1,66 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file found in 
+// the root directory of this distribution.
+
+// Google Benchmark memory manager based on the CRT debug heap allocation hook
+// of the memory leak detector. Register it before running benchmarks to get
+// allocation statistics reported next to timings:
+//
+//   gtest_memleak_detector::BenchmarkMemoryManager memory_manager;
+//   ::benchmark::RegisterMemoryManager(&memory_manager);
+//
+// Or use GTEST_MEMLEAK_DETECTOR_BENCHMARK_MAIN in place of BENCHMARK_MAIN.
+
+#ifndef GTEST_MEMLEAK_DETECTOR_BENCHMARK_H
+#define GTEST_MEMLEAK_DETECTOR_BENCHMARK_H
+
+#include <gtest_memleak_detector/gtest_memleak_detector.h>
+
+#include <benchmark/benchmark.h> // Google Benchmark
+
+#define GTEST_MEMLEAK_DETECTOR_BENCHMARK_MAIN \
+int main(int argc, char **argv) \
+{ \
+  ::gtest_memleak_detector::BenchmarkMemoryManager memory_manager; \
+  ::benchmark::RegisterMemoryManager(&memory_manager); \
+  ::benchmark::Initialize(&argc, argv); \
+  if (::benchmark::ReportUnrecognizedArguments(argc, argv)) return 1; \
+  ::benchmark::RunSpecifiedBenchmarks(); \
+  ::benchmark::RegisterMemoryManager(nullptr); \
+  return 0; \
+}
+
+namespace gtest_memleak_detector { 
+
+///////////////////////////////////////////////////////////////////////////////
+// BenchmarkMemoryManager
+///////////////////////////////////////////////////////////////////////////////
+
+// Reports number of allocations, total allocated bytes, peak bytes in use and
+// bytes leaked (net heap growth) for each benchmark run. Counters are only
+// available if memory leak detection is available, e.g. in debug builds.
+class BenchmarkMemoryManager : public ::benchmark::MemoryManager {
+public:
+	BenchmarkMemoryManager() noexcept;
+	~BenchmarkMemoryManager() noexcept override;
+
+	BenchmarkMemoryManager(const BenchmarkMemoryManager&) = delete;
+	BenchmarkMemoryManager(BenchmarkMemoryManager&&) = delete;
+	BenchmarkMemoryManager& operator=(const BenchmarkMemoryManager&) = delete;
+	BenchmarkMemoryManager& operator=(BenchmarkMemoryManager&&) = delete;
+
+	void Start() override;
+	void Stop(Result& result) override;
+
+	// Number of blocks allocated and not freed by the most recent run.
+	int64_t LeakedBlocks() const noexcept;
+
+private:
+	std::unique_ptr<ScopedLeakCheck> check_;
+	int64_t leaked_blocks_;
+	int64_t leaked_bytes_;
+};
+
+} // namespace gtest_memleak_detector
+
+#endif // GTEST_MEMLEAK_DETECTOR_BENCHMARK_H
@@ -0,0 +1,189 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+// Runs an unmodified test binary with the detector DLL loaded into it.
+//
+// Usage: gtest_memleak_detector_preload test_binary [argument...]
+//
+// The test binary is started suspended, the detector DLL located next to this
+// executable is loaded into it by a remote thread calling LoadLibrary and the
+// binary is then resumed. Arguments are passed to the test binary and the
+// exit code of the test binary is returned. The path of the launcher is
+// exported to the test binary so that child processes started by the
+// detector, e.g. failure injection sweep children, are run via the launcher.
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <cstdio>        // fprintf
+#include <cstdlib>       // EXIT_FAILURE
+#include <cstring>       // strpbrk
+#include <string>        // std::string
+
+#include "memory_leak_detector_preload.h"
+
+namespace {
+
+const char dll_name[] = "gtest_memleak_detector_preload_dll.dll";
+
+// Quotes an argument as parsed by the CRT, see "Parsing C++ command-line
+// arguments" in the MSVC documentation.
+void AppendArgument(std::string& command_line, const char* argument)
+{
+    if (!command_line.empty())
+        command_line += ' ';
+    if (*argument != '\0' && strpbrk(argument, " \t\"") == nullptr)
+    {
+        command_line += argument;
+        return;
+    }
+
+    command_line += '"';
+    size_t backslashes = 0;
+    for (const char* p = argument; ; ++p)
+    {
+        if (*p == '\\')
+        {
+            ++backslashes;
+            continue;
+        }
+        if (*p == '\0' || *p == '"')
+        {
+            // Backslashes preceding a quote are escaped
+            command_line.append(backslashes * 2 + ((*p == '"') ? 1 : 0), '\\');
+            if (*p == '\0')
+                break;
+            command_line += '"';
+        }
+        else
+        {
+            command_line.append(backslashes, '\\');
+            command_line += *p;
+        }
+        backslashes = 0;
+    }
+    command_line += '"';
+}
+
+bool GetLauncherPath(std::string& path)
+{
+    char module[MAX_PATH];
+    const auto length = GetModuleFileNameA(nullptr, module, MAX_PATH);
+    if (length == 0 || length == MAX_PATH)
+        return false;
+    path.assign(module, length);
+    return true;
+}
+
+bool GetDllPath(const std::string& launcher_path, std::string& path)
+{
+    path = launcher_path;
+    path.erase(path.find_last_of("\\/") + 1);
+    path += dll_name;
+    return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+// Loads the DLL into the process via a remote thread. Kernel32 is mapped at
+// the same address in all processes of a session, hence LoadLibraryA is too.
+bool LoadDll(HANDLE process, const std::string& path)
+{
+    const auto size = path.size() + 1;
+    auto* remote_path = VirtualAllocEx(process, nullptr, size,
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (remote_path == nullptr)
+        return false;
+
+    auto loaded = false;
+    if (WriteProcessMemory(process, remote_path, path.c_str(), size, nullptr))
+    {
+        #pragma warning( push )
+        #pragma warning( disable : 4191 ) // unsafe conversion from FARPROC
+        const auto load_library = reinterpret_cast<LPTHREAD_START_ROUTINE>(
+            GetProcAddress(GetModuleHandleA("kernel32.dll"), "LoadLibraryA"));
+        #pragma warning( pop )
+        auto* thread = CreateRemoteThread(process, nullptr, 0, load_library,
+            remote_path, 0, nullptr);
+        if (thread != nullptr)
+        {
+            DWORD module = 0; // lower 32 bits of HMODULE, zero if failed
+            (void)WaitForSingleObject(thread, INFINITE);
+            loaded = GetExitCodeThread(thread, &module) && module != 0;
+            (void)CloseHandle(thread);
+        }
+    }
+    (void)VirtualFreeEx(process, remote_path, 0, MEM_RELEASE);
+    return loaded;
+}
+
+// Terminates the test binary if the launcher is terminated, e.g. by a failure
+// injection sweep of the parent test binary. The handle is closed by the
+// system when the launcher exits.
+void KillOnExit(HANDLE process)
+{
+    auto* job = CreateJobObjectA(nullptr, nullptr);
+    if (job == nullptr)
+        return;
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+    limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+    if (!SetInformationJobObject(job, JobObjectExtendedLimitInformation, 
+        &limits, sizeof(limits)) || !AssignProcessToJobObject(job, process))
+    {
+        (void)CloseHandle(job);
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s test_binary [argument...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::string launcher_path;
+    std::string dll_path;
+    if (!GetLauncherPath(launcher_path) || !GetDllPath(launcher_path, dll_path))
+    {
+        fprintf(stderr, "%s not found next to %s\n", dll_name, argv[0]);
+        return EXIT_FAILURE;
+    }
+    // Inherited by the test binary
+    (void)SetEnvironmentVariableA(
+        gtest_memleak_detector::preload_launcher_variable, launcher_path.c_str());
+
+    std::string command_line;
+    for (int i = 1; i < argc; ++i)
+        AppendArgument(command_line, argv[i]);
+
+    STARTUPINFOA startup_info = {};
+    startup_info.cb = sizeof(startup_info);
+    PROCESS_INFORMATION process_info = {};
+    if (!CreateProcessA(nullptr, &command_line[0], nullptr, nullptr, TRUE,
+        CREATE_SUSPENDED, nullptr, nullptr, &startup_info, &process_info))
+    {
+        fprintf(stderr, "Failed to start %s (error %lu)\n", argv[1],
+            GetLastError());
+        return EXIT_FAILURE;
+    }
+
+    if (!LoadDll(process_info.hProcess, dll_path))
+    {
+        fprintf(stderr, "Failed to load %s into %s\n", dll_path.c_str(), argv[1]);
+        (void)TerminateProcess(process_info.hProcess, EXIT_FAILURE);
+        (void)CloseHandle(process_info.hThread);
+        (void)CloseHandle(process_info.hProcess);
+        return EXIT_FAILURE;
+    }
+
+    KillOnExit(process_info.hProcess);
+    (void)ResumeThread(process_info.hThread);
+    (void)WaitForSingleObject(process_info.hProcess, INFINITE);
+    DWORD exit_code = EXIT_FAILURE;
+    (void)GetExitCodeProcess(process_info.hProcess, &exit_code);
+    (void)CloseHandle(process_info.hThread);
+    (void)CloseHandle(process_info.hProcess);
+    return static_cast<int>(exit_code);
+}
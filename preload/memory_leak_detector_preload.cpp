@@ -0,0 +1,122 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+// Detector DLL loaded into unmodified test binaries by the preload launcher.
+// Registers a MemoryLeakDetectorListener when loaded, i.e. before main runs,
+// so that the binary does not need to append it or link the detector.
+//
+// The test binary must use the same Google Test DLL and the debug DLL CRT,
+// since listeners are registered with the UnitTest instance of Google Test
+// and allocations are observed via the CRT allocation hook. Hence the fast
+// path is the same allocation hook as when linking the detector.
+
+#include <gtest_memleak_detector/gtest_memleak_detector.h>
+
+#include <cstdlib>      // __argc, __argv
+#include <memory>       // std::unique_ptr
+
+namespace {
+
+// Creates the detector listener when the test program starts rather than
+// when the DLL is loaded, since the CRT has not parsed the command line yet
+// and the loader lock is held while loading.
+class PreloadListener final : public ::testing::TestEventListener
+{
+public:
+    void OnTestProgramStart(const ::testing::UnitTest& unit_test) override
+    {
+        listener_ = std::make_unique<
+            gtest_memleak_detector::MemoryLeakDetectorListener>(__argc, __argv);
+        Listener().OnTestProgramStart(unit_test);
+    }
+
+    void OnTestIterationStart(const ::testing::UnitTest& unit_test,
+        int iteration) override
+    {
+        Listener().OnTestIterationStart(unit_test, iteration);
+    }
+
+    void OnEnvironmentsSetUpStart(const ::testing::UnitTest& unit_test) override
+    {
+        Listener().OnEnvironmentsSetUpStart(unit_test);
+    }
+
+    void OnEnvironmentsSetUpEnd(const ::testing::UnitTest& unit_test) override
+    {
+        Listener().OnEnvironmentsSetUpEnd(unit_test);
+    }
+
+    void OnTestSuiteStart(const ::testing::TestSuite& test_suite) override
+    {
+        Listener().OnTestSuiteStart(test_suite);
+    }
+
+    void OnTestStart(const ::testing::TestInfo& test_info) override
+    {
+        Listener().OnTestStart(test_info);
+    }
+
+    void OnTestPartResult(const ::testing::TestPartResult& result) override
+    {
+        Listener().OnTestPartResult(result);
+    }
+
+    void OnTestEnd(const ::testing::TestInfo& test_info) override
+    {
+        Listener().OnTestEnd(test_info);
+    }
+
+    void OnTestSuiteEnd(const ::testing::TestSuite& test_suite) override
+    {
+        Listener().OnTestSuiteEnd(test_suite);
+    }
+
+    void OnEnvironmentsTearDownStart(const ::testing::UnitTest& unit_test) override
+    {
+        Listener().OnEnvironmentsTearDownStart(unit_test);
+    }
+
+    void OnEnvironmentsTearDownEnd(const ::testing::UnitTest& unit_test) override
+    {
+        Listener().OnEnvironmentsTearDownEnd(unit_test);
+    }
+
+    void OnTestIterationEnd(const ::testing::UnitTest& unit_test,
+        int iteration) override
+    {
+        Listener().OnTestIterationEnd(unit_test, iteration);
+    }
+
+    void OnTestProgramEnd(const ::testing::UnitTest& unit_test) override
+    {
+        Listener().OnTestProgramEnd(unit_test);
+        // Release before DLLs are detached on process exit
+        listener_.reset();
+    }
+
+private:
+    ::testing::TestEventListener& Listener() noexcept
+    {
+        if (listener_)
+            return *listener_;
+        return ignore_;
+    }
+
+    std::unique_ptr<gtest_memleak_detector::MemoryLeakDetectorListener> listener_;
+    ::testing::EmptyTestEventListener ignore_;
+};
+
+struct Preload
+{
+    Preload()
+    {
+        // Ownership is transferred to Google Test
+        ::testing::UnitTest::GetInstance()->listeners().Append(
+            new PreloadListener());
+    }
+};
+
+Preload preload;
+
+} // anonymous namespace
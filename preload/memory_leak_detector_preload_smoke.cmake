@@ -0,0 +1,25 @@
+# Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+# This file is subject to the license terms in the LICENSE file 
+# found in the root directory of this distribution.
+
+###################################################################################################
+# Runs a test binary via the preload launcher and checks both its output and that the exit code
+# of the test binary is returned by the launcher, which CTest cannot check in a single test.
+#
+# Usage: cmake -DLAUNCHER=path -DBINARY=path -DFILTER=filter -DEXPECTED_OUTPUT=regex
+#              -DEXPECTED_FAILURE=ON|OFF -P memory_leak_detector_preload_smoke.cmake
+execute_process(
+	COMMAND "${LAUNCHER}" "${BINARY}" "--gtest_filter=${FILTER}"
+	OUTPUT_VARIABLE output
+	ERROR_VARIABLE output
+	RESULT_VARIABLE result
+)
+message("${output}")
+if (NOT output MATCHES "${EXPECTED_OUTPUT}")
+	message(FATAL_ERROR "Output does not match \"${EXPECTED_OUTPUT}\"")
+endif()
+if (EXPECTED_FAILURE AND result EQUAL 0)
+	message(FATAL_ERROR "Exit code is 0, expected the failure of the test binary")
+elseif (NOT EXPECTED_FAILURE AND NOT result EQUAL 0)
+	message(FATAL_ERROR "Exit code is ${result}, expected 0")
+endif()
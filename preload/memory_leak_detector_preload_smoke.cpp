@@ -0,0 +1,37 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+// Unmodified test binary run via the preload launcher by the smoke tests.
+// Neither links the detector nor appends its listener.
+
+#include <gtest/gtest.h>
+
+#include <new>          // std::bad_alloc
+
+TEST(preload_smoke, leaking_test)
+{
+    auto* leak = new int(1);
+    EXPECT_EQ(*leak, 1);
+}
+
+TEST(preload_smoke, test_leaking_if_allocation_fails)
+{
+    auto* first = new int(1);
+    try
+    {
+        auto* second = new int(2);
+        delete second;
+    }
+    catch (const std::bad_alloc&)
+    {
+        return; // first is leaked
+    }
+    delete first;
+}
+
+int main(int argc, char* argv[])
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -6,8 +6,10 @@
 
 //#ifdef GTEST_MEMLEAK_DETECTOR_CRTDBG_AVAILABLE
 
+#include <chrono>   // std::chrono::steady_clock
 #include <string>   // std::string
 #include <exception>
+#include <thread>   // std::thread::hardware_concurrency
 
 #ifdef GTEST_MEMLEAK_DETECTOR_DEBUG
 #define GTEST_MEMLEAK_DETECTOR_DBGLOG(fmt, ...) \
@@ -22,8 +24,9 @@
 // This normally opaque struct is vaguely documented here:
 // https://docs.microsoft.com/en-us/visualstudio/debugger/crt-debug-heap-details?view=vs-2019
 //
-// Note that we are only interested in request counter so other fields are only
-// relevant for getting padding right.
+// Note that we are only interested in the fields up to and including the gap
+// preceding user data, other fields are only relevant for getting padding 
+// right.
 ///////////////////////////////////////////////////////////////////////////////
 
 #ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
@@ -47,100 +50,149 @@ typedef struct _CrtMemBlockHeader
     int                         nBlockUse;
 #endif  /* _WIN64 */
     long                        lRequest;
-    // Further members not necessary
+    unsigned char               gap[4]; // no man's land preceding user data
 } _CrtMemBlockHeader;
 
 } // extern "C"
 
-// Constants and locals
-extern "C" 
-{ 
-    static _CRT_ALLOC_HOOK stored_alloc_hook = NULL; 
-}
-
-static long           alloc_no = 0;
-//long                  parsed_alloc_no;
+namespace {
 
-extern "C" int GTestMemoryLeakDetector4ll0c470rh00k(
-    int nAllocType, void* pvData,
-    size_t nSize, int nBlockUse, long lRequest,
-    const unsigned char* szFileName, int nLine) noexcept
+// Visits heap blocks with first < request no <= last from most recent to 
+// least recent, starting at the given block. Only blocks that would be 
+// reported as leaks by CRTDBG are visited. Must be invoked with the CRT heap
+// lock held since other threads may free visited blocks otherwise.
+template<class Visitor>
+size_t VisitBlocks(const _CrtMemBlockHeader* header, long first, long last,
+    Visitor&& visit)
 {
-    gtest_memleak_detector::MemoryLeakDetector::Instance()->OnAllocation(
-        nAllocType, lRequest);
-
-    int result = TRUE;
-    if (stored_alloc_hook)
-    {   // Forward call to previously installed hook
-        result = stored_alloc_hook(nAllocType, pvData,
-            nSize, nBlockUse, lRequest, szFileName, nLine);
+    size_t count = 0;
+    for (; header != nullptr && header->lRequest > first;
+        header = header->pBlockHeaderNext)
+    {
+        if (header->lRequest > last)
+            continue;
+        const auto block_type = _BLOCK_TYPE(header->nBlockUse);
+        if (block_type != _NORMAL_BLOCK && block_type != _CLIENT_BLOCK)
+            continue;
+        ++count;
+        if (!visit(*header))
+            break;
     }
-    return result;
+    return count;
 }
 
-bool try_parse_alloc_no(long& dst, const char* str) noexcept // TODO Make static class function
+const _CrtMemBlockHeader* HeaderOf(const void* ptr) noexcept
 {
-    // IMPORTANT: This function must have noexcept/nothrow semantics
-    //            since indirectly called by C-run-time.
-    if (!str)
-        return false; // nullptr
-
-    const auto first = strchr(str, '{');
-    if (nullptr == first)
-        return false; // failed (format error)
+    return static_cast<const _CrtMemBlockHeader*>(ptr) - 1;
+}
 
-    const auto last = strchr(first, '}');
-    if (nullptr == last)
-        return false; // failed (format error)
+// Allocation bus subscriber of the detector, returns false on injected
+// allocation failure.
+bool OnAllocationEvent(void* context, int type, void* data, size_t size,
+    int block_use, long request, const unsigned char* file, int line)
+{
+    const gtest_memleak_detector::AllocationEvent event{
+        type, data, size, block_use, request, file, line };
+    return static_cast<gtest_memleak_detector::MemoryLeakDetector*>(
+        context)->OnAllocation(event);
+}
 
-    const auto len = last - first - 1;
-    if (len <= 0 || len > 10) // max 10 digits
-        return false; // failed (range error)
+} // anonymous namespace
 
-    // Parse allocation no as 32-bit integer, i.e.
-    // max 10 digits + termination char
-    char buffer[11]{ 0 };
-    strncpy_s(buffer, first + 1, static_cast<size_t>(len));
-    const auto value = strtol(buffer, nullptr, 10);
-    if (value == LONG_MIN || value == LONG_MAX)
-        return false; // failed
+// Constants and locals
+static long           alloc_no = 0;
 
-    dst = value;
-    return true; // success
-}
+///////////////////////////////////////////////////////////////////////////////
+// HeapBlocks
+//
+// Copy of the live heap blocks with first < request no <= last, most recent
+// first, taken with the CRT heap lock held so that blocks freed by other
+// threads, e.g. executors of the test, are never dereferenced. Visitors and
+// user callbacks are invoked on the copy after the lock is released. Storage
+// is allocated from the process heap rather than the CRT heap.
+///////////////////////////////////////////////////////////////////////////////
 
-void gtest_memleak_detector::MemoryLeakDetector::OnReport(const char* message) noexcept
+class gtest_memleak_detector::MemoryLeakDetector::HeapBlocks final
 {
-    long parsed_value;
-    if (try_parse_alloc_no(parsed_value, message))
+public:
+    struct Block
+    {
+        Leak        leak;       // identity set if allocated within the test
+        int         block_use;
+        const char* file;
+        int         line;
+    };
+
+    // Blocks linked after the given live block if any, otherwise all blocks
+    HeapBlocks(long first, long last, const MemoryLeakDetector* detector,
+        const void* after = nullptr) noexcept
+        : first_(first), last_(last), detector_(detector), after_(after)
+    {
+        (void)AllocationBus::Get().RunLocked(&HeapBlocks::Copy, this);
+    }
+
+    ~HeapBlocks() noexcept
+    {
+        if (blocks_ != nullptr)
+            (void)HeapFree(GetProcessHeap(), 0, blocks_);
+    }
+
+    HeapBlocks(const HeapBlocks&) = delete;
+    HeapBlocks(HeapBlocks&&) = delete;
+    HeapBlocks& operator=(const HeapBlocks&) = delete;
+    HeapBlocks& operator=(HeapBlocks&&) = delete;
+
+    const Block* begin() const noexcept { return blocks_; }
+    const Block* end() const noexcept { return blocks_ + size_; }
+    size_t size() const noexcept { return size_; }
+
+    const Block* Find(long request) const noexcept
     {
-        // Only parse leak originating from code exercised within test-body
-        // we do not want leak reports on e.g. Google Test framework
-        if (parsed_value > state_.pre_alloc_no && 
-            parsed_value <= state_.post_alloc_no)
+        for (const auto& block : *this)
         {
-            // Parse if within range and preceeding previously parsed leak
-            // or if this is the first parsed leak for the current test case
-            if (parsed_value < state_.parsed_alloc_no || 
-                state_.parsed_alloc_no == no_break_alloc)
-            {
-                state_.parsed_alloc_no = parsed_value;
-            }
+            if (block.leak.request == request)
+                return &block;
         }
+        return nullptr;
     }
-}
 
-extern "C" int report_callback(int reportType, char* message, int* returnValue)
-{
-    // IMPORTANT: Remember that this function must have noexcept/nothrow semantics
-    //            since indirectly called by C-run-time.
-    if (reportType == _CRT_WARN)
-        gtest_memleak_detector::MemoryLeakDetector::Instance()->OnReport(message);
+private:
+    static void Copy(void* context, const void* probe)
+    {
+        // Invoked with the CRT heap lock held, must not use the CRT heap
+        auto* self = static_cast<HeapBlocks*>(context);
+        const auto* start = HeaderOf(
+            (self->after_ != nullptr) ? self->after_ : probe)->pBlockHeaderNext;
+        const auto count = VisitBlocks(start, self->first_, self->last_,
+            [](const _CrtMemBlockHeader&) { return true; });
+        if (count == 0)
+            return;
+        self->blocks_ = static_cast<Block*>(
+            HeapAlloc(GetProcessHeap(), 0, count * sizeof(Block)));
+        if (self->blocks_ == nullptr)
+            return;
+        (void)VisitBlocks(start, self->first_, self->last_, 
+            [self](const _CrtMemBlockHeader& header)
+        {
+            auto& block = self->blocks_[self->size_++];
+            block.leak = Leak{ &header + 1, header.nDataSize, header.lRequest, 
+                0ul, StackSignature::invalid, nullptr };
+            block.block_use = header.nBlockUse;
+            block.file = header.szFileName;
+            block.line = header.nLine;
+            if (self->detector_ != nullptr) // recorded with the lock held
+                self->detector_->SetLeakIdentity(block.leak);
+            return true;
+        });
+    }
 
-    if (returnValue)
-        return *returnValue; // TODO Check what's expected
-    return TRUE;
-}
+    long        first_;
+    long        last_;
+    const MemoryLeakDetector* detector_;
+    const void* after_;
+    Block*      blocks_ = nullptr;
+    size_t      size_ = 0;
+};
 
 #endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
 
@@ -153,17 +205,24 @@ class GTestFlagSaverAllocationMitigator : public ::testing::Test
     void TestBody() override { }
 };
 
-gtest_memleak_detector::MemoryLeakDetector*
-    gtest_memleak_detector::MemoryLeakDetector::instance_ = nullptr;
+std::atomic<gtest_memleak_detector::MemoryLeakDetector*>
+    gtest_memleak_detector::MemoryLeakDetector::instance_{ nullptr };
+std::atomic<unsigned long long>
+    gtest_memleak_detector::MemoryLeakDetector::running_test_{ 0ull };
+thread_local const gtest_memleak_detector::LeakContext*
+    gtest_memleak_detector::MemoryLeakDetector::leak_context_ = nullptr;
+thread_local bool
+    gtest_memleak_detector::MemoryLeakDetector::reporting_failure_ = false;
 
 gtest_memleak_detector::MemoryLeakDetector::MemoryLeakDetector(
     int argc, char** argv) 
-    : pre_state_{ 0 }
+    : options_()
+    , pre_state_{ 0 }
     , stored_debug_flags_(0)
     , alloc_hook_set_(false)
     , fail_(nullptr)
 #ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
-    , stack_trace_()
+    , stack_trace_(files_)
 #endif
 {
     // Require binary path as first argument
@@ -172,11 +231,16 @@ gtest_memleak_detector::MemoryLeakDetector::MemoryLeakDetector(
     if (argv == nullptr)
         throw std::exception("missing command line arguments");
 
+    options_ = ParseOptions(argc, argv);
+
 #ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
     // Get test binary file info from data-base
     if (_stat(argv[0], &file_info_) == 0)
     {
         file_path_ = MakeDatabaseFilePath(argv[0]); // TODO Use individual leak files instead
+        stats_path_ = MakeProcessStatsFilePath(argv[0]);
+        if (options_.record || options_.workload)
+            trace_prefix_ = argv[0];
         if (!TryReadDatabase())
             std::remove(file_path_.c_str());
     }
@@ -196,6 +260,33 @@ gtest_memleak_detector::MemoryLeakDetector::MemoryLeakDetector(
 	// Turn on debug allocation
 	stored_debug_flags_ = _CrtSetDbgFlag(
         _CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF); 
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    // Arenas reserve their address range once, make sure that happens before
+    // virtual memory imports are redirected.
+    (void)TraceArena::Get();
+    (void)DatabaseArena::Get();
+    if (options_.virtual_memory)
+        ImportHooks::Install();
+    if (!trace_prefix_.empty())
+        (void)recorder_.Enable();
+
+    // Report to the test of the parent process if started by one. Death test
+    // children exit within the test, hence also report when exiting.
+    if (parent_.Attach())
+    {
+        static const auto registered = atexit(&ReportProcessExit) == 0;
+        (void)registered;
+    }
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+gtest_memleak_detector::MemoryLeakDetector::~MemoryLeakDetector() noexcept
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    if (options_.virtual_memory)
+        ImportHooks::Uninstall();
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
 }
 
 void gtest_memleak_detector::MemoryLeakDetector::SetFailureCallback(FailureCallback cb)
@@ -203,24 +294,338 @@ void gtest_memleak_detector::MemoryLeakDetector::SetFailureCallback(FailureCallb
     fail_ = cb;
 }
 
-std::string gtest_memleak_detector::MemoryLeakDetector::MakeFailureMessage(
+void gtest_memleak_detector::MemoryLeakDetector::SetBatchFailureCallback(
+    BatchFailureCallback cb)
+{
+    batch_fail_ = cb;
+}
+
+gtest_memleak_detector::MemoryLeakDetector::FailureMessage 
+gtest_memleak_detector::MemoryLeakDetector::MakeFailureMessage(
     long leak_alloc_no,
     const char* leak_file,
     unsigned long leak_line,
-    const char* leak_trace)
+    const char* leak_trace,
+    CaptureMode mode)
 {
     UNREFERENCED_PARAMETER(leak_file);
     UNREFERENCED_PARAMETER(leak_line);
 
-    std::stringstream ss;
-    ss << "Memory leak detected";
+    FailureMessage message;
+    message.Append("Memory leak detected");
     if (leak_alloc_no >= 0)
-        ss << " (Request: " << leak_alloc_no << ")";
+        message.Append(" (Request: ").Append(leak_alloc_no).Append(')');
+    if (mode == CaptureMode::Count)
+        message.Append(" [count mode: allocation-heavy test, identified by request no only]");
     if (leak_trace && leak_trace[0] != 0)
-        ss << " at:\n" << leak_trace;
+        message.Append(" at:\n").Append(leak_trace);
+    else
+        message.Append(". Re-run test to obtain stack-trace of the allocation causing the memory leak.");
+    return message;
+}
+
+gtest_memleak_detector::MemoryLeakDetector::FailureMessage 
+gtest_memleak_detector::MemoryLeakDetector::MakeBatchFailureMessage(
+    const char* leak_test,
+    long leak_alloc_no,
+    size_t batch_tests)
+{
+    FailureMessage message;
+    message.Append("Memory leak detected");
+    if (leak_test && leak_test[0] != 0)
+        message.Append(" in test ").Append(leak_test);
     else
-        ss << ". Re-run test to obtain stack-trace of the allocation causing the memory leak.";
-    return ss.str();
+        message.Append(" between tests");
+    message.Append(" of batch with ")
+        .Append(static_cast<unsigned long>(batch_tests))
+        .Append(" tests");
+    if (leak_alloc_no >= 0)
+        message.Append(" (Request: ").Append(leak_alloc_no).Append(')');
+    message.Append(". Re-run test to check tests individually and obtain "
+        "stack-trace of the allocation causing the memory leak.");
+    return message;
+}
+
+gtest_memleak_detector::MemoryLeakDetector::FailureMessage
+gtest_memleak_detector::MemoryLeakDetector::MakeDivergenceMessage(
+    const SequenceFingerprint::Divergence& divergence,
+    const char* trace)
+{
+    FailureMessage message;
+    message.Append("Allocation sequence differs from previous run");
+    if (divergence.first == divergence.last)
+    {
+        message.Append(" at allocation ").Append(divergence.first)
+            .Append(" of the test's allocation sequence")
+            .Append(" (size ").Append(static_cast<unsigned long>(divergence.size));
+        if (divergence.expected != 0)
+            message.Append(", previously ").Append(static_cast<unsigned long>(divergence.expected));
+        message.Append(')');
+        if (trace && trace[0] != 0)
+            return message.Append(" at:\n").Append(trace);
+        return message.Append('.');
+    }
+    message.Append(" between allocations ").Append(divergence.first)
+        .Append(" and ").Append(divergence.last)
+        .Append(" of the test's allocation sequence")
+        .Append(". Leak stack-traces of this test may not be reproducible. "
+            "Re-run test to locate the first differing allocation.");
+    return message;
+}
+
+gtest_memleak_detector::MemoryLeakDetector::FailureMessage
+gtest_memleak_detector::MemoryLeakDetector::MakeChildLeakMessage(
+    const ChildReport::Totals& totals)
+{
+    // Counters are 64-bit in shared memory but bounded by address space
+    FailureMessage message;
+    message.Append("Memory leak detected in ")
+        .Append(static_cast<unsigned long>(totals.leaked_tests)).Append(" of ")
+        .Append(static_cast<unsigned long>(totals.tests))
+        .Append(" test(s) run by child processes (")
+        .Append(static_cast<unsigned long>(totals.leaked_blocks)).Append(" blocks, ")
+        .Append(static_cast<unsigned long>(totals.leaked_bytes)).Append(" bytes). ")
+        .Append("Run the leaking child process separately to obtain stack-trace.");
+    return message;
+}
+
+gtest_memleak_detector::MemoryLeakDetector::FailureMessage
+gtest_memleak_detector::MemoryLeakDetector::MakeSweepSummary(
+    const FailureSweep::Result& result)
+{
+    FailureMessage message;
+    message.Append(static_cast<unsigned long>(result.runs)).Append(" runs, ")
+        .Append(static_cast<unsigned long>(result.passed)).Append(" passed, ")
+        .Append(static_cast<unsigned long>(result.failed)).Append(" failed, ")
+        .Append(static_cast<unsigned long>(result.leaked)).Append(" leaked, ")
+        .Append(static_cast<unsigned long>(result.crashed)).Append(" crashed");
+    return message;
+}
+
+gtest_memleak_detector::MemoryLeakDetector::FailureMessage
+gtest_memleak_detector::MemoryLeakDetector::MakeSweepLeakMessage(
+    const FailureSweep::Result& result, const char* filter)
+{
+    FailureMessage message;
+    message.Append("Memory leak detected when failing allocation ")
+        .Append(result.first_leak).Append(" of test (")
+        .Append(static_cast<unsigned long>(result.leaked)).Append(" of ")
+        .Append(static_cast<unsigned long>(result.runs))
+        .Append(" injected allocation failures leak). Re-run with --gtest_filter=")
+        .Append(filter).Append(" --memleak_fail_alloc=").Append(result.first_leak)
+        .Append(" to obtain stack-trace.");
+    return message;
+}
+
+gtest_memleak_detector::MemoryLeakDetector::FailureMessage
+gtest_memleak_detector::MemoryLeakDetector::MakeSweepCrashMessage(
+    const FailureSweep::Result& result)
+{
+    FailureMessage message;
+    message.Append("Test crashed (exit code 0x").AppendHex(result.crash_code)
+        .Append(") when failing allocation ").Append(result.first_crash)
+        .Append(" of test (").Append(static_cast<unsigned long>(result.crashed))
+        .Append(" of ").Append(static_cast<unsigned long>(result.runs))
+        .Append(" injected allocation failures crash).");
+    return message;
+}
+
+gtest_memleak_detector::MemoryLeakDetector::FailureMessage
+gtest_memleak_detector::MemoryLeakDetector::MakeScopeLeakMessage(
+    size_t blocks, size_t bytes, long first_alloc_no)
+{
+    FailureMessage message;
+    message.Append("Memory leak detected in scope (")
+        .Append(static_cast<unsigned long>(blocks)).Append(" blocks, ")
+        .Append(static_cast<unsigned long>(bytes))
+        .Append(" bytes, least recent allocation request no: ")
+        .Append(first_alloc_no).Append(").");
+    return message;
+}
+
+gtest_memleak_detector::MemoryLeakDetector::FailureMessage
+gtest_memleak_detector::MemoryLeakDetector::MakeContextLeakMessage(
+    const char* submitter, size_t blocks, size_t bytes, long first_alloc_no)
+{
+    FailureMessage message;
+    message.Append("Memory leak detected in work submitted by test ")
+        .Append(submitter)
+        .Append(" and run within its LeakContext after it ended (")
+        .Append(static_cast<unsigned long>(blocks)).Append(" blocks, ")
+        .Append(static_cast<unsigned long>(bytes))
+        .Append(" bytes, least recent allocation request no: ")
+        .Append(first_alloc_no).Append(").");
+    return message;
+}
+
+namespace {
+
+// Returns option value if arg is given option, e.g. "--memleak_x=", 
+// otherwise nullptr.
+template<size_t N>
+const char* MatchOption(const char* arg, const char(&option)[N]) noexcept
+{
+    return strncmp(arg, option, N - 1) == 0 ? arg + N - 1 : nullptr;
+}
+
+long ParseLongOption(const char* value, long min_value, const char* error)
+{
+    char* end = nullptr;
+    const auto result = strtol(value, &end, 10);
+    if (end == value || *end != 0 || result < min_value)
+        throw std::exception(error);
+    return result;
+}
+
+// Sequence fingerprint as {hash, length, checkpoints, prefix..., window,
+// sizes...} where sizes are only present if a window is kept
+void ReadSequence(std::istream& in,
+    gtest_memleak_detector::SequenceFingerprint::Baseline& sequence)
+{
+    using gtest_memleak_detector::SequenceFingerprint;
+    sequence = SequenceFingerprint::Baseline();
+    in >> sequence.hash >> sequence.length >> sequence.checkpoints;
+    if (!in || sequence.checkpoints > SequenceFingerprint::max_checkpoints)
+        throw std::exception("corrupt database entry");
+    for (size_t i = 0; i < sequence.checkpoints; ++i)
+        in >> sequence.prefix[i];
+    in >> sequence.window;
+    if (sequence.window != SequenceFingerprint::no_window)
+    {
+        for (auto& size : sequence.sizes)
+            in >> size;
+    }
+}
+
+void WriteSequence(std::ostream& out,
+    const gtest_memleak_detector::SequenceFingerprint::Baseline& sequence)
+{
+    using gtest_memleak_detector::SequenceFingerprint;
+    out << sequence.hash << ' '
+        << sequence.length << ' '
+        << sequence.checkpoints;
+    for (size_t i = 0; i < sequence.checkpoints; ++i)
+        out << ' ' << sequence.prefix[i];
+    out << ' ' << sequence.window;
+    if (sequence.window != SequenceFingerprint::no_window)
+    {
+        for (const auto size : sequence.sizes)
+            out << ' ' << size;
+    }
+}
+
+} // anonymous namespace
+
+gtest_memleak_detector::MemoryLeakDetector::Options 
+gtest_memleak_detector::MemoryLeakDetector::ParseOptions(int argc, char** argv)
+{
+    // Note that flags are intentionally not prefixed with "gtest_" since
+    // Google Test treats unrecognized flags with that prefix as errors.
+    Options options;
+    for (auto i = 1; i < argc; ++i)
+    {
+        const auto* arg = argv[i];
+        if (arg == nullptr)
+            continue;
+
+        const char* value = nullptr;
+        if ((value = MatchOption(arg, "--memleak_identity=")) != nullptr)
+        {
+            if (strcmp(value, "signature") == 0)
+                options.identity = IdentityMode::Signature;
+            else if (strcmp(value, "request") == 0)
+                options.identity = IdentityMode::Request;
+            else
+                throw std::exception("invalid --memleak_identity value");
+        }
+        else if ((value = MatchOption(arg, "--memleak_break_window=")) != nullptr)
+        {
+            options.break_window = ParseLongOption(value, 1, 
+                "invalid --memleak_break_window value");
+        }
+        else if (strcmp(arg, "--memleak_growth") == 0)
+        {
+            options.growth = true;
+        }
+        else if ((value = MatchOption(arg, "--memleak_growth_min_iterations=")) != nullptr)
+        {
+            options.growth = true;
+            options.growth_min_iterations = ParseLongOption(value, 2,
+                "invalid --memleak_growth_min_iterations value");
+        }
+        else if (strcmp(arg, "--memleak_process_stats") == 0)
+        {
+            options.process_stats = true;
+        }
+        else if (strcmp(arg, "--memleak_lifetime") == 0)
+        {
+            options.lifetime = true;
+        }
+        else if (strcmp(arg, "--memleak_child_processes") == 0)
+        {
+            options.children = true;
+        }
+        else if ((value = MatchOption(arg, "--memleak_quiescence=")) != nullptr)
+        {
+            options.quiescence_timeout = ParseLongOption(value, 1,
+                "invalid --memleak_quiescence value");
+        }
+        else if ((value = MatchOption(arg, "--memleak_quiescence_window=")) != nullptr)
+        {
+            options.quiescence_window = ParseLongOption(value, 1,
+                "invalid --memleak_quiescence_window value");
+        }
+        else if ((value = MatchOption(arg, "--memleak_quiescence_condition=")) != nullptr)
+        {
+            if (strcmp(value, "any") == 0)
+                options.quiescence_condition = QuiescenceCondition::Any;
+            else if (strcmp(value, "all") == 0)
+                options.quiescence_condition = QuiescenceCondition::All;
+            else
+                throw std::exception("invalid --memleak_quiescence_condition value");
+        }
+        else if ((value = MatchOption(arg, "--memleak_trace_limit=")) != nullptr)
+        {
+            options.trace_limit = ParseLongOption(value, 1,
+                "invalid --memleak_trace_limit value");
+        }
+        else if ((value = MatchOption(arg, "--memleak_fail_alloc=")) != nullptr)
+        {
+            options.fail_alloc = ParseLongOption(value, 1,
+                "invalid --memleak_fail_alloc value");
+        }
+        else if (strcmp(arg, "--memleak_fail_sweep") == 0)
+        {
+            options.fail_sweep = true;
+        }
+        else if ((value = MatchOption(arg, "--memleak_fail_sweep_max=")) != nullptr)
+        {
+            options.fail_sweep = true;
+            options.fail_sweep_max = ParseLongOption(value, 1,
+                "invalid --memleak_fail_sweep_max value");
+        }
+        else if (strcmp(arg, "--memleak_record") == 0)
+        {
+            options.record = true;
+        }
+        else if (strcmp(arg, "--memleak_workload") == 0)
+        {
+            options.workload = true;
+        }
+        else if (strcmp(arg, "--memleak_track_virtual_memory") == 0)
+        {
+            options.virtual_memory = true;
+        }
+        else if ((value = MatchOption(arg, "--memleak_batch=")) != nullptr)
+        {
+            if (strcmp(value, "suite") == 0)
+                options.batch_size = batch_per_suite;
+            else
+                options.batch_size = ParseLongOption(value, 1,
+                    "invalid --memleak_batch value");
+        }
+    }
+    return options;
 }
 
 std::string gtest_memleak_detector::MemoryLeakDetector::MakeDatabaseFilePath(
@@ -233,6 +638,37 @@ std::string gtest_memleak_detector::MemoryLeakDetector::MakeDatabaseFilePath(
     return path;
 }
 
+std::string gtest_memleak_detector::MemoryLeakDetector::MakeTraceFilePath(
+    const char* binary_file_path, const char* test)
+{
+    if (!binary_file_path || !test)
+        throw std::exception();
+    std::string path = binary_file_path;
+    path += '.';
+    for (auto* c = test; *c != 0; ++c)
+        path += isalnum(static_cast<unsigned char>(*c)) ? *c : '_';
+    path += ".gt.memtrace";
+    return path;
+}
+
+std::string gtest_memleak_detector::MemoryLeakDetector::MakeWorkloadFilePath(
+    const char* binary_file_path, const char* test)
+{
+    auto path = MakeTraceFilePath(binary_file_path, test);
+    path.replace(path.size() - strlen("memtrace"), std::string::npos, "workload");
+    return path;
+}
+
+std::string gtest_memleak_detector::MemoryLeakDetector::MakeProcessStatsFilePath(
+    const char* binary_file_path)
+{
+    if (!binary_file_path)
+        throw std::exception();
+    std::string path = binary_file_path;
+    path += ".gt.memstats";
+    return path;
+}
+
 bool gtest_memleak_detector::MemoryLeakDetector::ReadDatabase()
 {
 #ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
@@ -268,14 +704,23 @@ bool gtest_memleak_detector::MemoryLeakDetector::ReadDatabase()
     in >> size;
     db_.reserve(size);
 
-    // Parse {description, leak_alloc_no} pairs
+    // Parse {description, {leak_alloc_no, signature, ordinal, size, 
+    // fingerprint, annotation, mode, isolate, sequence}} pairs
     std::string name;
-    long leak_alloc_no;
+    DatabaseEntry entry;
+    int mode;
     for (auto i = 0u; i < size; ++i)
     {
         in >> name;
-        in >> leak_alloc_no;
-        db_.emplace(name, leak_alloc_no);
+        in >> entry.alloc_no >> entry.signature >> entry.ordinal >> entry.size 
+            >> entry.fingerprint >> entry.annotation >> mode >> entry.isolate;
+        if (!in || mode < 0 || mode > static_cast<int>(CaptureMode::Count))
+            throw std::exception("corrupt database entry");
+        ReadSequence(in, entry.sequence);
+        entry.mode = static_cast<CaptureMode>(mode);
+        if (entry.isolate)
+            ++isolated_;
+        db_.emplace(DatabaseString(name.c_str(), name.size()), entry);
     }
 
     GTEST_MEMLEAK_DETECTOR_DBGLOG("Database: %s", "Success");
@@ -320,166 +765,969 @@ void gtest_memleak_detector::MemoryLeakDetector::WriteDatabase()
         << file_info_.st_mtime << '\n'
         << db_.size() << '\n';
     for (auto& kvp : db_)
-        out << kvp.first << '\n' << kvp.second << '\n';
+    {
+        const auto& entry = kvp.second;
+        out << kvp.first << '\n' 
+            << entry.alloc_no << ' ' 
+            << entry.signature << ' ' 
+            << entry.ordinal << ' ' 
+            << entry.size << ' '
+            << entry.fingerprint << ' '
+            << entry.annotation << ' '
+            << static_cast<int>(entry.mode) << ' '
+            << entry.isolate << ' ';
+        WriteSequence(out, entry.sequence);
+        out << '\n';
+    }
     out.flush();
     out.close();
 #endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
 }
 
-//void gtest_memleak_detector::MemoryLeakDetector::WriteLeakFile(long leak_alloc_no)
-//{
-//    std::ofstream out;
-//    out.open("MemoryLeaks/" + hash_)
-//}
+void gtest_memleak_detector::MemoryLeakDetector::WriteGrowthReport(FILE* out) const
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    if (!options_.growth)
+        return;
+    const auto count = growth_.Report(out, files_, options_.growth_min_iterations);
+    fprintf(out, "[ MEMLEAK  ] %zu test(s) with growing memory\n", count);
+#else
+    UNREFERENCED_PARAMETER(out);
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
 
+void gtest_memleak_detector::MemoryLeakDetector::WriteLifetimeReport(FILE* out) const
+{
 #ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    if (!options_.lifetime)
+        return;
+    for (const auto& kvp : lifetime_log_)
+        LifetimeProfile::Write(out, kvp.first.c_str(), kvp.second);
+    fprintf(out, "[ MEMLEAK  ] %zu test(s) with short-lived allocations\n", 
+        lifetime_log_.size());
+#else
+    UNREFERENCED_PARAMETER(out);
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
 
-void gtest_memleak_detector::MemoryLeakDetector::CaptureLeakStackTrace()
+void gtest_memleak_detector::MemoryLeakDetector::WriteLeakSummary(FILE* out) const
 {
-    try 
-    {
-        state_.discard = true;
-        state_.pre_trace_no = alloc_no;
-        stack_trace_.Reset(); // TODO Guard against different thread
-        stack_trace_.ShowCallstack();
-        state_.post_trace_no = alloc_no;
-        state_.discard = false;
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    (void)summary_.Write(out, std::thread::hardware_concurrency());
+#else
+    UNREFERENCED_PARAMETER(out);
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
 
-        switch (stack_trace_.CurrentState())
-        {
-        case StackTrace::State::Completed:
-            SetTrace(stack_trace_.GetLocation(), stack_trace_.Stream().str());
-            break;
-        case StackTrace::State::Capture:
-        case StackTrace::State::Scanning:
-        case StackTrace::State::Exception:
-        default:
-            break;
-        }
-    }
-    catch (...)
+void gtest_memleak_detector::MemoryLeakDetector::WriteProcessStats() const
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    if (!options_.process_stats || stats_path_.empty())
+        return;
+    std::ofstream out;
+    out.open(stats_path_);
+    out << "test working_set_delta peak_working_set peak_working_set_delta "
+           "page_faults committed_pages\n";
+    for (const auto& kvp : process_log_)
     {
-        // Ignore
+        const auto& stats = kvp.second;
+        out << kvp.first << ' '
+            << stats.working_set_delta << ' '
+            << stats.peak_working_set << ' '
+            << stats.peak_working_set_delta << ' '
+            << stats.page_faults << ' '
+            << stats.committed_pages << '\n';
     }
+    out.flush();
+    out.close();
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
 }
 
-#ifdef GTEST_MEMLEAK_DETECTOR_DEBUG
+bool gtest_memleak_detector::MemoryLeakDetector::ProcessStatsEnabled() const noexcept
+{
+    return options_.process_stats;
+}
 
-void gtest_memleak_detector::MemoryLeakDetector::LogStackTrace()
+bool gtest_memleak_detector::MemoryLeakDetector::GrowthEnabled() const noexcept
 {
-    state_.discard = true;
-    try 
-    {
-        stack_trace_.Reset();
-        stack_trace_.ShowCallstack();
-        Log("%s", stack_trace_.Stream().str().c_str());
-    }
-    catch (...)
-    {
-        ResetDebugBuffer();
-    }
-    state_.discard = false;
+    return options_.growth;
 }
 
-#endif GTEST_MEMLEAK_DETECTOR_DEBUG
+bool gtest_memleak_detector::MemoryLeakDetector::LifetimeEnabled() const noexcept
+{
+    return options_.lifetime;
+}
 
-void gtest_memleak_detector::MemoryLeakDetector::OnAllocation(
-    int nAllocType, long lRequest)
+bool gtest_memleak_detector::MemoryLeakDetector::ChildProcessesEnabled() const noexcept
 {
-    switch (nAllocType)
-    {
-    case _HOOK_ALLOC:
-    case _HOOK_REALLOC:
-        alloc_no = lRequest;
-        if (state_.discard)
-            break;
-        GTEST_MEMLEAK_DETECTOR_DBGLOG("# alloc_no: %ld, relative_no: %ld\n", 
-            alloc_no, alloc_no - gtest_memleak_detector::MemoryLeakDetector::state_.pre_alloc_no);
-#if defined(GTEST_MEMLEAK_DETECTOR_DEBUG) && defined(GTEST_MEMLEAK_DETECTOR_DEBUG_TRACE_ALLOC)
-        LogStackTrace();
-#endif
-        if (lRequest == state_.break_alloc)
-            CaptureLeakStackTrace();
-        break;
-    case _HOOK_FREE: // fall-through
-    default:
-        break;
-    }
+    return options_.children;
 }
 
-#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+bool gtest_memleak_detector::MemoryLeakDetector::QuiescenceEnabled() const noexcept
+{
+    return options_.quiescence_timeout > 0;
+}
 
-void gtest_memleak_detector::MemoryLeakDetector::SetAllocHook()
+long gtest_memleak_detector::MemoryLeakDetector::QuiescenceTimeout() const noexcept
 {
-#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
-    assert(alloc_hook_set_ == false);
-    stored_alloc_hook = _CrtSetAllocHook(GTestMemoryLeakDetector4ll0c470rh00k);
-    alloc_hook_set_ = true;
-#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    return options_.quiescence_timeout;
 }
 
-void gtest_memleak_detector::MemoryLeakDetector::RevertAllocHook()
+bool gtest_memleak_detector::MemoryLeakDetector::FailureInjectionEnabled() const noexcept
 {
-#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
-    assert(alloc_hook_set_ == true);
-    // "warning C5039: '_CrtSetAllocHook', false positive
-    // Currently no known approach to avoid this.
-    // stored_alloc_hook should not throw since C API
-    #pragma warning( push )            
-    #pragma warning( disable : 5039 ) 
-    (void)_CrtSetAllocHook(stored_alloc_hook); 
-    #pragma warning( pop )
-    alloc_hook_set_ = false;
-#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    return options_.fail_alloc > 0;
 }
 
-void gtest_memleak_detector::MemoryLeakDetector::SetTrace(
-    const Location& location, std::string stack_trace)
+size_t gtest_memleak_detector::MemoryLeakDetector::LeakCount() const noexcept
 {
-    location_ = location;
-    trace_ = std::move(stack_trace);
+    return summary_.Size();
 }
 
-void gtest_memleak_detector::MemoryLeakDetector::Start(
-    std::function<std::string()> descriptor)
+const gtest_memleak_detector::LeakSummary& 
+gtest_memleak_detector::MemoryLeakDetector::GetLeakSummary() const noexcept
+{
+    return summary_;
+}
+
+bool gtest_memleak_detector::MemoryLeakDetector::SweepEnabled() const noexcept
+{
+    // Children inject failures themselves and must not sweep recursively
+    return options_.fail_sweep && options_.fail_alloc == 0;
+}
+
+gtest_memleak_detector::FailureSweep::Result 
+gtest_memleak_detector::MemoryLeakDetector::SweepAllocationFailures(
+    const char* test_filter) const
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    // Request no range of the most recent test excluding the sync probe
+    const auto allocations = (std::min)(
+        state_.post_alloc_no - state_.pre_alloc_no, options_.fail_sweep_max);
+    return FailureSweep::Run(test_filter, allocations, 
+        std::thread::hardware_concurrency());
+#else
+    UNREFERENCED_PARAMETER(test_filter);
+    return FailureSweep::Result();
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+gtest_memleak_detector::MemoryLeakDetector::CaptureMode
+gtest_memleak_detector::MemoryLeakDetector::GetCaptureMode() const noexcept
+{
+    return state_.mode;
+}
+
+const gtest_memleak_detector::ProcessMemory::Stats& 
+gtest_memleak_detector::MemoryLeakDetector::GetProcessStats() const noexcept
+{
+    return process_stats_;
+}
+
+const gtest_memleak_detector::LifetimeProfile::Profile&
+gtest_memleak_detector::MemoryLeakDetector::GetLifetimeProfile() const noexcept
+{
+    return lifetime_.Get();
+}
+
+const gtest_memleak_detector::MemoryLeakDetector::FailureMessage&
+gtest_memleak_detector::MemoryLeakDetector::GetDivergenceMessage() const noexcept
+{
+    return divergence_;
+}
+
+const gtest_memleak_detector::MemoryLeakDetector::FailureMessage&
+gtest_memleak_detector::MemoryLeakDetector::GetContextLeakMessage() const noexcept
+{
+    return context_leak_;
+}
+
+size_t gtest_memleak_detector::MemoryLeakDetector::ForeignOverflow() const noexcept
+{
+    return foreign_.dropped;
+}
+
+size_t gtest_memleak_detector::MemoryLeakDetector::AnnotationOverflow() const noexcept
+{
+    return annotated_.Dropped();
+}
+
+size_t gtest_memleak_detector::MemoryLeakDetector::TraceOverflow() const noexcept
+{
+    return recorder_.Enabled() ? recorder_.DroppedThreads() : 0u;
+}
+
+const gtest_memleak_detector::ChildReport::Totals&
+gtest_memleak_detector::MemoryLeakDetector::GetChildTotals() const noexcept
+{
+    return child_totals_;
+}
+
+const gtest_memleak_detector::MemoryLeakDetector::Quiescence&
+gtest_memleak_detector::MemoryLeakDetector::GetQuiescence() const noexcept
+{
+    return quiescence_;
+}
+
+//void gtest_memleak_detector::MemoryLeakDetector::WriteLeakFile(long leak_alloc_no)
+//{
+//    std::ofstream out;
+//    out.open("MemoryLeaks/" + hash_)
+//}
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+bool gtest_memleak_detector::MemoryLeakDetector::CaptureStackTrace()
+{
+    try 
+    {
+        // Trace buffers are arena-backed but StackWalker and DbgHelp still 
+        // allocate internally while walking the stack, discard those.
+        state_.discard = true;
+        state_.pre_trace_no = alloc_no;
+        stack_trace_.Reset(); // TODO Guard against different thread
+        stack_trace_.ShowCallstack();
+        state_.post_trace_no = alloc_no;
+        state_.discard = false;
+
+        switch (stack_trace_.CurrentState())
+        {
+        case StackTrace::State::Completed:
+            return true;
+        case StackTrace::State::Capture:
+        case StackTrace::State::Scanning:
+        case StackTrace::State::Exception:
+        default:
+            break;
+        }
+    }
+    catch (...)
+    {
+        // Ignore
+    }
+    return false;
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::CaptureLeakStackTrace()
+{
+    if (CaptureStackTrace())
+        SetTrace(stack_trace_.GetLocation(), stack_trace_.GetBuffer().c_str());
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::CaptureDivergenceStackTrace()
+{
+    if (CaptureStackTrace())
+    {
+        const auto& buffer = stack_trace_.GetBuffer();
+        divergence_trace_.clear();
+        divergence_trace_.Append(buffer.c_str(), buffer.size());
+    }
+}
+
+#ifdef GTEST_MEMLEAK_DETECTOR_DEBUG
+
+void gtest_memleak_detector::MemoryLeakDetector::LogStackTrace()
+{
+    state_.discard = true;
+    try 
+    {
+        stack_trace_.Reset();
+        stack_trace_.ShowCallstack();
+        Log("%s", stack_trace_.GetBuffer().c_str());
+    }
+    catch (...)
+    {
+        ResetDebugBuffer();
+    }
+    state_.discard = false;
+}
+
+#endif GTEST_MEMLEAK_DETECTOR_DEBUG
+
+uint32_t gtest_memleak_detector::AllocationEvent::MakeFingerprint(
+    int block_use, const unsigned char* file, int line) noexcept
+{
+    auto hash = 2166136261u; // FNV-1a
+    const auto mix = [&hash](unsigned value) 
+    {
+        hash ^= value;
+        hash *= 16777619u;
+    };
+    mix(static_cast<unsigned>(block_use));
+    mix(static_cast<unsigned>(line));
+    if (file != nullptr)
+    {
+        for (auto* p = file; *p != 0; ++p)
+            mix(*p);
+    }
+    return hash;
+}
+
+bool gtest_memleak_detector::MemoryLeakDetector::MatchesBreakType(
+    const AllocationEvent& event) const noexcept
+{
+    if (state_.break_size == 0)
+        return true; // unknown, e.g. leak recorded without block info
+    return event.size == state_.break_size &&
+        AllocationEvent::MakeFingerprint(event.block_use, event.file, event.line) ==
+            state_.break_fingerprint;
+}
+
+bool gtest_memleak_detector::MemoryLeakDetector::IsBreakAllocation(
+    const AllocationEvent& event) noexcept
+{
+    // Only trace an allocation matching the recorded size and type. If the
+    // allocation at the recorded request no do not match, e.g. due to 
+    // shuffling or filtering, scan forward within a bounded window.
+    if (state_.break_found || state_.break_alloc == no_break_alloc)
+        return false;
+    if (state_.break_size == 0)
+        return event.request == state_.break_alloc;
+    if (event.request < state_.break_alloc ||
+        event.request - state_.break_alloc >= options_.break_window)
+        return false;
+    if (!MatchesBreakType(event))
+        return false;
+    state_.break_found = true;
+    return true;
+}
+
+bool gtest_memleak_detector::MemoryLeakDetector::SetLeakBlockInfo(
+    DatabaseEntry& entry, const HeapBlocks& blocks, long leak_alloc_no) const noexcept
+{
+    // Returns true if the block has a source file, i.e. _CRTDBG_MAP_ALLOC
+    const auto* block = blocks.Find(leak_alloc_no);
+    if (block == nullptr)
+        return false;
+    entry.size = block->leak.size;
+    entry.fingerprint = AllocationEvent::MakeFingerprint(block->block_use,
+        reinterpret_cast<const unsigned char*>(block->file), block->line);
+    return block->file != nullptr;
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::SampleGrowth(
+    const DatabaseString& key, const _CrtMemState& diff)
+{
+    const auto delta_bytes = 
+        static_cast<int64_t>(diff.lSizes[_NORMAL_BLOCK]) + 
+        static_cast<int64_t>(diff.lSizes[_CLIENT_BLOCK]);
+    const auto delta_blocks = 
+        static_cast<int64_t>(diff.lCounts[_NORMAL_BLOCK]) + 
+        static_cast<int64_t>(diff.lCounts[_CLIENT_BLOCK]);
+    auto& trend = growth_.Sample(key, delta_bytes, delta_blocks);
+
+    // Attribute blocks allocated and retained by this test to call sites.
+    // Only blocks more recent than the test start are visited.
+    const HeapBlocks blocks(state_.pre_alloc_no, LONG_MAX, this);
+    for (const auto& block : blocks)
+    {
+        auto file = FileTable::invalid_id;
+        auto signature = StackSignature::invalid;
+        if (block.file != nullptr)
+            file = files_.Intern(block.file);
+        else
+            signature = block.leak.stack;
+        trend.AddSite(file, static_cast<unsigned long>(block.line), 
+            signature, block.leak.size);
+    }
+}
+
+bool gtest_memleak_detector::MemoryLeakDetector::RecordIdentity(
+    const AllocationEvent& event) noexcept
+{
+    // Record {signature, ordinal, size} of every allocation so that the 
+    // identity of a leak can be looked up from its request no in End().
+    try
+    {
+        const auto signature = StackSignature::Capture();
+        uint32_t ordinal;
+        if (!signatures_.Next(signature, ordinal))
+            return false; // too many unique signatures
+
+        const auto index = static_cast<size_t>(event.request - state_.pre_alloc_no);
+        if (index >= allocations_.size())
+            allocations_.resize(index + 1, AllocationRecord{});
+        allocations_[index] = AllocationRecord{ 
+            signature, ordinal, GetCurrentThreadId() };
+
+        return signature == state_.break_signature &&
+            ordinal == state_.break_ordinal &&
+            MatchesBreakType(event);
+    }
+    catch (...)
+    {
+        return false; // arena exhausted, identity not available
+    }
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::RecordEvent(
+    const AllocationEvent& event) noexcept
+{
+    const auto block_type = _BLOCK_TYPE(event.block_use);
+    if (block_type != _NORMAL_BLOCK && block_type != _CLIENT_BLOCK)
+        return;
+
+    TraceEvent record{};
+    record.timestamp = EventRecorder::Timestamp();
+    record.thread = GetCurrentThreadId();
+    if (event.data != nullptr)
+    {   // Block freed or reallocated
+        const auto* header = HeaderOf(event.data);
+        record.address = reinterpret_cast<uintptr_t>(event.data);
+        record.freed = header->nDataSize;
+        record.previous = header->lRequest;
+    }
+    if (event.type != _HOOK_FREE)
+    {
+        record.size = event.size;
+        record.request = event.request;
+        if (state_.mode == CaptureMode::Trace)
+            record.stack = StackSignature::Capture();
+    }
+    recorder_.Push(record);
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::ProfileLifetime(
+    const AllocationEvent& event) noexcept
+{
+    const auto block_type = _BLOCK_TYPE(event.block_use);
+    if (block_type != _NORMAL_BLOCK && block_type != _CLIENT_BLOCK)
+        return;
+
+    const auto timestamp = EventRecorder::Timestamp();
+    if (event.data != nullptr)
+    {   // Block freed or reallocated, a realloc request itself is not counted
+        const auto last_request = (event.type == _HOOK_FREE) ? 
+            alloc_no : event.request - 1;
+        lifetime_.OnFree(HeaderOf(event.data)->lRequest, last_request, timestamp);
+    }
+    if (event.type != _HOOK_FREE)
+    {
+        lifetime_.OnAllocation(event.request, event.size, 
+            (state_.mode == CaptureMode::Trace) ? 
+                StackSignature::Capture() : StackSignature::invalid, timestamp);
+    }
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::SampleAllocationRate() noexcept
+{
+    // Allocation-heavy test, only count for the remainder of it if the last
+    // window was allocated faster than the limit. Growth attributes every
+    // retained block to its call-site and is therefore never downgraded.
+    if (options_.growth)
+        return;
+    const auto now = EventRecorder::Timestamp();
+    const auto elapsed = now - state_.rate_window_start;
+    state_.rate_window_start = now;
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    if (static_cast<double>(trace_rate_window) * 
+        static_cast<double>(frequency.QuadPart) > 
+        static_cast<double>(options_.trace_limit) * static_cast<double>(elapsed))
+    {
+        state_.rate_exceeded = true;
+        state_.mode = CaptureMode::Count;
+    }
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::TrackInFlight(
+    const AllocationEvent& event) noexcept
+{
+    // Invoked with the CRT heap lock held, atomics are only for End to read
+    const auto block_type = _BLOCK_TYPE(event.block_use);
+    if (block_type != _NORMAL_BLOCK && block_type != _CLIENT_BLOCK)
+        return;
+    auto in_flight = in_flight_.load(std::memory_order_relaxed);
+    if (event.data != nullptr)
+    {   // Block freed or reallocated, only blocks of this test are counted
+        const auto request = HeaderOf(event.data)->lRequest;
+        if (request > state_.pre_alloc_no && foreign_.Find(request) == nullptr)
+            --in_flight;
+    }
+    if (event.type != _HOOK_FREE)
+        ++in_flight;
+    in_flight_.store(in_flight, std::memory_order_relaxed);
+    activity_.store(activity_.load(std::memory_order_relaxed) + 1u, 
+        std::memory_order_relaxed);
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::WaitForQuiescence() noexcept
+{
+    // Wait until all blocks of the test are freed, or until the heap has been
+    // idle for a window or registered executors are idle, but at most for
+    // the timeout. With the All condition both are required, and executors
+    // are only considered with Any if at least one is registered.
+    using Clock = std::chrono::steady_clock;
+    quiescence_ = Quiescence();
+    if (options_.quiescence_timeout <= 0)
+        return;
+    const auto start = Clock::now();
+    const auto timeout = std::chrono::milliseconds(options_.quiescence_timeout);
+    const auto window = std::chrono::milliseconds(options_.quiescence_window);
+    auto activity = activity_.load(std::memory_order_relaxed);
+    auto idle_since = start;
+    for (auto now = start; in_flight_.load(std::memory_order_relaxed) > 0; 
+        now = Clock::now())
+    {
+        const auto current = activity_.load(std::memory_order_relaxed);
+        if (current != activity)
+        {
+            activity = current;
+            idle_since = now;
+        }
+        const auto stable = now - idle_since >= window;
+        auto& executors = ExecutorRegistry::Get();
+        if (options_.quiescence_condition == QuiescenceCondition::All ?
+            stable && executors.Idle() :
+            stable || (executors.Count() != 0 && executors.Idle()))
+        {
+            break;
+        }
+        if (now - start >= timeout)
+        {
+            quiescence_.timed_out = true;
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    quiescence_.milliseconds = static_cast<long>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            Clock::now() - start).count());
+}
+
+bool gtest_memleak_detector::MemoryLeakDetector::OnAllocation(
+    const AllocationEvent& event)
+{
+    switch (event.type)
+    {
+    case _HOOK_ALLOC:
+    case _HOOK_REALLOC:
+        alloc_no = event.request;
+        if (state_.discard)
+            break;
+        GTEST_MEMLEAK_DETECTOR_DBGLOG("# alloc_no: %ld, relative_no: %ld\n", 
+            alloc_no, alloc_no - gtest_memleak_detector::MemoryLeakDetector::state_.pre_alloc_no);
+#if defined(GTEST_MEMLEAK_DETECTOR_DEBUG) && defined(GTEST_MEMLEAK_DETECTOR_DEBUG_TRACE_ALLOC)
+        LogStackTrace();
+#endif
+        if (!armed_.load(std::memory_order_acquire))
+            break;
+        if (reporting_failure_)
+        {   // Retained by the result of the test, not leaked by it
+            (void)reported_.Push(event.request, 
+                running_test_.load(std::memory_order_relaxed));
+            break;
+        }
+        if (leak_context_ != nullptr && 
+            leak_context_->Test() != running_test_.load(std::memory_order_relaxed))
+        {   // Charged to another test, e.g. by work outliving its test
+            (void)foreign_.Push(event.request, leak_context_->Test());
+            break;
+        }
+        if (options_.fail_alloc > 0 && !state_.fail_injected &&
+            event.request - state_.pre_alloc_no == options_.fail_alloc)
+        {   // Fail once since a failed request do not advance request no
+            state_.fail_injected = true;
+            return false;
+        }
+        if (options_.quiescence_timeout > 0)
+            TrackInFlight(event);
+        if (recorder_.Enabled())
+            RecordEvent(event);
+        if (options_.lifetime)
+            ProfileLifetime(event);
+        if (sequence_.Add(event.size))
+            CaptureDivergenceStackTrace();
+        if ((event.request - state_.pre_alloc_no) % trace_rate_window == 0)
+            SampleAllocationRate();
+        if (state_.mode == CaptureMode::Trace)
+        {   // Thread and call-site of every allocation are recorded for
+            // Leak, the identity tuple is only matched in signature mode and
+            // falls back to request no if unknown
+            const auto match = RecordIdentity(event);
+            const auto by_request = 
+                options_.identity != IdentityMode::Signature ||
+                state_.break_signature == StackSignature::invalid;
+            if ((options_.identity == IdentityMode::Signature && match) ||
+                (by_request && IsBreakAllocation(event)))
+            {
+                CaptureLeakStackTrace();
+            }
+        }
+        else if (IsBreakAllocation(event))
+        {
+            CaptureLeakStackTrace();
+        }
+        break;
+    case _HOOK_FREE:
+        if (!armed_.load(std::memory_order_acquire) || state_.discard)
+            break;
+        if (options_.quiescence_timeout > 0)
+            TrackInFlight(event);
+        if (recorder_.Enabled())
+            RecordEvent(event);
+        if (options_.lifetime)
+            ProfileLifetime(event);
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::OnAnnotatedAllocation(
+    const void* pool, const void* ptr, size_t size) noexcept
+{
+    // Annotated by any thread, the state of the test is published by arming
+    if (!armed_.load(std::memory_order_acquire))
+        return;
+
+    // Annotated blocks cannot advance the CRT request counter so they are
+    // numbered by a separate sequence relative to the test start.
+    const auto request = annotation_no_.fetch_add(1, std::memory_order_relaxed) + 1;
+    (void)annotated_.Insert(AnnotationTable::Block{ 
+        ptr, pool, size, request, GetCurrentThreadId() });
+    if (request == state_.break_annotation &&
+        (state_.break_size == 0 || size == state_.break_size))
+    {   // A test traces either a heap or an annotated block so the capture
+        // never runs concurrently with one from the allocation hook
+        try
+        {
+            CaptureLeakStackTrace();
+        }
+        catch (...)
+        {
+            // Ignore, arena exhausted
+        }
+    }
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::OnAnnotatedFree(
+    const void* pool, const void* ptr) noexcept
+{
+    if (!armed_.load(std::memory_order_acquire))
+        return;
+    annotated_.Erase(pool, ptr);
+}
+
+size_t gtest_memleak_detector::MemoryLeakDetector::FindAnnotatedLeak(
+    DatabaseEntry& entry, uint64_t& bytes) const
+{
+    // Report the least recent block similar to heap leaks
+    bytes = 0;
+    auto found = false;
+    return ForEachAnnotatedLeak([&](const Leak& leak)
+    {
+        if (!found || leak.request < entry.annotation)
+        {
+            entry.annotation = leak.request;
+            entry.size = leak.size;
+            found = true;
+        }
+        bytes += leak.size;
+        return true;
+    });
+}
+
+size_t gtest_memleak_detector::MemoryLeakDetector::ForEachHeapLeak(
+    const HeapBlocks& blocks, const LeakCallback& callback) const
+{
+    // Blocks are copied from most recent to least recent within the test.
+    // Blocks charged to other tests via LeakContext and blocks retained by
+    // results of failures reported by the test are skipped.
+    size_t count = 0;
+    for (const auto& block : blocks)
+    {
+        if (foreign_.Find(block.leak.request) != nullptr ||
+            reported_.Find(block.leak.request) != nullptr)
+        {
+            continue;
+        }
+        ++count;
+        if (!callback(block.leak))
+            break;
+    }
+    return count;
+}
+
+bool gtest_memleak_detector::MemoryLeakDetector::ForeignLog::Push(
+    long request, unsigned long long test) noexcept
+{
+    // Invoked with the CRT heap lock held, hence in increasing request order
+    if (size == capacity)
+    {
+        ++dropped;
+        return false;
+    }
+    entries[size++] = Entry{ request, test };
+    return true;
+}
+
+const gtest_memleak_detector::MemoryLeakDetector::ForeignLog::Entry*
+gtest_memleak_detector::MemoryLeakDetector::ForeignLog::Find(
+    long request) const noexcept
+{
+    const auto* last = entries + size;
+    const auto* it = std::lower_bound(entries, last, request,
+        [](const Entry& entry, long value) { return entry.request < value; });
+    return (it != last && it->request == request) ? it : nullptr;
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::FailureReporter::
+    ReportTestPartResult(const ::testing::TestPartResult& result)
+{
+    // Forwarded to the previous reporter of the test thread which records
+    // the result. Failures reported by other threads are not marked.
+    reporting_failure_ = true;
+    try
+    {
+        HasNewFatalFailureHelper::ReportTestPartResult(result);
+    }
+    catch (...)
+    {
+        reporting_failure_ = false;
+        throw;
+    }
+    reporting_failure_ = false;
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::ChargeForeignLeaks()
+{
+    // Blocks allocated within the context of an ended test and still alive
+    // when the running test ends are leaks of the submitting test. This is
+    // the last check covering them since the next test starts after them.
+    const HeapBlocks heap(state_.pre_alloc_no, state_.post_alloc_no, nullptr);
+    const ForeignLog::Entry* first = nullptr;
+    size_t blocks = 0;
+    size_t bytes = 0;
+    for (const auto& block : heap)
+    {
+        const auto* entry = foreign_.Find(block.leak.request);
+        if (entry != nullptr)
+        {   // Copied from most recent to least recent
+            first = entry;
+            ++blocks;
+            bytes += block.leak.size;
+        }
+    }
+    if (first == nullptr)
+        return;
+    const auto index = static_cast<size_t>(first->test - 1u);
+    context_leak_ = MakeContextLeakMessage((index < test_names_.size()) ?
+        test_names_[index].c_str() : "(unknown)", blocks, bytes, first->request);
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::SetLeakIdentity(
+    Leak& leak) const noexcept
+{
+    // Identity is only recorded for allocations of the current test
+    if (leak.request <= state_.pre_alloc_no)
+        return;
+    const auto index = static_cast<size_t>(leak.request - state_.pre_alloc_no);
+    if (index < allocations_.size())
+    {
+        leak.thread = allocations_[index].thread;
+        leak.stack = allocations_[index].signature;
+    }
+}
+
+size_t gtest_memleak_detector::MemoryLeakDetector::ForEachAnnotatedLeak(
+    const LeakCallback& callback) const
+{
+    // Callback must not annotate, which is a no-op once the test has ended
+    return annotated_.ForEach([&callback](const AnnotationTable::Block& block)
+    {
+        const Leak leak{ block.ptr, block.size, block.request, 
+            block.thread, StackSignature::invalid, block.pool };
+        return callback(leak);
+    });
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+size_t gtest_memleak_detector::MemoryLeakDetector::ForEachLeak(
+    const LeakCallback& callback) const
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    // Blocks freed since the test ended are no longer linked, so copy the
+    // current heap blocks rather than those of the end of the test
+    const HeapBlocks blocks(state_.pre_alloc_no, state_.post_alloc_no, this);
+    auto stopped = false;
+    const auto visit = [&](const Leak& leak)
+    {
+        stopped = !callback(leak);
+        return !stopped;
+    };
+    auto count = ForEachHeapLeak(blocks, visit);
+    if (!stopped)
+        count += ForEachAnnotatedLeak(visit);
+    return count;
+#else
+    UNREFERENCED_PARAMETER(callback);
+    return 0u;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::AnnotateAlloc(
+    const void* pool, const void* ptr, size_t size) noexcept
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    auto* detector = instance_.load(std::memory_order_acquire);
+    if (detector != nullptr)
+        detector->OnAnnotatedAllocation(pool, ptr, size);
+#else
+    UNREFERENCED_PARAMETER(pool);
+    UNREFERENCED_PARAMETER(ptr);
+    UNREFERENCED_PARAMETER(size);
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::AnnotateFree(
+    const void* pool, const void* ptr) noexcept
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    auto* detector = instance_.load(std::memory_order_acquire);
+    if (detector != nullptr)
+        detector->OnAnnotatedFree(pool, ptr);
+#else
+    UNREFERENCED_PARAMETER(pool);
+    UNREFERENCED_PARAMETER(ptr);
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::SetAllocHook()
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    assert(alloc_hook_set_ == false);
+    alloc_hook_set_ = AllocationBus::Get().Subscribe(OnAllocationEvent, this);
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::RevertAllocHook()
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    assert(alloc_hook_set_ == true);
+    (void)AllocationBus::Get().Unsubscribe(OnAllocationEvent, this);
+    alloc_hook_set_ = false;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::SyncAllocNo()
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    // Detector bookkeeping is allocated from arenas and never reaches the
+    // allocation hook, so explicitly make a single CRT allocation to obtain
+    // the current allocation request number.
+    auto* volatile probe = malloc(1);
+    free(probe);
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::ResetTrace() noexcept
+{
+    // Clear all trace state before resetting the trace arena itself since
+    // it would otherwise refer to memory about to be reused.
+    trace_.clear();
+    location_ = Location();
+    AllocationLog().swap(allocations_);
+    annotated_.Clear();
+    annotation_no_.store(0, std::memory_order_relaxed);
+    foreign_.Clear();
+    reported_.Clear();
+    Batch().swap(batch_);
+    signatures_.Clear();
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    stack_trace_.Reset();
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    TraceArena::Get().Reset();
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::SetTrace(
+    const Location& location, const char* stack_trace) noexcept
+{
+    location_ = location;
+    trace_.clear();
+    trace_.Append(stack_trace);
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::Start(
+    std::function<std::string()> descriptor)
 {
 #ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
     ::testing::UnitTest::GetInstance();
     if (instance_ != nullptr)
         throw std::exception("Parallel execution not supported\n");
-    instance_ = this;
+    instance_.store(this, std::memory_order_release);
+    running_test_ = ++started_tests_;
 
     GTEST_MEMLEAK_DETECTOR_DBGLOG("%s", "begin-first ----------\n");
 
     state_ = State(); // reset
+    ResetTrace();
+    divergence_trace_.clear();
+    divergence_.clear();
+    context_leak_.clear();
 
     GTEST_MEMLEAK_DETECTOR_DBGLOG("Process ID: %lu\n", GetProcessId(GetCurrentProcess()));
     GTEST_MEMLEAK_DETECTOR_DBGLOG("Thread ID:  %lu\n", GetThreadId(GetCurrentThread()));
     GTEST_MEMLEAK_DETECTOR_DBGLOG("Database:   %s\n", file_path_.c_str());
 
+    // Installed before the checkpoint and removed after the check, so its
+    // own allocations are outside of the test
+    if (options_.fail_alloc > 0)
+        failure_reporter_ = std::make_unique<FailureReporter>();
+
     // Hook directly so we can count number of allocations from this function
     // as well since it will offset recorded allocation request indices.
     SetAllocHook();
 
     // Find leaking allocation from database built during previous test run
-    // Note that this search indirectly allocates which makes it possible to
-    // obtain pre-allocation no used for relative allocation request no calc
     {
-        auto description_ = descriptor();
-        hash_ = std::hash<std::string>()(description_);
-        const auto kvp_it = db_.find(description_);
+        const auto description = descriptor();
+        const DatabaseString key(description.c_str(), description.size());
+        hash_ = StringHash()(key);
+        test_names_.emplace_back(key);  // named by leak contexts of the test
+        const auto kvp_it = db_.find(key);
         if (kvp_it != db_.end())
-            state_.break_alloc = kvp_it->second;
+        {
+            const auto& entry = kvp_it->second;
+            state_.break_alloc = entry.alloc_no;
+            state_.break_signature = entry.signature;
+            state_.break_ordinal = entry.ordinal;
+            state_.break_size = entry.size;
+            state_.break_fingerprint = entry.fingerprint;
+            state_.break_annotation = entry.annotation;
+            state_.mode = entry.mode; // begin in cheap mode if downgraded
+        }
+        sequence_.Begin((kvp_it != db_.end()) ? &kvp_it->second.sequence : nullptr);
+        if (recorder_.Enabled())
+        {
+            (void)recorder_.BeginTest(MakeTraceFilePath(
+                trace_prefix_.c_str(), description.c_str()).c_str(), description.c_str());
+        }
     }
     
-    // Determine allocation no based on relative information
+    // Determine allocation no based on relative information.
+    // Note that the arena-backed search above do not allocate from the CRT
+    // heap so the allocation no needs to be explicitly synchronized.
+    SyncAllocNo();
     state_.pre_alloc_no = alloc_no;
     if (state_.break_alloc != no_break_alloc)
         state_.break_alloc += alloc_no;
 
     // Create a memory checkpoint to diff with later to find leaks
     // NOTE: Allocations below will be excluded
+    if (options_.process_stats)
+        (void)ProcessMemory::Capture(process_pre_);
+    if (options_.lifetime)
+        lifetime_.Reset(alloc_no);
+    child_totals_ = ChildReport::Totals();
+    in_flight_ = 0;
+    activity_ = 0u;
+    if (options_.children)
+        (void)children_.Create(); // mapped before armed, i.e. not annotated
     _CrtMemCheckpoint(&pre_state_);
+    state_.rate_window_start = EventRecorder::Timestamp();
+    armed_.store(true, std::memory_order_release);
 
     //GTEST_MEMLEAK_DETECTOR_DBGLOG("PRE ALLOC NO: %ld, BREAK ALLOC NO: %ld, PRE-REQ: %ld\n", state_.pre_alloc_no, state_.break_alloc, pre_state_.pBlockHeader->lRequest);
 
@@ -498,11 +1746,44 @@ void gtest_memleak_detector::MemoryLeakDetector::End(
 
     assert(instance_ != nullptr);
 
+    // Background work of the test may still hold blocks about to be freed
+    WaitForQuiescence();
+
     state_.post_alloc_no = alloc_no;
+    armed_.store(false, std::memory_order_release);
+    running_test_ = 0ull;
+
+    ProcessMemory::Sample process_post;
+    if (options_.process_stats && ProcessMemory::Capture(process_post))
+        process_stats_ = ProcessMemory::Difference(process_pre_, process_post);
 
     // Unhook to avoid further allocation callbacks from code below
     if (alloc_hook_set_)
         RevertAllocHook();
+    if (options_.children)
+        child_totals_ = children_.Close();
+    sequence_.End();
+    if (recorder_.Enabled())
+    {
+        recorder_.EndTest();
+        if (options_.workload)
+        {   // Converted from the trace which is only kept if requested
+            const auto description = descriptor();
+            const auto trace_path = MakeTraceFilePath(
+                trace_prefix_.c_str(), description.c_str());
+            (void)EventRecorder::WriteWorkload(trace_path.c_str(), 
+                MakeWorkloadFilePath(trace_prefix_.c_str(), description.c_str()).c_str());
+            if (!options_.record)
+                std::remove(trace_path.c_str());
+        }
+    }
+    if (options_.lifetime && lifetime_.Get().Flagged())
+    {   // Only flagged tests are kept for the report since profiles are large
+        const auto description = descriptor();
+        lifetime_log_.emplace_back(
+            DatabaseString(description.c_str(), description.size()),
+            lifetime_.Get());
+    }
 
 	// Avoid adding extra asserts if test is not passing anyway and the failing
     // logic is the main failure.
@@ -511,24 +1792,90 @@ void gtest_memleak_detector::MemoryLeakDetector::End(
     // framework (bad).
     auto leak_alloc_no = no_break_alloc;
     auto leak_detected = false;
-    if (passed) // Avoid reporting leaks if previous assertion failure
+    auto leak_has_file = false;
+    uint64_t leak_bytes = 0;
+    uint64_t leak_blocks = 0;
+    auto annotated_alloc_no = no_break_alloc;
+    DatabaseEntry entry;
+    // Tests failed due to injected allocation failures are checked as well
+    // since results retained by Google Test are known, unless not all of
+    // them could be recorded. Leaks are relative to the start of the test,
+    // i.e. the state the clean run of the test ended leak free with.
+    const auto check = passed || 
+        (failure_reporter_ != nullptr && reported_.dropped == 0);
+    if (!foreign_.Empty())
+        ChargeForeignLeaks(); // regardless of the result of this test
+    if (passed && options_.growth)
+    {
+        // Retained memory is sampled instead of failing the test so that
+        // bounded retention, e.g. a cache, is distinguished from growth.
+        // Hence leaking tests are not failed in this mode.
+        _CrtMemState post_state;
+        _CrtMemCheckpoint(&post_state);
+
+        _CrtMemState mem_diff;
+        (void)_CrtMemDifference(&mem_diff, &pre_state_, &post_state);
+        const auto description = descriptor();
+        SampleGrowth(DatabaseString(description.c_str(), description.size()),
+            mem_diff);
+    }
+    else if (check) // Avoid reporting leaks if previous assertion failure
     {
         _CrtMemState post_state;
         _CrtMemCheckpoint(&post_state);
 
         _CrtMemState mem_diff;
         leak_detected = _CrtMemDifference(&mem_diff, &pre_state_, &post_state) != 0;
+        // Blocks are only copied if leaking, none is more recent than LONG_MAX
+        const HeapBlocks blocks(leak_detected ? state_.pre_alloc_no : LONG_MAX,
+            state_.post_alloc_no, this);
+        if (leak_detected && (!foreign_.Empty() || !reported_.Empty()))
+        {   // Blocks charged to other tests do not leak from this test
+            leak_blocks = ForEachHeapLeak(blocks, [&](const Leak& leak)
+            {
+                leak_alloc_no = leak.request;
+                leak_bytes += leak.size;
+                return true;
+            });
+            leak_detected = leak_blocks != 0;
+        }
+        else if (leak_detected)
+        {
+            leak_bytes = static_cast<uint64_t>(mem_diff.lSizes[_NORMAL_BLOCK]) +
+                static_cast<uint64_t>(mem_diff.lSizes[_CLIENT_BLOCK]);
+            leak_blocks = static_cast<uint64_t>(mem_diff.lCounts[_NORMAL_BLOCK]) +
+                static_cast<uint64_t>(mem_diff.lCounts[_CLIENT_BLOCK]);
+            // Blocks are copied from most recent to least recent so the
+            // least recent leak is reported
+            (void)ForEachHeapLeak(blocks, [&leak_alloc_no](const Leak& leak)
+            {
+                leak_alloc_no = leak.request;
+                return true;
+            });
+        }
         if (leak_detected)
         {
-            //parsed_alloc_no = no_break_alloc; // init
-            if (_CrtSetReportHook2(_CRT_RPTHOOK_INSTALL, report_callback) == -1)
-                throw std::exception("Failed to install CRT report hook");
-            _CrtMemDumpAllObjectsSince(&pre_state_);
-            //_CrtMemDumpStatistics(&mem_diff);
-            if (_CrtSetReportHook2(_CRT_RPTHOOK_REMOVE, report_callback) == -1)
-                throw std::exception("Failed to remove CRT report hook");
-            leak_alloc_no = state_.parsed_alloc_no;
-//            assert(leak_alloc_no > state_.pre_alloc_no);
+            // Record size and type of leaking block to verify identity on re-run
+            leak_has_file = SetLeakBlockInfo(entry, blocks, leak_alloc_no);
+        }
+
+        // Blocks from annotated pools are not part of the heap diff and are
+        // reported regardless of it. Only one block is traced on re-run and
+        // heap blocks are traced first.
+        DatabaseEntry annotated;
+        uint64_t annotated_bytes = 0;
+        const auto annotated_blocks = FindAnnotatedLeak(annotated, annotated_bytes);
+        if (annotated_blocks != 0)
+        {
+            annotated_alloc_no = annotated.annotation;
+            if (!leak_detected)
+            {
+                entry.annotation = annotated.annotation;
+                entry.size = annotated.size;
+                leak_detected = true;
+            }
+            leak_blocks += annotated_blocks;
+            leak_bytes += annotated_bytes;
         }
     }
 
@@ -555,24 +1902,376 @@ void gtest_memleak_detector::MemoryLeakDetector::End(
 
     // Fail test only if not failed due to assertion and a leak
     // has been detected.
-    if (passed && leak_detected) // TODO Assert deterministic allocations, otherwise warn
+    entry.alloc_no = relative_leak_alloc_no;
+    // Re-evaluated every run so that a test no longer allocating faster than
+    // the limit begins in Trace mode again
+    entry.mode = state_.rate_exceeded ? CaptureMode::Count : CaptureMode::Trace;
+    entry.isolate = options_.batch_size != 0 && passed && leak_detected;
+    entry.sequence = sequence_.Current();
+    if (relative_leak_alloc_no >= 0 && 
+        static_cast<size_t>(relative_leak_alloc_no) < allocations_.size())
+    {
+        const auto& record = allocations_[static_cast<size_t>(relative_leak_alloc_no)];
+        entry.signature = record.signature;
+        entry.ordinal = record.ordinal;
+    }
+
+    const auto description = descriptor();
+    DatabaseString key(description.c_str(), description.size());
+    if (options_.process_stats)
+        process_log_.emplace_back(key, process_stats_);
+    // Injected failures intentionally alter the allocation sequence
+    SequenceFingerprint::Divergence divergence;
+    if (passed && !FailureInjectionEnabled() && sequence_.Diverged(divergence))
+        divergence_ = MakeDivergenceMessage(divergence, divergence_trace_.c_str());
+    if (parent_.Attached())
+    {
+        parent_.Add(static_cast<uint64_t>(state_.post_alloc_no - state_.pre_alloc_no),
+            leak_blocks, leak_bytes);
+    }
+    if (check && leak_detected)
     {
-        auto description = descriptor();
-        db_.insert_or_assign(description, relative_leak_alloc_no);
-        rerun_filter_.emplace_back(description);
+        // Signature is known unless the test ran in count mode and location
+        // only if the stack-trace was captured, i.e. on re-run
+        const auto site = LeakSummary::MakeKey(entry.signature, location_, 
+            leak_has_file ? entry.fingerprint : 0u);
+        summary_.Add(site, (leak_bytes != 0) ? leak_bytes : entry.size, 
+            description.c_str(), trace_.c_str());
+        rerun_filter_.emplace_back(key);
+        db_.insert_or_assign(std::move(key), entry);
         if (fail_)
-            fail_(leak_alloc_no, location_.file.c_str(), location_.line, trace_.c_str());
+        {
+            const auto request = (entry.annotation != no_break_alloc) ? 
+                entry.annotation : leak_alloc_no;
+            fail_(request, files_.Name(location_.file), location_.line, trace_.c_str());
+            if (entry.annotation == no_break_alloc && annotated_alloc_no != no_break_alloc)
+            {   // Pool blocks leaked in addition to heap blocks, not traced
+                fail_(annotated_alloc_no, "", Location::invalid_line, "");
+            }
+        }
     }
     else
     {
-        db_.insert_or_assign(descriptor(), relative_leak_alloc_no);
+        db_.insert_or_assign(std::move(key), entry);
     }
 
-    instance_ = nullptr; // TODO Scoped
+    failure_reporter_.reset(); // restores reporter of the test thread
+    instance_.store(nullptr, std::memory_order_release); // TODO Scoped
 #else
     UNREFERENCED_PARAMETER(descriptor);
     UNREFERENCED_PARAMETER(passed);
 #endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
 }
 
-//#endif // GTEST_MEMLEAK_DETECTOR_CRTDBG_AVAILABLE
\ No newline at end of file
+void gtest_memleak_detector::MemoryLeakDetector::ReportProcessExit() noexcept
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    // Registered with atexit when attached to a parent. The test never ends
+    // if the process exits within it, so add it to the parent report here.
+    auto* detector = instance_.load(std::memory_order_acquire);
+    if (detector == nullptr || !detector->armed_.load(std::memory_order_acquire) || 
+        !detector->parent_.Attached())
+        return;
+    detector->armed_.store(false, std::memory_order_release);
+    running_test_ = 0ull;
+    if (detector->alloc_hook_set_)
+        detector->RevertAllocHook();
+
+    _CrtMemState post_state;
+    _CrtMemCheckpoint(&post_state);
+    _CrtMemState mem_diff;
+    int64_t blocks = 0;
+    int64_t bytes = 0;
+    if (_CrtMemDifference(&mem_diff, &detector->pre_state_, &post_state))
+    {
+        blocks = static_cast<int64_t>(mem_diff.lCounts[_NORMAL_BLOCK]) +
+            static_cast<int64_t>(mem_diff.lCounts[_CLIENT_BLOCK]);
+        bytes = static_cast<int64_t>(mem_diff.lSizes[_NORMAL_BLOCK]) +
+            static_cast<int64_t>(mem_diff.lSizes[_CLIENT_BLOCK]);
+    }
+    detector->parent_.AddExited(
+        static_cast<uint64_t>(alloc_no - detector->state_.pre_alloc_no),
+        static_cast<uint64_t>((blocks > 0) ? blocks : 0),
+        static_cast<uint64_t>((bytes > 0) ? bytes : 0));
+    instance_ = nullptr;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Batched leak checking
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+bool gtest_memleak_detector::MemoryLeakDetector::BatchEnabled() const noexcept
+{
+    return options_.batch_size != 0;
+}
+
+bool gtest_memleak_detector::MemoryLeakDetector::BatchOpen() const noexcept
+{
+    return batch_open_;
+}
+
+bool gtest_memleak_detector::MemoryLeakDetector::IsIsolated(
+    std::function<std::string()> descriptor) const
+{
+    // Avoid describing tests at all unless some test needs isolation
+    if (isolated_ == 0)
+        return false;
+    const auto description = descriptor();
+    const auto it = db_.find(DatabaseString(description.c_str(), description.size()));
+    return it != db_.end() && it->second.isolate;
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::StartBatch()
+{
+    ::testing::UnitTest::GetInstance();
+    if (instance_ != nullptr)
+        throw std::exception("Parallel execution not supported\n");
+    instance_ = this;
+
+    state_ = State(); // reset
+    ResetTrace();
+    SetAllocHook();
+    SyncAllocNo();
+    state_.pre_alloc_no = alloc_no;
+    _CrtMemCheckpoint(&pre_state_);
+    batch_open_ = true;
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::StartBatchTest(const void* test)
+{
+    assert(batch_open_);
+    SyncAllocNo();
+    batch_.push_back(BatchTest{ test, alloc_no, no_break_alloc, no_break_alloc, true });
+}
+
+bool gtest_memleak_detector::MemoryLeakDetector::EndBatchTest(bool passed) noexcept
+{
+    assert(batch_open_ && !batch_.empty());
+    auto& test = batch_.back();
+    test.last_request = alloc_no;
+    test.passed = passed;
+    return batch_.size() >= static_cast<size_t>(options_.batch_size);
+}
+
+gtest_memleak_detector::MemoryLeakDetector::BatchTest* 
+gtest_memleak_detector::MemoryLeakDetector::FindBatchTest(long request) noexcept
+{
+    // Tests are ordered by request no so find the last test starting before
+    auto it = std::upper_bound(batch_.begin(), batch_.end(), request,
+        [](long value, const BatchTest& test) { return value <= test.first_request; });
+    if (it == batch_.begin())
+        return nullptr;
+    --it;
+    const auto last_request = (it->last_request != no_break_alloc) ? 
+        it->last_request : state_.post_alloc_no;
+    return (request <= last_request) ? &*it : nullptr;
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::EndBatch(BatchDescriptor descriptor)
+{
+    assert(batch_open_);
+    state_.post_alloc_no = alloc_no;
+    batch_open_ = false;
+    if (alloc_hook_set_)
+        RevertAllocHook();
+
+    _CrtMemState post_state;
+    _CrtMemCheckpoint(&post_state);
+
+    _CrtMemState mem_diff;
+    if (_CrtMemDifference(&mem_diff, &pre_state_, &post_state) == 0)
+    {
+        instance_ = nullptr;
+        return; // clean batch
+    }
+
+    // Attribute leaking blocks to tests by request no. Blocks are copied 
+    // from most recent to least recent so the first leak of each test is kept.
+    const HeapBlocks blocks(state_.pre_alloc_no, state_.post_alloc_no, this);
+    auto unattributed = no_break_alloc;
+    (void)ForEachHeapLeak(blocks, [&](const Leak& leak)
+    {
+        auto* test = FindBatchTest(leak.request);
+        if (test != nullptr)
+            test->leak_alloc_no = leak.request;
+        else
+            unattributed = leak.request;
+        return true;
+    });
+
+    // Isolate leaking tests so that they are checked individually and get
+    // a stack-trace on the next run
+    for (const auto& test : batch_)
+    {
+        if (!test.passed || test.leak_alloc_no == no_break_alloc)
+            continue;
+        DatabaseEntry entry;
+        entry.alloc_no = test.leak_alloc_no - test.first_request;
+        entry.isolate = true;
+        const auto has_file = SetLeakBlockInfo(entry, blocks, test.leak_alloc_no);
+        const auto* block = blocks.Find(test.leak_alloc_no);
+
+        const auto description = descriptor(test.test);
+        DatabaseString key(description.c_str(), description.size());
+        summary_.Add(LeakSummary::MakeKey(
+            (block != nullptr) ? block->leak.stack : StackSignature::invalid, Location(), 
+            has_file ? entry.fingerprint : 0u), entry.size, description.c_str(), nullptr);
+        rerun_filter_.emplace_back(key);
+        db_.insert_or_assign(std::move(key), entry);
+        ++isolated_;
+        if (batch_fail_)
+            batch_fail_(description.c_str(), test.leak_alloc_no, batch_.size());
+    }
+
+    // Blocks allocated in between tests cannot be attributed by request no,
+    // narrow down by isolating all passing tests of the batch instead.
+    if (unattributed != no_break_alloc)
+    {
+        auto any_passed = false;
+        for (const auto& test : batch_)
+        {
+            if (!test.passed)
+                continue;
+            any_passed = true;
+            const auto description = descriptor(test.test);
+            db_[DatabaseString(description.c_str(), description.size())].isolate = true;
+            ++isolated_;
+        }
+        if (any_passed && batch_fail_)
+            batch_fail_(nullptr, unattributed, batch_.size());
+    }
+
+    instance_ = nullptr;
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+//#endif // GTEST_MEMLEAK_DETECTOR_CRTDBG_AVAILABLE
+
+///////////////////////////////////////////////////////////////////////////////
+// Scoped leak checking
+///////////////////////////////////////////////////////////////////////////////
+
+void* gtest_memleak_detector::MemoryLeakDetector::AllocateSentinel() noexcept
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    // CRT blocks are not reported as leaks, neither by CRTDBG nor detector
+    return _malloc_dbg(1, _CRT_BLOCK, __FILE__, __LINE__);
+#else
+    return nullptr;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+void gtest_memleak_detector::MemoryLeakDetector::FreeSentinel(void* sentinel) noexcept
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    _free_dbg(sentinel, _CRT_BLOCK);
+#else
+    UNREFERENCED_PARAMETER(sentinel);
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+size_t gtest_memleak_detector::MemoryLeakDetector::ForEachBlockSince(
+    const void* sentinel, const LeakCallback& callback)
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    if (sentinel == nullptr)
+        return 0u; // sentinel allocation failed, e.g. injected failure
+
+    // Blocks are copied from the probe block of the heap lock, which is 
+    // linked first, this avoids _CrtMemCheckpoint which visits every live 
+    // block. Only blocks allocated after the sentinel are visited.
+    const HeapBlocks blocks(HeaderOf(sentinel)->lRequest, LONG_MAX, 
+        instance_.load(std::memory_order_acquire));
+    size_t count = 0;
+    for (const auto& block : blocks)
+    {
+        ++count;
+        if (!callback(block.leak))
+            break;
+    }
+    return count;
+#else
+    UNREFERENCED_PARAMETER(sentinel);
+    UNREFERENCED_PARAMETER(callback);
+    return 0u;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+size_t gtest_memleak_detector::MemoryLeakDetector::ForEachBlockBetween(
+    const void* first_sentinel, const void* last_sentinel, 
+    const LeakCallback& callback)
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    if (first_sentinel == nullptr || last_sentinel == nullptr)
+        return 0u;
+
+    // Blocks are linked first when allocated and when moved by a realloc,
+    // so the walk from the last sentinel towards the first one only visits
+    // live blocks allocated in between, regardless of the total number of
+    // live blocks. A block reallocated in place keeps its link but gets a new
+    // request no, hence the walk is bounded by the request no of the last 
+    // sentinel. Such a block is attributed to its reallocation, i.e. skipped
+    // if reallocated after the last sentinel and not visited if allocated
+    // before the first sentinel.
+    const auto* first = HeaderOf(first_sentinel);
+    const auto* last = HeaderOf(last_sentinel);
+    if (last->lRequest <= first->lRequest)
+        return 0u;
+    // Blocks are copied with the heap lock held and visited after it is 
+    // released, so callbacks may allocate and other threads may free.
+    const HeapBlocks blocks(first->lRequest, last->lRequest, 
+        instance_.load(std::memory_order_acquire), last_sentinel);
+    size_t count = 0;
+    for (const auto& block : blocks)
+    {
+        ++count;
+        if (!callback(block.leak))
+            break;
+    }
+    return count;
+#else
+    UNREFERENCED_PARAMETER(first_sentinel);
+    UNREFERENCED_PARAMETER(last_sentinel);
+    UNREFERENCED_PARAMETER(callback);
+    return 0u;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+long gtest_memleak_detector::MemoryLeakDetector::SentinelRequest(
+    const void* sentinel) noexcept
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    return (sentinel != nullptr) ? HeaderOf(sentinel)->lRequest : no_break_alloc;
+#else
+    UNREFERENCED_PARAMETER(sentinel);
+    return no_break_alloc;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Leak contexts
+///////////////////////////////////////////////////////////////////////////////
+
+unsigned long long gtest_memleak_detector::MemoryLeakDetector::RunningTest() noexcept
+{
+    return running_test_.load(std::memory_order_relaxed);
+}
+
+const gtest_memleak_detector::LeakContext*
+gtest_memleak_detector::MemoryLeakDetector::CurrentLeakContext() noexcept
+{
+    return leak_context_;
+}
+
+const gtest_memleak_detector::LeakContext*
+gtest_memleak_detector::MemoryLeakDetector::SwapLeakContext(
+    const LeakContext* context) noexcept
+{
+    const auto* previous = leak_context_;
+    leak_context_ = context;
+    return previous;
+}
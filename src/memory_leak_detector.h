@@ -34,11 +34,23 @@
 #define _CRTDBG_MAP_ALLOC
 #endif // _CRTDBG_MAP_ALLOC
 
+#include "memory_leak_detector_preload.h"
+#include "memory_leak_detector_trace.h"
+
+#include <algorithm>     // std::min
+#include <atomic>        // std::atomic
+#include <climits>       // LONG_MAX
+#include <condition_variable> // std::condition_variable
+#include <cstdint>       // uint32_t
 #include <cstdio>        // snprintf_s
+#include <cstring>       // memcpy, strlen
 #include <crtdbg.h>      // _CrtMemState
 #include <fstream>       // std::ifstream, std::ofstream
+#include <mutex>         // std::mutex
+#include <thread>        // std::thread
 #include <unordered_map> // std::unordered_map
 #include <sstream>       // std::stringstream
+#include <vector>        // std::vector
 
 // Internal debugging:
 // Uncomment to debug during development of this library
@@ -55,6 +67,350 @@
 
 namespace gtest_memleak_detector {
 
+///////////////////////////////////////////////////////////////////////////////
+// Arena
+//
+// Detector-private memory backed directly by virtual memory pages, i.e. never
+// allocated via the CRT debug heap and hence never seen by the allocation
+// hook. Memory is bump-allocated from a reserved address range and committed
+// on demand. Small blocks are recycled via power-of-two size-class free lists.
+//
+// Note that the arena is not thread-safe, similar to the rest of the detector.
+///////////////////////////////////////////////////////////////////////////////
+
+class Arena final
+{
+public:
+    static constexpr size_t commit_granularity = 64u * 1024u;
+    static constexpr size_t min_block_size = 16u;
+    static constexpr size_t size_class_count = 13u; // 16 B - 64 kB
+
+    explicit Arena(size_t reserve_bytes);
+    ~Arena() noexcept;
+
+    Arena(const Arena&) = delete;
+    Arena(Arena&&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena& operator=(Arena&&) = delete;
+
+    void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+    void Deallocate(void* ptr, size_t size) noexcept;
+    void Reset() noexcept;
+
+    size_t Used() const noexcept;
+    size_t Committed() const noexcept;
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    static size_t SizeClass(size_t size) noexcept;
+    void Commit(size_t required_bytes);
+
+    char*       base_;
+    size_t      reserved_;
+    size_t      committed_;
+    size_t      offset_;
+    FreeBlock*  free_lists_[size_class_count];
+};
+
+// Arena reset when a test starts, holds stack traces and locations
+struct TraceArena
+{
+    static constexpr size_t reserve_bytes = 256u * 1024u * 1024u;
+    static Arena& Get();
+};
+
+// Arena living for the duration of the program, holds the leak database
+struct DatabaseArena
+{
+    static constexpr size_t reserve_bytes = 256u * 1024u * 1024u;
+    static Arena& Get();
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// AnnotationTable
+//
+// Live blocks of custom pools indexed by address. Blocks are annotated by any
+// thread so the table is split into shards by address, each an open 
+// addressing table of fixed capacity guarded by a spin lock. Annotating hence
+// never allocates and rarely contends. Blocks not fitting are counted.
+///////////////////////////////////////////////////////////////////////////////
+
+class AnnotationTable final
+{
+public:
+    static constexpr size_t shard_count = 64u;
+    static constexpr size_t shard_capacity = 1024u; // power of two
+    static constexpr size_t max_shard_size = shard_capacity / 4u * 3u;
+
+    struct Block
+    {
+        const void*     ptr;    // nullptr if slot is empty
+        const void*     pool;
+        size_t          size;
+        long            request;
+        unsigned long   thread;
+    };
+
+    AnnotationTable();
+    ~AnnotationTable() noexcept;
+
+    AnnotationTable(const AnnotationTable&) = delete;
+    AnnotationTable(AnnotationTable&&) = delete;
+    AnnotationTable& operator=(const AnnotationTable&) = delete;
+    AnnotationTable& operator=(AnnotationTable&&) = delete;
+
+    bool Insert(const Block& block) noexcept;
+    void Erase(const void* pool, const void* ptr) noexcept;
+    void Clear() noexcept;
+    size_t Dropped() const noexcept;
+
+    // Visits blocks until the callback returns false. The callback must not
+    // annotate since the shard visited is locked.
+    template<class Callback>
+    size_t ForEach(Callback&& callback) const
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < shard_count; ++i)
+        {
+            auto& shard = shards_[i];
+            if (shard.size.load(std::memory_order_relaxed) == 0u)
+                continue;
+            Lock(shard);
+            for (const auto& block : shard.slots)
+            {
+                if (block.ptr == nullptr)
+                    continue;
+                ++count;
+                if (!callback(block))
+                {
+                    Unlock(shard);
+                    return count;
+                }
+            }
+            Unlock(shard);
+        }
+        return count;
+    }
+
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<bool>   locked;
+        std::atomic<size_t> size;   // written with lock held
+        Block               slots[shard_capacity];
+    };
+
+    static size_t Hash(const void* ptr) noexcept;
+    static void Lock(Shard& shard) noexcept;
+    static void Unlock(Shard& shard) noexcept;
+
+    Shard*                  shards_; // committed pages are zeroed
+    std::atomic<size_t>     dropped_{ 0u };
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// ArenaAllocator
+//
+// Stateless standard library allocator allocating from the arena given by
+// the tag type, e.g. TraceArena or DatabaseArena.
+///////////////////////////////////////////////////////////////////////////////
+
+template<class T, class ArenaTag>
+class ArenaAllocator
+{
+public:
+    using value_type = T;
+
+    template<class U>
+    struct rebind
+    {
+        using other = ArenaAllocator<U, ArenaTag>;
+    };
+
+    ArenaAllocator() noexcept = default;
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U, ArenaTag>&) noexcept
+    { }
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(ArenaTag::Get().Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept
+    {
+        ArenaTag::Get().Deallocate(ptr, n * sizeof(T));
+    }
+
+    template<class U>
+    bool operator==(const ArenaAllocator<U, ArenaTag>&) const noexcept
+    {
+        return true;
+    }
+
+    template<class U>
+    bool operator!=(const ArenaAllocator<U, ArenaTag>&) const noexcept
+    {
+        return false;
+    }
+};
+
+using TraceString = std::basic_string<char, std::char_traits<char>,
+    ArenaAllocator<char, TraceArena>>;
+using DatabaseString = std::basic_string<char, std::char_traits<char>,
+    ArenaAllocator<char, DatabaseArena>>;
+
+// FNV-1a hash, avoids std::hash<std::string> requiring std::allocator
+struct StringHash
+{
+    template<class String>
+    size_t operator()(const String& str) const noexcept
+    {
+        auto hash = static_cast<size_t>(14695981039346656037ull);
+        for (const auto c : str)
+        {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= static_cast<size_t>(1099511628211ull);
+        }
+        return hash;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// FixedBuffer
+//
+// Null-terminated text buffer with fixed capacity used to format traces and
+// failure messages without allocating. Output exceeding capacity is 
+// truncated.
+///////////////////////////////////////////////////////////////////////////////
+
+template<size_t Capacity>
+class FixedBuffer
+{
+public:
+    static constexpr size_t capacity = Capacity;
+
+    FixedBuffer() noexcept
+        : length_(0)
+        , truncated_(false)
+    {
+        data_[0] = 0;
+    }
+
+    const char* c_str() const noexcept { return data_; }
+    size_t size() const noexcept { return length_; }
+    bool empty() const noexcept { return length_ == 0; }
+    bool truncated() const noexcept { return truncated_; }
+
+    void clear() noexcept
+    {
+        length_ = 0;
+        truncated_ = false;
+        data_[0] = 0;
+    }
+
+    FixedBuffer& Append(const char* str, size_t n) noexcept
+    {
+        const auto available = Capacity - 1 - length_;
+        if (n > available)
+        {
+            n = available;
+            truncated_ = true;
+        }
+        memcpy(data_ + length_, str, n);
+        length_ += n;
+        data_[length_] = 0;
+        return *this;
+    }
+
+    FixedBuffer& Append(const char* str) noexcept
+    {
+        return str ? Append(str, strlen(str)) : *this;
+    }
+
+    FixedBuffer& Append(char c) noexcept
+    {
+        return Append(&c, 1);
+    }
+
+    FixedBuffer& Append(long value) noexcept
+    {
+        char digits[24];
+        return Append(digits, Format(digits, "%ld", value));
+    }
+
+    FixedBuffer& Append(unsigned long value) noexcept
+    {
+        char digits[24];
+        return Append(digits, Format(digits, "%lu", value));
+    }
+
+    FixedBuffer& AppendHex(unsigned long value) noexcept
+    {
+        char digits[24];
+        return Append(digits, Format(digits, "%lX", value));
+    }
+
+    FixedBuffer& Append(const void* ptr) noexcept
+    {   // Same representation as std::ostream, e.g. 00007FF6A1B2C3D4 (MSVC)
+        char digits[24];
+        return Append(digits, Format(digits, "%p", ptr));
+    }
+
+private:
+    template<size_t N, class T>
+    static size_t Format(char(&dst)[N], const char* fmt, T value) noexcept
+    {
+        const auto n = snprintf(dst, N, fmt, value);
+        return n > 0 ? (std::min)(static_cast<size_t>(n), N - 1) : 0u;
+    }
+
+    char    data_[Capacity];
+    size_t  length_;
+    bool    truncated_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// FileTable
+//
+// Interns source file names as small integer identifiers so that locations
+// may be captured and copied without copying strings. Names are stored in the
+// database arena and remain valid for the lifetime of the program.
+///////////////////////////////////////////////////////////////////////////////
+
+class FileTable final
+{
+public:
+    using Id = unsigned;
+    static constexpr Id invalid_id = 0u;
+
+    FileTable() = default;
+
+    FileTable(const FileTable&) = delete;
+    FileTable(FileTable&&) = delete;
+    FileTable& operator=(const FileTable&) = delete;
+    FileTable& operator=(FileTable&&) = delete;
+
+    Id Intern(const char* file);
+    const char* Name(Id id) const noexcept;
+    size_t Size() const noexcept;
+
+private:
+    using Index = std::unordered_map<DatabaseString, Id,
+        StringHash, std::equal_to<DatabaseString>,
+        ArenaAllocator<std::pair<const DatabaseString, Id>, DatabaseArena>>;
+    using Names = std::vector<const char*, 
+        ArenaAllocator<const char*, DatabaseArena>>;
+
+    Index index_;
+    Names names_;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // Location
 ///////////////////////////////////////////////////////////////////////////////
@@ -64,20 +420,757 @@ struct Location
     static constexpr unsigned long invalid_line = static_cast<unsigned long>(-1);
 
     unsigned long   line = invalid_line;
-    std::string     file;
+    FileTable::Id   file = FileTable::invalid_id;
 
     inline void Clear() noexcept
     {
         line = invalid_line;
-        file.clear();
+        file = FileTable::invalid_id;
     }
 
     inline bool Empty() noexcept
     {
-        return line == invalid_line && file.empty();
+        return line == invalid_line && file == FileTable::invalid_id;
     }
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// StackSignature
+//
+// Compact identity of an allocation call-site computed by hashing a short
+// sequence of return addresses. Addresses are made relative to the module
+// they belong to so that signatures remain stable across runs even if modules
+// are relocated (ASLR).
+///////////////////////////////////////////////////////////////////////////////
+
+class StackSignature final
+{
+public:
+    using Value = uint32_t;
+
+    static constexpr Value invalid = 0u;
+
+    // Skip detector frames, capture enough frames to get past CRT allocation
+    // functions into the code under test
+    static constexpr unsigned long skip_frames = 2u;
+    static constexpr unsigned long max_frames = 16u;
+
+    static Value Capture() noexcept;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// SignatureCounter
+//
+// Fixed-capacity open-addressing table counting allocations per stack
+// signature within a test, i.e. giving the ordinal of an allocation among all
+// allocations sharing the same signature. Table storage is allocated once and
+// entries from previous tests are invalidated by bumping a generation counter.
+///////////////////////////////////////////////////////////////////////////////
+
+class SignatureCounter final
+{
+public:
+    static constexpr size_t capacity = 16384u; // power of two
+    static constexpr size_t max_probes = 32u;
+
+    SignatureCounter() noexcept;
+
+    SignatureCounter(const SignatureCounter&) = delete;
+    SignatureCounter(SignatureCounter&&) = delete;
+    SignatureCounter& operator=(const SignatureCounter&) = delete;
+    SignatureCounter& operator=(SignatureCounter&&) = delete;
+
+    bool Next(StackSignature::Value signature, uint32_t& ordinal);
+    void Clear() noexcept;
+
+private:
+    struct Entry
+    {
+        StackSignature::Value   signature;
+        uint32_t                count;
+        uint32_t                generation;
+    };
+
+    Entry*      entries_;
+    uint32_t    generation_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// AllocationBus
+//
+// Dispatches CRT allocation hook events to subscribers. Subscribers are kept
+// in an immutable array replaced on every change (read-copy-update) so that
+// dispatch never takes a lock. A replaced array is released once readers 
+// that may still observe it have left, tracked by two reader counts selected
+// by an epoch flipped on every update. The CRT hook is installed with the 
+// first subscriber and only removed with the last one if no other hook has
+// been installed on top of it, so hooks of other tools installed and removed
+// in any order remain chained.
+//
+// The CRT does not export its heap lock but invokes the hook with it held.
+// RunLocked uses this to run a function with the lock held, e.g. to copy
+// heap blocks without other threads freeing them while they are visited.
+///////////////////////////////////////////////////////////////////////////////
+
+class AllocationBus final
+{
+public:
+    struct Subscriber
+    {
+        AllocationSubscriber    callback;
+        void*                   context;
+    };
+
+    AllocationBus(const AllocationBus&) = delete;
+    AllocationBus(AllocationBus&&) = delete;
+    AllocationBus& operator=(const AllocationBus&) = delete;
+    AllocationBus& operator=(AllocationBus&&) = delete;
+
+    static AllocationBus& Get() noexcept;
+
+    bool Subscribe(AllocationSubscriber callback, void* context);
+    bool Unsubscribe(AllocationSubscriber callback, void* context);
+    size_t Size() const noexcept;
+
+    int Dispatch(int type, void* data, size_t size, int block_use,
+        long request, const unsigned char* file, int line) noexcept;
+
+    // Invokes function with the CRT heap lock held from the hook freeing a
+    // probe block, which is linked as the most recent block allocated before
+    // the call. The probe is not dispatched to subscribers. The function must
+    // not allocate from the CRT heap. Returns false if it was not invoked.
+    using LockedFunction = void(*)(void* context, const void* probe);
+    bool RunLocked(LockedFunction function, void* context) noexcept;
+
+private:
+    struct Array
+    {
+        size_t      count;
+        Subscriber  items[1]; // count items
+    };
+
+    AllocationBus() = default;
+
+    static Array* Allocate(size_t count) noexcept;
+    unsigned Enter() noexcept;
+    void Leave(unsigned epoch) noexcept;
+    void Publish(Array* subscribers) noexcept;
+
+    std::atomic<Array*>     current_{ nullptr };
+    std::atomic<unsigned>   epoch_{ 0u };
+    std::atomic<long>       readers_[2]{};
+    std::atomic<_CRT_ALLOC_HOOK> previous_{ nullptr };
+    std::mutex              mutex_;
+    bool                    installed_ = false;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// ExecutorRegistry
+//
+// Idle probes of executors registered by the test program. Storage is fixed
+// so that executors may be registered from any thread and at any time 
+// without allocating.
+///////////////////////////////////////////////////////////////////////////////
+
+class ExecutorRegistry final
+{
+public:
+    static constexpr size_t capacity = 16u;
+
+    ExecutorRegistry(const ExecutorRegistry&) = delete;
+    ExecutorRegistry(ExecutorRegistry&&) = delete;
+    ExecutorRegistry& operator=(const ExecutorRegistry&) = delete;
+    ExecutorRegistry& operator=(ExecutorRegistry&&) = delete;
+
+    static ExecutorRegistry& Get() noexcept;
+
+    bool Register(IdleProbe probe, void* context);
+    bool Unregister(IdleProbe probe, void* context);
+    bool Idle(); // true if all registered executors are idle
+    size_t Count();
+
+private:
+    struct Executor
+    {
+        IdleProbe   probe;
+        void*       context;
+    };
+
+    ExecutorRegistry() = default;
+
+    std::mutex  mutex_;
+    Executor    executors_[capacity]{};
+    size_t      count_ = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// AllocationEvent
+//
+// Arguments of a CRT allocation hook callback.
+///////////////////////////////////////////////////////////////////////////////
+
+struct AllocationEvent
+{
+    int                     type;       // _HOOK_ALLOC, _HOOK_REALLOC, _HOOK_FREE
+    void*                   data;       // user data, nullptr for _HOOK_ALLOC
+    size_t                  size;
+    int                     block_use;
+    long                    request;
+    const unsigned char*    file;       // only if allocated via _CRTDBG_MAP_ALLOC
+    int                     line;
+
+    // Type fingerprint of the allocation, i.e. hash of block type and 
+    // allocation file/line if available. Content is not available since the
+    // allocation hook is invoked before the allocation takes place.
+    static uint32_t MakeFingerprint(int block_use, 
+        const unsigned char* file, int line) noexcept;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// GrowthTracker
+//
+// Tracks memory retained by each test across --gtest_repeat iterations and
+// fits a linear trend to detect unbounded growth, e.g. caches only freed at
+// shutdown. State per test is constant in size regardless of iteration count
+// since only least-squares accumulators and a bounded set of top allocation
+// sites are kept.
+///////////////////////////////////////////////////////////////////////////////
+
+class GrowthTracker final
+{
+public:
+    static constexpr size_t max_sites = 8u;
+    static constexpr size_t reported_sites = 3u;
+    static constexpr double min_r_squared = 0.9;
+
+    struct Site
+    {
+        FileTable::Id           file = FileTable::invalid_id;
+        unsigned long           line = 0;
+        StackSignature::Value   signature = StackSignature::invalid;
+        uint64_t                bytes = 0;
+        uint64_t                blocks = 0;
+    };
+
+    // Online least-squares fit of y = a + b * x where x is the iteration
+    struct Fit
+    {
+        double n = 0;
+        double sum_x = 0;
+        double sum_xx = 0;
+        double sum_y = 0;
+        double sum_xy = 0;
+        double sum_yy = 0;
+
+        void Add(double x, double y) noexcept;
+        double Slope() const noexcept;
+        double RSquared() const noexcept;
+    };
+
+    struct Trend
+    {
+        int64_t     retained_bytes = 0;  // cumulative over iterations
+        int64_t     retained_blocks = 0; // cumulative over iterations
+        Fit         bytes;
+        Fit         blocks;
+        Site        sites[max_sites];
+
+        void AddSite(FileTable::Id file, unsigned long line, 
+            StackSignature::Value signature, size_t bytes) noexcept;
+        bool Growing(long min_iterations) const noexcept;
+    };
+
+    GrowthTracker() = default;
+
+    GrowthTracker(const GrowthTracker&) = delete;
+    GrowthTracker(GrowthTracker&&) = delete;
+    GrowthTracker& operator=(const GrowthTracker&) = delete;
+    GrowthTracker& operator=(GrowthTracker&&) = delete;
+
+    Trend& Sample(const DatabaseString& test, 
+        int64_t delta_bytes, int64_t delta_blocks);
+    size_t Report(FILE* out, const FileTable& files, long min_iterations) const;
+
+private:
+    using Trends = std::unordered_map<DatabaseString, Trend,
+        StringHash, std::equal_to<DatabaseString>,
+        ArenaAllocator<std::pair<const DatabaseString, Trend>, DatabaseArena>>;
+
+    Trends trends_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LifetimeProfile
+//
+// Log2 histograms of allocation sizes and block lifetimes within a test where
+// lifetime is measured both in subsequent allocation requests and in
+// nanoseconds. Storage is fixed in size. Live blocks are tracked by a direct
+// mapped table indexed by request no where a colliding allocation evicts the
+// older block, whose lifetime is then only known in allocation requests.
+///////////////////////////////////////////////////////////////////////////////
+
+class LifetimeProfile final
+{
+public:
+    static constexpr size_t buckets = 48u;
+    static constexpr size_t live_capacity = 4096u; // power of two
+    static constexpr size_t max_sites = 64u;       // power of two
+    static constexpr uint64_t short_lived_requests = 4u;
+    static constexpr uint64_t min_frees = 64u;
+    static constexpr uint64_t min_site_frees = 16u;
+
+    // Bucket i counts values in [2^(i-1), 2^i), bucket 0 counts zero
+    struct Histogram
+    {
+        uint64_t counts[buckets] = {};
+
+        void Add(uint64_t value) noexcept;
+        static size_t Bucket(uint64_t value) noexcept;
+    };
+
+    struct Site
+    {
+        StackSignature::Value   signature = StackSignature::invalid;
+        uint64_t                frees = 0;
+        uint64_t                short_lived = 0;
+
+        bool ShortLived() const noexcept;
+    };
+
+    struct Profile
+    {
+        Histogram   sizes;
+        Histogram   requests;    // lifetime in subsequent allocation requests
+        Histogram   nanoseconds; // lifetime of blocks still in live table
+        uint64_t    allocations = 0;
+        uint64_t    frees = 0;
+        uint64_t    short_lived = 0;
+        uint64_t    untracked = 0; // freed after eviction from live table
+        Site        sites[max_sites];
+
+        bool ShortLived() const noexcept;
+        bool Flagged() const noexcept;
+    };
+
+    LifetimeProfile() = default;
+
+    LifetimeProfile(const LifetimeProfile&) = delete;
+    LifetimeProfile(LifetimeProfile&&) = delete;
+    LifetimeProfile& operator=(const LifetimeProfile&) = delete;
+    LifetimeProfile& operator=(LifetimeProfile&&) = delete;
+
+    void Reset(long first_request) noexcept;
+    void OnAllocation(long request, size_t size,
+        StackSignature::Value signature, uint64_t timestamp) noexcept;
+    void OnFree(long request, long last_request, uint64_t timestamp) noexcept;
+    const Profile& Get() const noexcept;
+
+    static void Write(FILE* out, const char* test, const Profile& profile);
+
+private:
+    struct Live
+    {
+        long                    request = 0;
+        StackSignature::Value   signature = StackSignature::invalid;
+        uint64_t                timestamp = 0;
+    };
+
+    Site* FindSite(StackSignature::Value signature) noexcept;
+
+    Profile     profile_;
+    Live        live_[live_capacity];
+    long        first_request_ = 0;
+    uint64_t    frequency_ = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// SequenceFingerprint
+//
+// Rolling hash over the sizes of all allocation requests of a test, compared
+// with the previous run of the same binary since leaks are identified by
+// request no on re-run. Prefix hashes are kept at a fixed stride to locate a
+// divergence within a window, and the sizes of a diverging window are kept so
+// that the next run can locate the first differing request and its stack.
+///////////////////////////////////////////////////////////////////////////////
+
+class SequenceFingerprint final
+{
+public:
+    using Value = uint64_t;
+
+    static constexpr long stride = 64;
+    static constexpr size_t max_checkpoints = 32u;
+    static constexpr long no_window = -1;
+
+    // Fingerprint of a run, persisted in the database
+    struct Baseline
+    {
+        Value   hash = 0;
+        long    length = 0;
+        size_t  checkpoints = 0;
+        Value   prefix[max_checkpoints] = {};
+        long    window = no_window; // window whose sizes are kept
+        size_t  sizes[stride] = {};
+    };
+
+    // Ordinal range within the test's allocation sequence where it first
+    // differs, a single allocation if located. Ordinals count allocations of
+    // the test and are not CRT allocation request numbers.
+    struct Divergence
+    {
+        long    first = 0;
+        long    last = 0;
+        size_t  size = 0;       // size of located allocation
+        size_t  expected = 0;   // size in previous run of located allocation
+    };
+
+    SequenceFingerprint() = default;
+
+    SequenceFingerprint(const SequenceFingerprint&) = delete;
+    SequenceFingerprint(SequenceFingerprint&&) = delete;
+    SequenceFingerprint& operator=(const SequenceFingerprint&) = delete;
+    SequenceFingerprint& operator=(SequenceFingerprint&&) = delete;
+
+    void Begin(const Baseline* baseline) noexcept;
+    bool Add(size_t size) noexcept; // true if request located as differing
+    void End() noexcept;
+    bool Diverged(Divergence& divergence) const noexcept;
+    const Baseline& Current() const noexcept;
+
+private:
+    void KeepWindow(long window, size_t count) noexcept;
+
+    Baseline    baseline_;
+    Baseline    current_;
+    bool        has_baseline_ = false;
+    long        mismatch_ = no_window; // first differing checkpoint
+    long        located_ = 0;
+    size_t      located_size_ = 0;
+    size_t      ring_[stride] = {};
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// LeakSummary
+//
+// Leaks of all tests in a run grouped by allocation site so that a single bug
+// exercised by many parameterized or typed tests is reported once. Groups are
+// aggregated by merging per-thread partial groups of disjoint record ranges.
+///////////////////////////////////////////////////////////////////////////////
+
+class LeakSummary final
+{
+public:
+    using Key = uint64_t;
+
+    // Identity of a leak site in order of preference. Leaks without a known
+    // site are not grouped since any shared key would merge unrelated sites.
+    enum class KeyKind : uint64_t
+    {
+        None = 0,
+        Fingerprint = 1,    // CRT block type, file and line
+        Location = 2,       // resolved location of captured stack-trace
+        Signature = 3
+    };
+
+    struct Record
+    {
+        Key             key;
+        uint64_t        bytes;
+        DatabaseString  test;
+        DatabaseString  trace;
+    };
+
+    struct Group
+    {
+        Key             key = 0;
+        size_t          tests = 0;
+        uint64_t        bytes = 0;
+        const Record*   representative = nullptr;
+    };
+
+    static constexpr size_t min_records_per_thread = 4096u;
+
+    LeakSummary() = default;
+
+    LeakSummary(const LeakSummary&) = delete;
+    LeakSummary(LeakSummary&&) = delete;
+    LeakSummary& operator=(const LeakSummary&) = delete;
+    LeakSummary& operator=(LeakSummary&&) = delete;
+
+    // Fingerprint should be zero unless the block has a source file, i.e. 
+    // allocated with _CRTDBG_MAP_ALLOC, since it only identifies the type
+    // of block otherwise.
+    static Key MakeKey(StackSignature::Value signature, 
+        const Location& location, uint32_t fingerprint) noexcept;
+    static KeyKind Kind(Key key) noexcept;
+
+    void Add(Key key, uint64_t bytes, const char* test, const char* trace);
+    std::vector<Group> Aggregate(unsigned threads) const;
+    size_t Write(FILE* out, unsigned threads) const;
+    size_t Size() const noexcept;
+
+private:
+    using Records = std::vector<Record, ArenaAllocator<Record, DatabaseArena>>;
+
+    Records records_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// EventRecorder
+//
+// Records allocation events into per-thread single-producer single-consumer
+// ring buffers which a background thread flushes to a trace file per test.
+// Pushing an event never blocks or allocates from the CRT heap, events are 
+// dropped and counted if a buffer is full. Buffers are reserved up-front and
+// committed when a thread records its first event. A buffer is returned when
+// its thread exits and reused by the next thread, threads not getting one 
+// since all are in use are counted.
+///////////////////////////////////////////////////////////////////////////////
+
+class EventRecorder final
+{
+public:
+    static constexpr size_t max_threads = 64u;
+    static constexpr size_t ring_capacity = 16384u; // events, power of two
+    static_assert(max_threads <= 64u, "free rings tracked by 64-bit mask");
+
+    EventRecorder() noexcept = default;
+    ~EventRecorder() noexcept;
+
+    EventRecorder(const EventRecorder&) = delete;
+    EventRecorder(EventRecorder&&) = delete;
+    EventRecorder& operator=(const EventRecorder&) = delete;
+    EventRecorder& operator=(EventRecorder&&) = delete;
+
+    bool Enable();
+    bool Enabled() const noexcept;
+    bool BeginTest(const char* path, const char* test);
+    void Push(const TraceEvent& event) noexcept;
+    void EndTest() noexcept;
+    size_t DroppedThreads() const noexcept; // by the last ended test
+
+    static uint64_t Timestamp() noexcept;
+    static bool WriteWorkload(const char* trace_path, const char* workload_path);
+
+private:
+    struct Ring
+    {
+        std::atomic<uint64_t>   head;   // written by producer
+        std::atomic<uint64_t>   tail;   // written by consumer
+        TraceEvent              events[ring_capacity];
+    };
+
+    // Ring of the calling thread, valid while generation matches the one of
+    // the recorder since an address may be reused by another recorder
+    struct ThreadRing
+    {
+        uint64_t    generation;
+        Ring*       ring;
+        size_t      index;
+        uint64_t    dropped_test; // test the thread was counted dropped by
+        bool        suppress;     // set for the flush thread itself
+    };
+    // Returns the ring of the calling thread when it exits
+    struct ThreadExit
+    {
+        ~ThreadExit() noexcept;
+        bool        armed;
+    };
+
+    Ring* AcquireRing() noexcept;
+    size_t ClaimRing() noexcept;
+    static void ReleaseRing(uint64_t generation, size_t index) noexcept;
+    void Drain() noexcept;              // requires mutex_
+    void Run() noexcept;
+
+    static std::atomic<uint64_t> generations_;
+    static thread_local ThreadRing thread_ring_;
+    static thread_local ThreadExit thread_exit_;
+
+    uint64_t                generation_ = 0u; // assigned when enabled
+    EventRecorder*          next_ = nullptr;  // enabled recorders
+    char*                   base_ = nullptr;
+    std::atomic<Ring*>      rings_[max_threads] = {};
+    std::atomic<size_t>     ring_count_{ 0u };
+    std::atomic<uint64_t>   released_{ 0u };  // mask of rings to reuse
+    std::atomic<uint64_t>   dropped_{ 0u };
+    std::atomic<uint64_t>   tests_{ 0u };
+    std::atomic<size_t>     dropped_threads_{ 0u };
+    size_t                  ended_dropped_threads_ = 0u;
+    std::mutex              mutex_;
+    std::condition_variable wake_;
+    std::thread             flusher_;
+    bool                    stop_ = false;
+    HANDLE                  file_ = INVALID_HANDLE_VALUE;
+    TraceFileHeader         header_ = {};
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// FailureSweep
+//
+// Re-runs a single test in child processes where allocation request N of the
+// test fails, for every N allocated by a clean run of the test. Children are
+// run in parallel and classified by exit code. If the test binary was started
+// by the preload launcher, children are started by the launcher as well since
+// they would otherwise run without the detector. Children are passed the flags
+// of the parent command line except those selecting tests, writing output or
+// changing how leaks are reported.
+///////////////////////////////////////////////////////////////////////////////
+
+class FailureSweep final
+{
+public:
+    static constexpr unsigned long leak_exit_code = 86u;
+
+    enum class Outcome
+    {
+        Passed,     // allocation failure handled
+        Failed,     // test assertion failed, e.g. due to allocation failure
+        Leaked,     // leak detected after allocation failure
+        Crashed     // abnormal termination
+    };
+
+    struct Result
+    {
+        size_t          runs = 0;
+        size_t          passed = 0;
+        size_t          failed = 0;
+        size_t          leaked = 0;
+        size_t          crashed = 0;
+        long            first_leak = 0;     // relative request no
+        long            first_crash = 0;    // relative request no
+        unsigned long   crash_code = 0;
+    };
+
+    static Outcome Classify(unsigned long exit_code) noexcept;
+    static bool IsForwarded(const char* arg) noexcept;
+    static Result Run(const char* test_filter, long allocations, 
+        unsigned parallelism);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// ImportHooks
+//
+// Redirects imports of virtual memory and file mapping functions by the test
+// executable so that such regions are tracked like annotated allocations.
+// Each function has a separate hook so that heap allocations are unaffected.
+///////////////////////////////////////////////////////////////////////////////
+
+class ImportHooks final
+{
+public:
+    static bool Patch(HMODULE module, const char* dll, const char* function,
+        void* replacement, void** original) noexcept;
+    static void Install() noexcept;
+    static void Uninstall() noexcept;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessMemory
+//
+// OS-level memory counters of the current process. Capturing a sample do not
+// allocate from any heap so it may be done within the tracked window.
+///////////////////////////////////////////////////////////////////////////////
+
+struct ProcessMemory
+{
+    struct Sample
+    {
+        uint64_t    working_set = 0;
+        uint64_t    peak_working_set = 0;
+        uint64_t    page_faults = 0;
+        uint64_t    private_bytes = 0;
+    };
+
+    struct Stats
+    {
+        int64_t     working_set_delta = 0;
+        uint64_t    peak_working_set = 0;
+        int64_t     peak_working_set_delta = 0;
+        uint64_t    page_faults = 0;
+        int64_t     committed_pages = 0;
+    };
+
+    static bool Capture(Sample& sample) noexcept;
+    static Stats Difference(const Sample& pre, const Sample& post) noexcept;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// ChildReport
+//
+// Shared memory through which child processes started by a test, e.g. death
+// tests or worker processes running tests of their own, report leaks to the
+// parent. The parent creates a named region per test and passes its name to
+// children in an environment variable. Children add the results of each 
+// completed test with interlocked operations, so nothing is communicated per
+// allocation and results of completed tests survive a crashing child. A test
+// interrupted by the child calling exit, e.g. a death test, is added when the
+// process exits. Blocks it holds at that point are counted separately since
+// they include state of the interrupted test and its death test machinery.
+///////////////////////////////////////////////////////////////////////////////
+
+class ChildReport final
+{
+public:
+    static constexpr const char* variable = "GTEST_MEMLEAK_DETECTOR_SHM";
+
+    struct Totals
+    {
+        uint64_t    processes = 0;      // child processes attached
+        uint64_t    tests = 0;          // tests completed by children
+        uint64_t    leaked_tests = 0;
+        uint64_t    leaked_blocks = 0;
+        uint64_t    leaked_bytes = 0;
+        uint64_t    allocations = 0;
+        uint64_t    exited_tests = 0;   // interrupted by child process exit
+        uint64_t    exited_blocks = 0;  // held at exit by interrupted tests
+        uint64_t    exited_bytes = 0;
+    };
+
+    ChildReport() = default;
+    ~ChildReport() noexcept;
+
+    ChildReport(const ChildReport&) = delete;
+    ChildReport(ChildReport&&) = delete;
+    ChildReport& operator=(const ChildReport&) = delete;
+    ChildReport& operator=(ChildReport&&) = delete;
+
+    // Parent, exports a new region to children started until closed
+    bool Create() noexcept;
+    Totals Close() noexcept;
+
+    // Child, attaches to the region exported by the parent if any
+    bool Attach() noexcept;
+    bool Attached() const noexcept;
+    void Add(uint64_t allocations, uint64_t leaked_blocks, 
+        uint64_t leaked_bytes) noexcept;
+    void AddExited(uint64_t allocations, uint64_t held_blocks,
+        uint64_t held_bytes) noexcept;
+
+private:
+    struct Region
+    {
+        volatile LONG64     processes;
+        volatile LONG64     tests;
+        volatile LONG64     leaked_tests;
+        volatile LONG64     leaked_blocks;
+        volatile LONG64     leaked_bytes;
+        volatile LONG64     allocations;
+        volatile LONG64     exited_tests;
+        volatile LONG64     exited_blocks;
+        volatile LONG64     exited_bytes;
+    };
+
+    bool Map(HANDLE mapping) noexcept;
+    void Release() noexcept;
+
+    HANDLE      mapping_ = nullptr;
+    Region*     region_ = nullptr;
+    bool        exported_ = false;
+    bool        restore_ = false;       // variable set before export
+    char        previous_[MAX_PATH]{};
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // StackTrace
 ///////////////////////////////////////////////////////////////////////////////
@@ -85,6 +1178,10 @@ struct Location
 class StackTrace final : public StackWalker
 {
 public:
+    static constexpr size_t buffer_capacity = 4096 * 4;
+
+    using Buffer = FixedBuffer<buffer_capacity>;
+
     enum class State
     {
         Scanning,
@@ -93,11 +1190,11 @@ public:
         Exception
     };
 
-    StackTrace();
+    explicit StackTrace(FileTable& files);
     virtual ~StackTrace() = default;
 
     State CurrentState() const noexcept;
-    const std::stringstream& Stream() const noexcept;
+    const Buffer& GetBuffer() const noexcept;
     const Location& GetLocation() const noexcept;
     void Reset(State reset_to_state = State::Scanning);
 
@@ -111,7 +1208,8 @@ protected:
         LPCSTR szFuncName, DWORD gle, DWORD64 addr) override;
 
 private:
-    std::stringstream  buffer;
+    FileTable&         files;
+    Buffer             buffer;
     Location           location;
     State              state;
 };
@@ -124,25 +1222,113 @@ class MemoryLeakDetector
 {
 public:
     static constexpr long no_break_alloc = -1;
+    static constexpr long batch_per_suite = LONG_MAX;
+
+    // Determines how a leaking allocation is identified when re-running a 
+    // test to obtain its stack-trace.
+    enum class IdentityMode
+    {
+        Request,    // relative allocation request no
+        Signature   // {stack signature, size, ordinal among same signature}
+    };
+
+    // Per-allocation work done while a test is running. Tests allocating
+    // faster than the trace limit are downgraded from Trace to Count to bound
+    // overhead. The rate is sampled every trace_rate_window allocations.
+    enum class CaptureMode
+    {
+        Trace,      // record identity of every allocation
+        Count       // only count allocation requests
+    };
+
+    static constexpr long trace_rate_window = 4096;
+
+    // When the quiescence wait ends before all blocks of the test are freed
+    enum class QuiescenceCondition
+    {
+        Any,        // heap idle for a window or registered executors idle
+        All         // heap idle for a window and registered executors idle
+    };
+
+    struct Options
+    {
+        IdentityMode identity = IdentityMode::Request;
+        long break_window = 64; // max forward scan if request no mismatch
+        bool growth = false;    // detect growth across --gtest_repeat
+        long growth_min_iterations = 5;
+        bool process_stats = false; // sample OS-level memory counters
+        long trace_limit = 100000; // allocations per second before Count mode
+        long batch_size = 0;    // tests per leak check, 0 checks every test
+        long fail_alloc = 0;    // relative request no to fail, 0 disabled
+        bool fail_sweep = false; // sweep allocation failures of each test
+        long fail_sweep_max = 1000; // max allocations swept per test
+        bool virtual_memory = false; // track VirtualAlloc, MapViewOfFile
+        bool record = false;    // record allocation events to trace files
+        bool workload = false;  // write replayable workload files
+        bool lifetime = false;  // profile block lifetimes and sizes
+        bool children = false;  // merge leaks of child processes
+        long quiescence_timeout = 0; // max ms waited before leak check
+        long quiescence_window = 10; // ms without heap activity
+        QuiescenceCondition quiescence_condition = QuiescenceCondition::Any;
+    };
+
+    struct DatabaseEntry
+    {
+        long                    alloc_no = no_break_alloc;
+        StackSignature::Value   signature = StackSignature::invalid;
+        uint32_t                ordinal = 0;
+        size_t                  size = 0; // 0 if unknown
+        uint32_t                fingerprint = 0;
+        long                    annotation = no_break_alloc; // pool request
+        CaptureMode             mode = CaptureMode::Trace;
+        bool                    isolate = false; // not batched if true
+        SequenceFingerprint::Baseline sequence;
+    };
 
 #ifdef GTEST_MEMLEAK_DETECTOR_DEBUG
     static constexpr size_t debug_buffer_size =
         GTEST_MEMLEAK_DETECTOR_DEBUG_BUFFER_SIZE_BYTES;
 #endif
 
+    using FailureMessage = FixedBuffer<StackTrace::buffer_capacity + 256>;
+
+    // Wait for blocks held by background work of a test before checking it
+    struct Quiescence
+    {
+        long    milliseconds = 0;   // time waited
+        bool    timed_out = false;
+    };
+
     using FailureCallback = std::function<void(
         long leak_alloc_no,
         const char* leak_file,
         unsigned long leak_line,
         const char* leak_trace)>;
 
+    // Invoked for leaks found by a batched check. leak_test is nullptr if
+    // the leak could not be attributed to a single test of the batch.
+    using BatchFailureCallback = std::function<void(
+        const char* leak_test,
+        long leak_alloc_no,
+        size_t batch_tests)>;
+    using BatchDescriptor = std::function<std::string(const void* test)>;
+
     struct State {
         long pre_alloc_no = 0;
         long post_alloc_no = 0;
         long pre_trace_no = 0;
         long post_trace_no = 0;
         long break_alloc = no_break_alloc;
-        long parsed_alloc_no = no_break_alloc;
+        StackSignature::Value break_signature = StackSignature::invalid;
+        uint32_t break_ordinal = 0;
+        size_t break_size = 0;
+        uint32_t break_fingerprint = 0;
+        long break_annotation = no_break_alloc;
+        bool fail_injected = false;
+        CaptureMode mode = CaptureMode::Trace;
+        uint64_t rate_window_start = 0; // timestamp of current rate window
+        bool rate_exceeded = false; // recorded so that re-runs begin in Count
+        bool break_found = false;
         bool discard = false;
 
 #ifdef GTEST_MEMLEAK_DETECTOR_DEBUG
@@ -153,7 +1339,7 @@ public:
     };
 
 	explicit MemoryLeakDetector(int argc, char** argv0);
-	~MemoryLeakDetector() noexcept = default;
+	~MemoryLeakDetector() noexcept;
 
     const MemoryLeakDetector(const MemoryLeakDetector&) = delete;
     const MemoryLeakDetector(MemoryLeakDetector&&) noexcept = delete;
@@ -162,24 +1348,103 @@ public:
 
     static MemoryLeakDetector* Instance() noexcept
     {
-        assert(instance_);
-        return instance_;
+        auto* instance = instance_.load(std::memory_order_acquire);
+        assert(instance);
+        return instance;
     }
 
 	void Start(std::function<std::string()> descriptor);
 	void End(std::function<std::string()> descriptor, bool passed);
 
     static std::string MakeDatabaseFilePath(const char* binary_file_path);
-    static std::string MakeFailureMessage(long leak_alloc_no,
+    static std::string MakeProcessStatsFilePath(const char* binary_file_path);
+    static std::string MakeTraceFilePath(const char* binary_file_path,
+        const char* test);
+    static std::string MakeWorkloadFilePath(const char* binary_file_path,
+        const char* test);
+    static Options ParseOptions(int argc, char** argv);
+    static FailureMessage MakeFailureMessage(long leak_alloc_no,
         const char* leak_file,
         unsigned long leak_line,
-        const char* leak_trace);
+        const char* leak_trace,
+        CaptureMode mode = CaptureMode::Trace);
+    static FailureMessage MakeBatchFailureMessage(const char* leak_test,
+        long leak_alloc_no,
+        size_t batch_tests);
+    static FailureMessage MakeDivergenceMessage(
+        const SequenceFingerprint::Divergence& divergence,
+        const char* trace);
+    static FailureMessage MakeChildLeakMessage(
+        const ChildReport::Totals& totals);
+    static FailureMessage MakeSweepSummary(const FailureSweep::Result& result);
+    static FailureMessage MakeSweepLeakMessage(
+        const FailureSweep::Result& result, const char* filter);
+    static FailureMessage MakeSweepCrashMessage(
+        const FailureSweep::Result& result);
+    static FailureMessage MakeScopeLeakMessage(size_t blocks, size_t bytes,
+        long first_alloc_no);
+    static FailureMessage MakeContextLeakMessage(const char* submitter,
+        size_t blocks, size_t bytes, long first_alloc_no);
+
+    // Batched leak checking where a single checkpoint covers several tests
+    // and leaks are attributed to tests by allocation request no ranges.
+    bool BatchEnabled() const noexcept;
+    bool BatchOpen() const noexcept;
+    bool IsIsolated(std::function<std::string()> descriptor) const;
+    void StartBatch();
+    void StartBatchTest(const void* test);
+    bool EndBatchTest(bool passed) noexcept;
+    void EndBatch(BatchDescriptor descriptor);
+    void SetBatchFailureCallback(BatchFailureCallback callback);
 
     void WriteDatabase();
+    void WriteGrowthReport(FILE* out) const;
+    void WriteLifetimeReport(FILE* out) const;
+    void WriteLeakSummary(FILE* out) const;
+    void WriteProcessStats() const;
+    bool ProcessStatsEnabled() const noexcept;
+    bool GrowthEnabled() const noexcept;
+    bool LifetimeEnabled() const noexcept;
+    bool ChildProcessesEnabled() const noexcept;
+    bool QuiescenceEnabled() const noexcept;
+    long QuiescenceTimeout() const noexcept;
+    bool FailureInjectionEnabled() const noexcept;
+    size_t LeakCount() const noexcept;
+    const LeakSummary& GetLeakSummary() const noexcept;
+    bool SweepEnabled() const noexcept;
+    FailureSweep::Result SweepAllocationFailures(const char* test_filter) const;
+    CaptureMode GetCaptureMode() const noexcept;
+    const ProcessMemory::Stats& GetProcessStats() const noexcept;
+    const LifetimeProfile::Profile& GetLifetimeProfile() const noexcept;
+    const FailureMessage& GetDivergenceMessage() const noexcept;
+    const FailureMessage& GetContextLeakMessage() const noexcept;
+    size_t ForeignOverflow() const noexcept;
+    size_t AnnotationOverflow() const noexcept;
+    size_t TraceOverflow() const noexcept;
+    const ChildReport::Totals& GetChildTotals() const noexcept;
+    const Quiescence& GetQuiescence() const noexcept;
     void SetFailureCallback(FailureCallback callback);
-    void SetTrace(const Location& location, std::string stack_trace);
-    void OnAllocation(int nAllocType, long lRequest);
-    void OnReport(const char* message) noexcept;
+    void SetTrace(const Location& location, const char* stack_trace) noexcept;
+    bool OnAllocation(const AllocationEvent& event);
+    size_t ForEachLeak(const LeakCallback& callback) const;
+
+    static void AnnotateAlloc(const void* pool, const void* ptr, 
+        size_t size) noexcept;
+    static void AnnotateFree(const void* pool, const void* ptr) noexcept;
+
+    static void* AllocateSentinel() noexcept;
+    static void FreeSentinel(void* sentinel) noexcept;
+    static size_t ForEachBlockSince(const void* sentinel, 
+        const LeakCallback& callback);
+    static size_t ForEachBlockBetween(const void* first_sentinel,
+        const void* last_sentinel, const LeakCallback& callback);
+    static long SentinelRequest(const void* sentinel) noexcept;
+
+    static unsigned long long RunningTest() noexcept;
+    static void ReportProcessExit() noexcept;
+    static const LeakContext* CurrentLeakContext() noexcept;
+    static const LeakContext* SwapLeakContext(
+        const LeakContext* context) noexcept;
 
 #ifdef GTEST_MEMLEAK_DETECTOR_DEBUG
 
@@ -242,31 +1507,160 @@ public:
 #endif // GTEST_MEMLEAK_DETECTOR_DEBUG
 
 private:
+    bool CaptureStackTrace();
     void CaptureLeakStackTrace();
+    void CaptureDivergenceStackTrace();
+    bool RecordIdentity(const AllocationEvent& event) noexcept;
+    void RecordEvent(const AllocationEvent& event) noexcept;
+    void ProfileLifetime(const AllocationEvent& event) noexcept;
+    void TrackInFlight(const AllocationEvent& event) noexcept;
+    void WaitForQuiescence() noexcept;
+    bool IsBreakAllocation(const AllocationEvent& event) noexcept;
+    void SampleAllocationRate() noexcept;
+    bool MatchesBreakType(const AllocationEvent& event) const noexcept;
+    class HeapBlocks;
+    bool SetLeakBlockInfo(DatabaseEntry& entry, 
+        const HeapBlocks& blocks, long leak_alloc_no) const noexcept;
+    void SampleGrowth(const DatabaseString& key, const _CrtMemState& diff);
+    void OnAnnotatedAllocation(const void* pool, const void* ptr, 
+        size_t size) noexcept;
+    void OnAnnotatedFree(const void* pool, const void* ptr) noexcept;
+    size_t FindAnnotatedLeak(DatabaseEntry& entry, uint64_t& bytes) const;
+    size_t ForEachHeapLeak(const HeapBlocks& blocks, 
+        const LeakCallback& callback) const;
+    size_t ForEachAnnotatedLeak(const LeakCallback& callback) const;
+    void ChargeForeignLeaks();
+    void SetLeakIdentity(Leak& leak) const noexcept;
+
+    // Marks allocations made while Google Test records a failure reported by
+    // the test thread, since the result retains them beyond the test. Only
+    // installed for failure injection where failed tests are checked as well.
+    class FailureReporter final 
+        : public ::testing::internal::HasNewFatalFailureHelper
+    {
+    public:
+        void ReportTestPartResult(const ::testing::TestPartResult& result) override;
+    };
 
     bool ReadDatabase();
     bool TryReadDatabase();
 
     void SetAllocHook();
     void RevertAllocHook();
+    void SyncAllocNo();
+    void ResetTrace() noexcept;
+    struct BatchTest;
+    BatchTest* FindBatchTest(long request) noexcept;
 
-    using Database = std::unordered_map<std::string, long>;
-    using ReRun = std::vector<std::string>;
+    using Database = std::unordered_map<DatabaseString, DatabaseEntry, 
+        StringHash, std::equal_to<DatabaseString>, 
+        ArenaAllocator<std::pair<const DatabaseString, DatabaseEntry>, 
+            DatabaseArena>>;
+
+    // Identity of each allocation within the current test indexed by
+    // relative allocation request no
+    struct AllocationRecord
+    {
+        StackSignature::Value   signature;
+        uint32_t                ordinal;
+        unsigned long           thread;
+    };
+    using AllocationLog = std::vector<AllocationRecord,
+        ArenaAllocator<AllocationRecord, TraceArena>>;
+    using ProcessStatsLog = std::vector<
+        std::pair<DatabaseString, ProcessMemory::Stats>,
+        ArenaAllocator<std::pair<DatabaseString, ProcessMemory::Stats>, DatabaseArena>>;
+    using LifetimeLog = std::vector<
+        std::pair<DatabaseString, LifetimeProfile::Profile>,
+        ArenaAllocator<std::pair<DatabaseString, LifetimeProfile::Profile>, DatabaseArena>>;
+    // Request no range of each test within the current batch
+    struct BatchTest
+    {
+        const void*     test;
+        long            first_request;
+        long            last_request;
+        long            leak_alloc_no;
+        bool            passed;
+    };
+    using Batch = std::vector<BatchTest, ArenaAllocator<BatchTest, TraceArena>>;
+    using ReRun = std::vector<DatabaseString, 
+        ArenaAllocator<DatabaseString, DatabaseArena>>;
+    // Allocations of the current test made within a LeakContext of another
+    // test, in increasing request no order. Appended by the allocation hook,
+    // hence of fixed capacity with overflowing allocations only counted.
+    struct ForeignLog
+    {
+        static constexpr size_t capacity = 1024u;
+
+        struct Entry
+        {
+            long                request;
+            unsigned long long  test;   // charged to
+        };
+
+        bool Push(long request, unsigned long long test) noexcept;
+        const Entry* Find(long request) const noexcept;
+        bool Empty() const noexcept { return size == 0; }
+        void Clear() noexcept { size = 0; dropped = 0; }
+
+        Entry   entries[capacity];
+        size_t  size = 0;
+        size_t  dropped = 0;            // not recorded since full
+    };
 
-    static MemoryLeakDetector* instance_;
+    static std::atomic<MemoryLeakDetector*> instance_;
+    static std::atomic<unsigned long long> running_test_;
+    static thread_local const LeakContext* leak_context_;
+    static thread_local bool reporting_failure_;
 
+    Options           options_;
     State             state_;
     _CrtMemState      pre_state_;
     int               stored_debug_flags_;
     bool              alloc_hook_set_;
     struct _stat      file_info_;
-    std::string       trace_;
+    StackTrace::Buffer trace_;
     size_t            hash_;
+    FileTable         files_;
     Location          location_;
     std::string       file_path_;
+    std::string       stats_path_;
+    std::string       trace_prefix_;
     Database          db_;
     ReRun             rerun_filter_;
+    SignatureCounter  signatures_;
+    AllocationLog     allocations_;
+    AnnotationTable   annotated_;   // live pool blocks of the test
+    std::atomic<long> annotation_no_{ 0 };
+    std::atomic<bool> armed_{ false }; // test running, hook and annotations
+    ForeignLog        foreign_;     // charged to other tests
+    ForeignLog        reported_;    // retained by results of failures
+    std::unique_ptr<FailureReporter> failure_reporter_;
+    ReRun             test_names_;  // indexed by test identifier - 1
+    FailureMessage    context_leak_; // leak charged to an ended test
+    unsigned long long started_tests_ = 0;
+    std::atomic<long> in_flight_{ 0 };  // live blocks of the test
+    std::atomic<unsigned long> activity_{ 0u }; // heap events of the test
+    Quiescence        quiescence_;
+    GrowthTracker     growth_;
+    LeakSummary       summary_;
+    ProcessMemory::Sample process_pre_;
+    ProcessMemory::Stats process_stats_;
+    ProcessStatsLog   process_log_;
+    LifetimeProfile   lifetime_;
+    LifetimeLog       lifetime_log_; // flagged tests only
+    Batch             batch_;
+    bool              batch_open_ = false;
+    size_t            isolated_ = 0;
+    BatchFailureCallback batch_fail_;
     FailureCallback   fail_;
+    EventRecorder     recorder_;
+    SequenceFingerprint sequence_;
+    StackTrace::Buffer divergence_trace_;
+    FailureMessage    divergence_;
+    ChildReport       parent_;      // attached if started by a test
+    ChildReport       children_;    // exported while a test is running
+    ChildReport::Totals child_totals_;
 #ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
     StackTrace        stack_trace_;
 #endif
@@ -0,0 +1,139 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include "memory_leak_detector.h"
+
+#include <new> // std::bad_alloc, placement new
+
+gtest_memleak_detector::AnnotationTable::AnnotationTable()
+    : shards_(nullptr)
+{
+    // Reserved and committed once, pages are only backed once touched
+    auto* memory = VirtualAlloc(nullptr, shard_count * sizeof(Shard), 
+        MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (memory == nullptr)
+        throw std::bad_alloc();
+    shards_ = static_cast<Shard*>(memory);
+    for (size_t i = 0; i < shard_count; ++i)
+        (void)new (shards_ + i) Shard;
+}
+
+gtest_memleak_detector::AnnotationTable::~AnnotationTable() noexcept
+{
+    if (shards_ != nullptr)
+        (void)VirtualFree(shards_, 0, MEM_RELEASE);
+}
+
+size_t gtest_memleak_detector::AnnotationTable::Hash(const void* ptr) noexcept
+{
+    // Fibonacci hashing, the upper bits select the shard and the slot
+    return static_cast<size_t>(
+        (static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)) >> 4u) * 
+        0x9E3779B97F4A7C15ull >> 32u);
+}
+
+void gtest_memleak_detector::AnnotationTable::Lock(Shard& shard) noexcept
+{
+    while (shard.locked.exchange(true, std::memory_order_acquire))
+    {
+        while (shard.locked.load(std::memory_order_relaxed))
+            YieldProcessor();
+    }
+}
+
+void gtest_memleak_detector::AnnotationTable::Unlock(Shard& shard) noexcept
+{
+    shard.locked.store(false, std::memory_order_release);
+}
+
+bool gtest_memleak_detector::AnnotationTable::Insert(const Block& block) noexcept
+{
+    const auto hash = Hash(block.ptr);
+    auto& shard = shards_[hash % shard_count];
+    const auto mask = shard_capacity - 1u;
+    Lock(shard);
+    for (auto i = (hash / shard_count) & mask; ; i = (i + 1u) & mask)
+    {
+        auto& slot = shard.slots[i];
+        if (slot.ptr == block.ptr)
+        {   // Annotated again without being freed
+            slot = block;
+            break;
+        }
+        if (slot.ptr == nullptr)
+        {   // Bounded load keeps probe sequences short
+            if (shard.size.load(std::memory_order_relaxed) == max_shard_size)
+            {
+                Unlock(shard);
+                dropped_.fetch_add(1u, std::memory_order_relaxed);
+                return false;
+            }
+            slot = block;
+            shard.size.fetch_add(1u, std::memory_order_relaxed);
+            break;
+        }
+    }
+    Unlock(shard);
+    return true;
+}
+
+void gtest_memleak_detector::AnnotationTable::Erase(
+    const void* pool, const void* ptr) noexcept
+{
+    const auto hash = Hash(ptr);
+    auto& shard = shards_[hash % shard_count];
+    const auto mask = shard_capacity - 1u;
+    Lock(shard);
+    auto i = (hash / shard_count) & mask;
+    while (shard.slots[i].ptr != ptr)
+    {
+        if (shard.slots[i].ptr == nullptr)
+        {   // Not annotated within the test or not recorded
+            Unlock(shard);
+            return;
+        }
+        i = (i + 1u) & mask;
+    }
+    if (shard.slots[i].pool != pool)
+    {
+        Unlock(shard);
+        return;
+    }
+
+    // Shift following blocks of the probe sequence back instead of leaving a
+    // tombstone, so that an empty slot always ends a probe sequence
+    for (auto j = (i + 1u) & mask; shard.slots[j].ptr != nullptr; j = (j + 1u) & mask)
+    {
+        const auto home = (Hash(shard.slots[j].ptr) / shard_count) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            shard.slots[i] = shard.slots[j];
+            i = j;
+        }
+    }
+    shard.slots[i] = Block{};
+    shard.size.fetch_sub(1u, std::memory_order_relaxed);
+    Unlock(shard);
+}
+
+void gtest_memleak_detector::AnnotationTable::Clear() noexcept
+{
+    for (size_t i = 0; i < shard_count; ++i)
+    {
+        auto& shard = shards_[i];
+        if (shard.size.load(std::memory_order_relaxed) == 0u)
+            continue; // untouched pages are not backed by memory
+        Lock(shard);
+        for (auto& slot : shard.slots)
+            slot = Block{};
+        shard.size.store(0u, std::memory_order_relaxed);
+        Unlock(shard);
+    }
+    dropped_.store(0u, std::memory_order_relaxed);
+}
+
+size_t gtest_memleak_detector::AnnotationTable::Dropped() const noexcept
+{
+    return dropped_.load(std::memory_order_relaxed);
+}
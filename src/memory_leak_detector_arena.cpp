@@ -0,0 +1,137 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include "memory_leak_detector.h"
+
+#include <new> // std::bad_alloc, placement new
+
+namespace {
+
+inline size_t AlignUp(size_t value, size_t alignment) noexcept
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Constructs an arena in static storage that is intentionally never destroyed 
+// since arena-backed containers owned by e.g. a listener may be destructed
+// after function-local statics during program termination.
+template<class ArenaTag>
+gtest_memleak_detector::Arena& ImmortalArena()
+{
+    alignas(gtest_memleak_detector::Arena) 
+        static char storage[sizeof(gtest_memleak_detector::Arena)];
+    static auto* arena = new (storage) gtest_memleak_detector::Arena(
+        ArenaTag::reserve_bytes);
+    return *arena;
+}
+
+} // anonymous namespace
+
+gtest_memleak_detector::Arena::Arena(size_t reserve_bytes)
+    : base_(nullptr)
+    , reserved_(AlignUp(reserve_bytes, commit_granularity))
+    , committed_(0)
+    , offset_(0)
+    , free_lists_{ nullptr }
+{
+    base_ = static_cast<char*>(
+        VirtualAlloc(nullptr, reserved_, MEM_RESERVE, PAGE_NOACCESS));
+    if (base_ == nullptr)
+        throw std::bad_alloc();
+}
+
+gtest_memleak_detector::Arena::~Arena() noexcept
+{
+    if (base_ != nullptr)
+        (void)VirtualFree(base_, 0, MEM_RELEASE);
+}
+
+size_t gtest_memleak_detector::Arena::SizeClass(size_t size) noexcept
+{
+    auto cls = size_t(0);
+    auto block_size = min_block_size;
+    while (block_size < size && cls < size_class_count)
+    {
+        block_size <<= 1;
+        ++cls;
+    }
+    return cls; // size_class_count if too large to be recycled
+}
+
+void gtest_memleak_detector::Arena::Commit(size_t required_bytes)
+{
+    const auto commit_end = AlignUp(required_bytes, commit_granularity);
+    if (commit_end > reserved_)
+        throw std::bad_alloc(); // reserved address range exhausted
+    if (VirtualAlloc(base_ + committed_, commit_end - committed_, 
+        MEM_COMMIT, PAGE_READWRITE) == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    committed_ = commit_end;
+}
+
+void* gtest_memleak_detector::Arena::Allocate(size_t size, size_t alignment)
+{
+    // Recycle a previously deallocated block if size class is available,
+    // note that blocks are always at least aligned to max_align_t.
+    const auto cls = SizeClass(size);
+    const auto recyclable = cls < size_class_count && 
+        alignment <= alignof(std::max_align_t);
+    if (recyclable && free_lists_[cls] != nullptr)
+    {
+        auto* block = free_lists_[cls];
+        free_lists_[cls] = block->next;
+        return block;
+    }
+
+    const auto bytes = cls < size_class_count ? (min_block_size << cls) : size;
+    const auto offset = AlignUp(offset_, 
+        (std::max)(alignment, alignof(std::max_align_t)));
+    const auto end = offset + bytes;
+    if (end > committed_)
+        Commit(end);
+    offset_ = end;
+    return base_ + offset;
+}
+
+void gtest_memleak_detector::Arena::Deallocate(void* ptr, size_t size) noexcept
+{
+    // Large blocks are only reclaimed when the arena is reset
+    const auto cls = SizeClass(size);
+    if (ptr == nullptr || cls >= size_class_count)
+        return;
+
+    auto* block = static_cast<FreeBlock*>(ptr);
+    block->next = free_lists_[cls];
+    free_lists_[cls] = block;
+}
+
+void gtest_memleak_detector::Arena::Reset() noexcept
+{
+    // Keep committed pages to avoid system calls when arena is reused
+    offset_ = 0;
+    for (auto& free_list : free_lists_)
+        free_list = nullptr;
+}
+
+size_t gtest_memleak_detector::Arena::Used() const noexcept
+{
+    return offset_;
+}
+
+size_t gtest_memleak_detector::Arena::Committed() const noexcept
+{
+    return committed_;
+}
+
+gtest_memleak_detector::Arena& gtest_memleak_detector::TraceArena::Get()
+{
+    return ImmortalArena<TraceArena>();
+}
+
+gtest_memleak_detector::Arena& gtest_memleak_detector::DatabaseArena::Get()
+{
+    return ImmortalArena<DatabaseArena>();
+}
@@ -0,0 +1,263 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include <gtest_memleak_detector/gtest_memleak_detector.h>
+#include "memory_leak_detector.h"
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+namespace {
+
+struct LockedCall
+{
+    gtest_memleak_detector::AllocationBus::LockedFunction function;
+    void*   context;
+    void*   probe;
+    bool    invoked;
+};
+
+// Call of RunLocked in progress on this thread if any
+thread_local LockedCall* locked_call = nullptr;
+
+} // anonymous namespace
+
+// Allocation hook installed into the CRT. Note that the name is used to locate
+// the allocating frame when capturing stack traces.
+extern "C" int GTestMemoryLeakDetector4ll0c470rh00k(
+    int nAllocType, void* pvData,
+    size_t nSize, int nBlockUse, long lRequest,
+    const unsigned char* szFileName, int nLine) noexcept
+{
+    return gtest_memleak_detector::AllocationBus::Get().Dispatch(nAllocType,
+        pvData, nSize, nBlockUse, lRequest, szFileName, nLine);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AllocationBus
+///////////////////////////////////////////////////////////////////////////////
+
+gtest_memleak_detector::AllocationBus&
+gtest_memleak_detector::AllocationBus::Get() noexcept
+{
+    static AllocationBus bus;
+    return bus;
+}
+
+bool gtest_memleak_detector::AllocationBus::Subscribe(
+    AllocationSubscriber callback, void* context)
+{
+    if (callback == nullptr)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto* current = current_.load();
+    const auto count = (current != nullptr) ? current->count : 0u;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (current->items[i].callback == callback &&
+            current->items[i].context == context)
+            return false; // already subscribed
+    }
+
+    // Subscribers are stored outside the CRT heap to not invoke the hook
+    auto* subscribers = Allocate(count + 1);
+    if (subscribers == nullptr)
+        return false;
+    if (count != 0)
+        std::copy(current->items, current->items + count, subscribers->items);
+    subscribers->items[count] = Subscriber{ callback, context };
+    Publish(subscribers);
+
+    if (!installed_)
+    {
+        // "warning C5039: '_CrtSetAllocHook', false positive, see detector
+        #pragma warning( push )
+        #pragma warning( disable : 5039 )
+        previous_ = _CrtSetAllocHook(GTestMemoryLeakDetector4ll0c470rh00k);
+        #pragma warning( pop )
+        installed_ = true;
+    }
+    return true;
+}
+
+bool gtest_memleak_detector::AllocationBus::Unsubscribe(
+    AllocationSubscriber callback, void* context)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto* current = current_.load();
+    const auto count = (current != nullptr) ? current->count : 0u;
+    size_t index = 0;
+    while (index < count && (current->items[index].callback != callback ||
+        current->items[index].context != context))
+    {
+        ++index;
+    }
+    if (index == count)
+        return false; // not subscribed
+
+    Array* subscribers = nullptr;
+    if (count > 1)
+    {
+        subscribers = Allocate(count - 1);
+        if (subscribers == nullptr)
+            return false;
+        std::copy(current->items, current->items + index, subscribers->items);
+        std::copy(current->items + index + 1, current->items + count,
+            subscribers->items + index);
+    }
+
+    // Remove the CRT hook with the last subscriber unless another hook has
+    // been installed on top of it, in which case it keeps forwarding to the
+    // previous hook until subscribed again.
+    if (count == 1 && _CrtGetAllocHook() == GTestMemoryLeakDetector4ll0c470rh00k)
+    {
+        #pragma warning( push )
+        #pragma warning( disable : 5039 )
+        (void)_CrtSetAllocHook(previous_.load());
+        #pragma warning( pop )
+        installed_ = false;
+    }
+    Publish(subscribers);
+    return true;
+}
+
+size_t gtest_memleak_detector::AllocationBus::Size() const noexcept
+{
+    const auto* current = current_.load();
+    return (current != nullptr) ? current->count : 0u;
+}
+
+int gtest_memleak_detector::AllocationBus::Dispatch(int type, void* data,
+    size_t size, int block_use, long request, const unsigned char* file,
+    int line) noexcept
+{
+    auto* call = locked_call;
+    if (call != nullptr && _BLOCK_TYPE(block_use) == _CRT_BLOCK)
+    {   // Probe of RunLocked, the only CRT block allocated by the call
+        if (type == _HOOK_FREE && data == call->probe)
+        {
+            call->function(call->context, data);
+            call->invoked = true;
+        }
+        return TRUE;
+    }
+
+    const auto epoch = Enter();
+    auto result = TRUE;
+    const auto* subscribers = current_.load();
+    if (subscribers != nullptr)
+    {
+        for (size_t i = 0; i < subscribers->count; ++i)
+        {
+            const auto& subscriber = subscribers->items[i];
+            if (!subscriber.callback(subscriber.context, type, data, size,
+                block_use, request, file, line))
+            {
+                result = FALSE; // request failed
+                break;
+            }
+        }
+    }
+    Leave(epoch);
+
+    const auto previous = previous_.load();
+    if (result && previous != nullptr)
+    {   // Forward call to previously installed hook
+        result = previous(type, data, size, block_use, request, file, line);
+    }
+    return result;
+}
+
+bool gtest_memleak_detector::AllocationBus::RunLocked(LockedFunction function,
+    void* context) noexcept
+{
+    LockedCall call{ function, context, nullptr, false };
+    std::lock_guard<std::mutex> lock(mutex_); // keeps the hook installed
+    const auto install = !installed_;
+    #pragma warning( push )
+    #pragma warning( disable : 5039 )
+    if (install)
+        previous_ = _CrtSetAllocHook(GTestMemoryLeakDetector4ll0c470rh00k);
+    locked_call = &call;
+    call.probe = _malloc_dbg(1, _CRT_BLOCK, __FILE__, __LINE__);
+    if (call.probe != nullptr)
+        _free_dbg(call.probe, _CRT_BLOCK);
+    locked_call = nullptr;
+    if (install && _CrtGetAllocHook() == GTestMemoryLeakDetector4ll0c470rh00k)
+        (void)_CrtSetAllocHook(previous_.load());
+    #pragma warning( pop )
+    return call.invoked;
+}
+
+gtest_memleak_detector::AllocationBus::Array*
+gtest_memleak_detector::AllocationBus::Allocate(size_t count) noexcept
+{
+    auto* subscribers = static_cast<Array*>(HeapAlloc(GetProcessHeap(), 0,
+        sizeof(Array) + (count - 1) * sizeof(Subscriber)));
+    if (subscribers != nullptr)
+        subscribers->count = count;
+    return subscribers;
+}
+
+unsigned gtest_memleak_detector::AllocationBus::Enter() noexcept
+{
+    // Retry if the epoch flipped in between to never increment a count the
+    // writer is no longer waiting for after it observed the flip.
+    for (;;)
+    {
+        const auto epoch = epoch_.load();
+        readers_[epoch & 1u].fetch_add(1);
+        if (epoch_.load() == epoch)
+            return epoch;
+        readers_[epoch & 1u].fetch_sub(1);
+    }
+}
+
+void gtest_memleak_detector::AllocationBus::Leave(unsigned epoch) noexcept
+{
+    readers_[epoch & 1u].fetch_sub(1);
+}
+
+void gtest_memleak_detector::AllocationBus::Publish(Array* subscribers) noexcept
+{
+    // Readers observing the previous array entered before the flip, wait for
+    // them to leave before releasing it. Readers entering after the flip only
+    // observe the new array.
+    auto* previous = current_.exchange(subscribers);
+    const auto epoch = epoch_.fetch_add(1u);
+    while (readers_[epoch & 1u].load() != 0)
+        (void)SwitchToThread();
+    if (previous != nullptr)
+        (void)HeapFree(GetProcessHeap(), 0, previous);
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+///////////////////////////////////////////////////////////////////////////////
+// Public API
+///////////////////////////////////////////////////////////////////////////////
+
+bool gtest_memleak_detector::Subscribe(AllocationSubscriber subscriber,
+    void* context)
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    return AllocationBus::Get().Subscribe(subscriber, context);
+#else
+    UNREFERENCED_PARAMETER(subscriber);
+    UNREFERENCED_PARAMETER(context);
+    return false;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+bool gtest_memleak_detector::Unsubscribe(AllocationSubscriber subscriber,
+    void* context)
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    return AllocationBus::Get().Unsubscribe(subscriber, context);
+#else
+    UNREFERENCED_PARAMETER(subscriber);
+    UNREFERENCED_PARAMETER(context);
+    return false;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
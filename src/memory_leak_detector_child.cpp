@@ -0,0 +1,142 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include "memory_leak_detector.h"
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+namespace {
+
+uint64_t Read(volatile LONG64& value) noexcept
+{
+    return static_cast<uint64_t>(InterlockedCompareExchange64(&value, 0, 0));
+}
+
+void Add(volatile LONG64& value, uint64_t n) noexcept
+{
+    if (n != 0)
+        (void)InterlockedAdd64(&value, static_cast<LONG64>(n));
+}
+
+} // anonymous namespace
+
+gtest_memleak_detector::ChildReport::~ChildReport() noexcept
+{
+    if (exported_)
+        (void)Close();
+    Release();
+}
+
+bool gtest_memleak_detector::ChildReport::Create() noexcept
+{
+    // Unique per test since children may outlive the test that started them
+    static unsigned long sequence = 0;
+    char name[MAX_PATH];
+    (void)snprintf(name, sizeof(name), "Local\\gtest_memleak_detector_%lu_%lu",
+        GetCurrentProcessId(), ++sequence);
+    auto* mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr,
+        PAGE_READWRITE, 0, static_cast<DWORD>(sizeof(Region)), name);
+    if (mapping == nullptr || !Map(mapping))
+        return false;
+
+    // Restore the name exported by our own parent when closed, if any
+    const auto length = GetEnvironmentVariableA(
+        variable, previous_, static_cast<DWORD>(sizeof(previous_)));
+    restore_ = length != 0 && length < sizeof(previous_);
+    exported_ = SetEnvironmentVariableA(variable, name) != FALSE;
+    return exported_;
+}
+
+gtest_memleak_detector::ChildReport::Totals
+gtest_memleak_detector::ChildReport::Close() noexcept
+{
+    Totals totals;
+    if (exported_)
+    {
+        (void)SetEnvironmentVariableA(variable, restore_ ? previous_ : nullptr);
+        exported_ = false;
+    }
+    if (region_ != nullptr)
+    {
+        totals.processes = Read(region_->processes);
+        totals.tests = Read(region_->tests);
+        totals.leaked_tests = Read(region_->leaked_tests);
+        totals.leaked_blocks = Read(region_->leaked_blocks);
+        totals.leaked_bytes = Read(region_->leaked_bytes);
+        totals.allocations = Read(region_->allocations);
+        totals.exited_tests = Read(region_->exited_tests);
+        totals.exited_blocks = Read(region_->exited_blocks);
+        totals.exited_bytes = Read(region_->exited_bytes);
+    }
+    Release();
+    return totals;
+}
+
+bool gtest_memleak_detector::ChildReport::Attach() noexcept
+{
+    char name[MAX_PATH];
+    const auto length = GetEnvironmentVariableA(
+        variable, name, static_cast<DWORD>(sizeof(name)));
+    if (length == 0 || length >= sizeof(name))
+        return false;
+    auto* mapping = OpenFileMappingA(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name);
+    if (mapping == nullptr || !Map(mapping))
+        return false; // parent test already ended
+    (void)InterlockedIncrement64(&region_->processes);
+    return true;
+}
+
+bool gtest_memleak_detector::ChildReport::Attached() const noexcept
+{
+    return region_ != nullptr;
+}
+
+void gtest_memleak_detector::ChildReport::Add(uint64_t allocations,
+    uint64_t leaked_blocks, uint64_t leaked_bytes) noexcept
+{
+    if (region_ == nullptr)
+        return;
+    ::Add(region_->tests, 1u);
+    ::Add(region_->leaked_tests, (leaked_blocks != 0) ? 1u : 0u);
+    ::Add(region_->leaked_blocks, leaked_blocks);
+    ::Add(region_->leaked_bytes, leaked_bytes);
+    ::Add(region_->allocations, allocations);
+}
+
+void gtest_memleak_detector::ChildReport::AddExited(uint64_t allocations,
+    uint64_t held_blocks, uint64_t held_bytes) noexcept
+{
+    if (region_ == nullptr)
+        return;
+    ::Add(region_->exited_tests, 1u);
+    ::Add(region_->exited_blocks, held_blocks);
+    ::Add(region_->exited_bytes, held_bytes);
+    ::Add(region_->allocations, allocations);
+}
+
+bool gtest_memleak_detector::ChildReport::Map(HANDLE mapping) noexcept
+{
+    auto* view = MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE,
+        0, 0, sizeof(Region));
+    if (view == nullptr)
+    {
+        CloseHandle(mapping);
+        return false;
+    }
+    mapping_ = mapping;
+    region_ = static_cast<Region*>(view);
+    return true;
+}
+
+void gtest_memleak_detector::ChildReport::Release() noexcept
+{
+    if (region_ != nullptr)
+        (void)UnmapViewOfFile(region_);
+    if (mapping_ != nullptr)
+        (void)CloseHandle(mapping_);
+    region_ = nullptr;
+    mapping_ = nullptr;
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
@@ -0,0 +1,87 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include <gtest_memleak_detector/gtest_memleak_detector.h>
+#include "memory_leak_detector.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// ExecutorRegistry
+///////////////////////////////////////////////////////////////////////////////
+
+gtest_memleak_detector::ExecutorRegistry&
+gtest_memleak_detector::ExecutorRegistry::Get() noexcept
+{
+    static ExecutorRegistry registry;
+    return registry;
+}
+
+bool gtest_memleak_detector::ExecutorRegistry::Register(
+    IdleProbe probe, void* context)
+{
+    if (probe == nullptr)
+        return false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto* end = executors_ + count_;
+    if (count_ == capacity || std::any_of(executors_, end,
+        [&](const Executor& executor)
+        { return executor.probe == probe && executor.context == context; }))
+    {
+        return false;
+    }
+    executors_[count_++] = Executor{ probe, context };
+    return true;
+}
+
+bool gtest_memleak_detector::ExecutorRegistry::Unregister(
+    IdleProbe probe, void* context)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto* end = executors_ + count_;
+    auto* it = std::find_if(executors_, end, [&](const Executor& executor)
+        { return executor.probe == probe && executor.context == context; });
+    if (it == end)
+        return false;
+    std::copy(it + 1, end, it);
+    --count_;
+    return true;
+}
+
+bool gtest_memleak_detector::ExecutorRegistry::Idle()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::all_of(executors_, executors_ + count_,
+        [](const Executor& executor) { return executor.probe(executor.context); });
+}
+
+size_t gtest_memleak_detector::ExecutorRegistry::Count()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Public API
+///////////////////////////////////////////////////////////////////////////////
+
+bool gtest_memleak_detector::RegisterExecutor(IdleProbe probe, void* context)
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    return ExecutorRegistry::Get().Register(probe, context);
+#else
+    UNREFERENCED_PARAMETER(probe);
+    UNREFERENCED_PARAMETER(context);
+    return false;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
+bool gtest_memleak_detector::UnregisterExecutor(IdleProbe probe, void* context)
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    return ExecutorRegistry::Get().Unregister(probe, context);
+#else
+    UNREFERENCED_PARAMETER(probe);
+    UNREFERENCED_PARAMETER(context);
+    return false;
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
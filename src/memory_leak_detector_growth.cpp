@@ -0,0 +1,146 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include "memory_leak_detector.h"
+
+#include <cinttypes>
+
+///////////////////////////////////////////////////////////////////////////////
+// GrowthTracker::Fit
+///////////////////////////////////////////////////////////////////////////////
+
+void gtest_memleak_detector::GrowthTracker::Fit::Add(double x, double y) noexcept
+{
+    n += 1.0;
+    sum_x += x;
+    sum_xx += x * x;
+    sum_y += y;
+    sum_xy += x * y;
+    sum_yy += y * y;
+}
+
+double gtest_memleak_detector::GrowthTracker::Fit::Slope() const noexcept
+{
+    const auto denominator = n * sum_xx - sum_x * sum_x;
+    if (denominator <= 0.0)
+        return 0.0;
+    return (n * sum_xy - sum_x * sum_y) / denominator;
+}
+
+double gtest_memleak_detector::GrowthTracker::Fit::RSquared() const noexcept
+{
+    // Coefficient of determination, zero if either variable is constant
+    const auto var_x = n * sum_xx - sum_x * sum_x;
+    const auto var_y = n * sum_yy - sum_y * sum_y;
+    if (var_x <= 0.0 || var_y <= 0.0)
+        return 0.0;
+    const auto cov = n * sum_xy - sum_x * sum_y;
+    return (cov * cov) / (var_x * var_y);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrowthTracker::Trend
+///////////////////////////////////////////////////////////////////////////////
+
+void gtest_memleak_detector::GrowthTracker::Trend::AddSite(
+    FileTable::Id file, unsigned long line, 
+    StackSignature::Value signature, size_t bytes) noexcept
+{
+    // Keep a bounded set of the heaviest sites. A new site replaces the 
+    // lightest tracked site when the set is full.
+    Site* lightest = &sites[0];
+    for (auto& site : sites)
+    {
+        if (site.blocks != 0 && site.file == file && site.line == line && 
+            site.signature == signature)
+        {
+            site.bytes += bytes;
+            ++site.blocks;
+            return;
+        }
+        if (site.bytes < lightest->bytes)
+            lightest = &site;
+    }
+
+    if (lightest->blocks != 0 && lightest->bytes >= bytes)
+        return;
+    *lightest = Site{ file, line, signature, bytes, 1u };
+}
+
+bool gtest_memleak_detector::GrowthTracker::Trend::Growing(
+    long min_iterations) const noexcept
+{
+    return bytes.n >= static_cast<double>(min_iterations) &&
+        bytes.Slope() > 0.0 &&
+        bytes.RSquared() >= min_r_squared;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrowthTracker
+///////////////////////////////////////////////////////////////////////////////
+
+gtest_memleak_detector::GrowthTracker::Trend& 
+gtest_memleak_detector::GrowthTracker::Sample(
+    const DatabaseString& test, int64_t delta_bytes, int64_t delta_blocks)
+{
+    auto& trend = trends_[test];
+    const auto x = trend.bytes.n;
+    trend.retained_bytes += delta_bytes;
+    trend.retained_blocks += delta_blocks;
+    trend.bytes.Add(x, static_cast<double>(trend.retained_bytes));
+    trend.blocks.Add(x, static_cast<double>(trend.retained_blocks));
+    return trend;
+}
+
+size_t gtest_memleak_detector::GrowthTracker::Report(
+    FILE* out, const FileTable& files, long min_iterations) const
+{
+    using Entry = std::pair<const DatabaseString*, const Trend*>;
+    std::vector<Entry> growing;
+    for (const auto& kvp : trends_)
+    {
+        if (kvp.second.Growing(min_iterations))
+            growing.emplace_back(&kvp.first, &kvp.second);
+    }
+
+    // Report steepest growth first
+    std::sort(growing.begin(), growing.end(), [](const Entry& lhs, const Entry& rhs) {
+        return lhs.second->bytes.Slope() > rhs.second->bytes.Slope();
+    });
+
+    for (const auto& entry : growing)
+    {
+        const auto& trend = *entry.second;
+        fprintf(out, "[ MEMLEAK  ] %s grows %.1f bytes (%.1f blocks) per iteration "
+            "(r2=%.3f, iterations=%.0f)\n",
+            entry.first->c_str(), trend.bytes.Slope(), trend.blocks.Slope(),
+            trend.bytes.RSquared(), trend.bytes.n);
+
+        Site sites[max_sites];
+        std::copy(std::begin(trend.sites), std::end(trend.sites), std::begin(sites));
+        std::sort(std::begin(sites), std::end(sites), [](const Site& lhs, const Site& rhs) {
+            return lhs.bytes > rhs.bytes;
+        });
+        for (size_t i = 0; i < reported_sites && sites[i].blocks != 0; ++i)
+        {
+            const auto& site = sites[i];
+            if (site.file != FileTable::invalid_id)
+            {
+                fprintf(out, "[ MEMLEAK  ]   %s(%lu): %" PRIu64 " bytes in %" PRIu64 " blocks\n",
+                    files.Name(site.file), site.line, site.bytes, site.blocks);
+            }
+            else if (site.signature != StackSignature::invalid)
+            {
+                fprintf(out, "[ MEMLEAK  ]   signature 0x%08" PRIx32 ": %" PRIu64 " bytes in %" PRIu64 " blocks\n",
+                    site.signature, site.bytes, site.blocks);
+            }
+            else
+            {
+                fprintf(out, "[ MEMLEAK  ]   site unknown: %" PRIu64 " bytes in %" PRIu64 " blocks\n",
+                    site.bytes, site.blocks);
+            }
+        }
+    }
+    return growing.size();
+}
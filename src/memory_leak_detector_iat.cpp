@@ -0,0 +1,191 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include <gtest_memleak_detector/gtest_memleak_detector.h>
+#include "memory_leak_detector.h"
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+namespace {
+
+// Pool tags, only the addresses are significant
+const char virtual_alloc_pool = 0;
+const char map_view_pool = 0;
+
+using VirtualAllocFn = LPVOID (WINAPI*)(LPVOID, SIZE_T, DWORD, DWORD);
+using VirtualFreeFn = BOOL (WINAPI*)(LPVOID, SIZE_T, DWORD);
+using MapViewOfFileFn = LPVOID (WINAPI*)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+using UnmapViewOfFileFn = BOOL (WINAPI*)(LPCVOID);
+
+VirtualAllocFn original_virtual_alloc = nullptr;
+VirtualFreeFn original_virtual_free = nullptr;
+MapViewOfFileFn original_map_view_of_file = nullptr;
+UnmapViewOfFileFn original_unmap_view_of_file = nullptr;
+
+unsigned install_count = 0;
+
+size_t RoundUpToPage(size_t size) noexcept
+{
+    static const auto page_size = []() {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return static_cast<size_t>(info.dwPageSize);
+    }();
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+} // anonymous namespace
+
+// The hooks below are named with the prefix filtered by StackTrace so that
+// captured traces start at the caller of the original function.
+
+extern "C" LPVOID WINAPI GTestMemoryLeakDetectorVirtualAlloc(
+    LPVOID address, SIZE_T size, DWORD type, DWORD protect)
+{
+    auto* ptr = original_virtual_alloc(address, size, type, protect);
+
+    // Only reservations create regions, commits within reserved regions
+    // (e.g. by the detector arenas) are not tracked
+    if (ptr != nullptr && (type & MEM_RESERVE) != 0)
+        gtest_memleak_detector::AnnotateAlloc(
+            &virtual_alloc_pool, ptr, RoundUpToPage(size));
+    return ptr;
+}
+
+extern "C" BOOL WINAPI GTestMemoryLeakDetectorVirtualFree(
+    LPVOID address, SIZE_T size, DWORD type)
+{
+    if ((type & MEM_RELEASE) != 0)
+        gtest_memleak_detector::AnnotateFree(&virtual_alloc_pool, address);
+    return original_virtual_free(address, size, type);
+}
+
+extern "C" LPVOID WINAPI GTestMemoryLeakDetectorMapViewOfFile(
+    HANDLE mapping, DWORD access, DWORD offset_high, DWORD offset_low,
+    SIZE_T bytes)
+{
+    auto* ptr = original_map_view_of_file(
+        mapping, access, offset_high, offset_low, bytes);
+    if (ptr != nullptr)
+    {
+        // Zero maps until the end of the mapping, ask for the view size
+        if (bytes == 0)
+        {
+            MEMORY_BASIC_INFORMATION info{};
+            if (VirtualQuery(ptr, &info, sizeof(info)) != 0)
+                bytes = info.RegionSize;
+        }
+        gtest_memleak_detector::AnnotateAlloc(
+            &map_view_pool, ptr, RoundUpToPage(bytes));
+    }
+    return ptr;
+}
+
+extern "C" BOOL WINAPI GTestMemoryLeakDetectorUnmapViewOfFile(LPCVOID address)
+{
+    gtest_memleak_detector::AnnotateFree(&map_view_pool, address);
+    return original_unmap_view_of_file(address);
+}
+
+bool gtest_memleak_detector::ImportHooks::Patch(HMODULE module, 
+    const char* dll, const char* function, void* replacement, 
+    void** original) noexcept
+{
+    auto* base = reinterpret_cast<char*>(module);
+    const auto* dos = reinterpret_cast<const IMAGE_DOS_HEADER*>(base);
+    if (dos->e_magic != IMAGE_DOS_SIGNATURE)
+        return false;
+    const auto* nt = reinterpret_cast<const IMAGE_NT_HEADERS*>(
+        base + dos->e_lfanew);
+    if (nt->Signature != IMAGE_NT_SIGNATURE)
+        return false;
+    const auto& directory = 
+        nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+    if (directory.VirtualAddress == 0)
+        return false;
+
+    auto* descriptor = reinterpret_cast<const IMAGE_IMPORT_DESCRIPTOR*>(
+        base + directory.VirtualAddress);
+    for (; descriptor->Name != 0; ++descriptor)
+    {
+        if (_stricmp(base + descriptor->Name, dll) != 0)
+            continue;
+        if (descriptor->OriginalFirstThunk == 0)
+            continue; // names are unavailable, e.g. bound imports
+
+        auto* names = reinterpret_cast<const IMAGE_THUNK_DATA*>(
+            base + descriptor->OriginalFirstThunk);
+        auto* thunk = reinterpret_cast<IMAGE_THUNK_DATA*>(
+            base + descriptor->FirstThunk);
+        for (; names->u1.AddressOfData != 0; ++names, ++thunk)
+        {
+            if (IMAGE_SNAP_BY_ORDINAL(names->u1.Ordinal))
+                continue;
+            const auto* import = reinterpret_cast<const IMAGE_IMPORT_BY_NAME*>(
+                base + names->u1.AddressOfData);
+            if (strcmp(import->Name, function) != 0)
+                continue;
+
+            DWORD protect;
+            if (!VirtualProtect(&thunk->u1.Function, sizeof(thunk->u1.Function),
+                PAGE_READWRITE, &protect))
+            {
+                return false;
+            }
+            if (original != nullptr)
+                *original = reinterpret_cast<void*>(thunk->u1.Function);
+            thunk->u1.Function = reinterpret_cast<uintptr_t>(replacement);
+            VirtualProtect(&thunk->u1.Function, sizeof(thunk->u1.Function),
+                protect, &protect);
+            return true;
+        }
+    }
+    return false;
+}
+
+void gtest_memleak_detector::ImportHooks::Install() noexcept
+{
+    if (install_count++ != 0)
+        return;
+
+    // Resolve the originals first so that hooks are valid even if the 
+    // executable do not import all of the functions
+    auto* kernel32 = GetModuleHandleA("kernel32.dll");
+    original_virtual_alloc = reinterpret_cast<VirtualAllocFn>(
+        GetProcAddress(kernel32, "VirtualAlloc"));
+    original_virtual_free = reinterpret_cast<VirtualFreeFn>(
+        GetProcAddress(kernel32, "VirtualFree"));
+    original_map_view_of_file = reinterpret_cast<MapViewOfFileFn>(
+        GetProcAddress(kernel32, "MapViewOfFile"));
+    original_unmap_view_of_file = reinterpret_cast<UnmapViewOfFileFn>(
+        GetProcAddress(kernel32, "UnmapViewOfFile"));
+
+    auto* module = GetModuleHandleA(nullptr);
+    Patch(module, "kernel32.dll", "VirtualAlloc", 
+        reinterpret_cast<void*>(&GTestMemoryLeakDetectorVirtualAlloc), nullptr);
+    Patch(module, "kernel32.dll", "VirtualFree", 
+        reinterpret_cast<void*>(&GTestMemoryLeakDetectorVirtualFree), nullptr);
+    Patch(module, "kernel32.dll", "MapViewOfFile", 
+        reinterpret_cast<void*>(&GTestMemoryLeakDetectorMapViewOfFile), nullptr);
+    Patch(module, "kernel32.dll", "UnmapViewOfFile", 
+        reinterpret_cast<void*>(&GTestMemoryLeakDetectorUnmapViewOfFile), nullptr);
+}
+
+void gtest_memleak_detector::ImportHooks::Uninstall() noexcept
+{
+    if (install_count == 0 || --install_count != 0)
+        return;
+
+    auto* module = GetModuleHandleA(nullptr);
+    Patch(module, "kernel32.dll", "VirtualAlloc", 
+        reinterpret_cast<void*>(original_virtual_alloc), nullptr);
+    Patch(module, "kernel32.dll", "VirtualFree", 
+        reinterpret_cast<void*>(original_virtual_free), nullptr);
+    Patch(module, "kernel32.dll", "MapViewOfFile", 
+        reinterpret_cast<void*>(original_map_view_of_file), nullptr);
+    Patch(module, "kernel32.dll", "UnmapViewOfFile", 
+        reinterpret_cast<void*>(original_unmap_view_of_file), nullptr);
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
@@ -0,0 +1,183 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include "memory_leak_detector.h"
+
+#include <cinttypes>
+
+///////////////////////////////////////////////////////////////////////////////
+// LifetimeProfile::Histogram
+///////////////////////////////////////////////////////////////////////////////
+
+void gtest_memleak_detector::LifetimeProfile::Histogram::Add(
+    uint64_t value) noexcept
+{
+    ++counts[Bucket(value)];
+}
+
+size_t gtest_memleak_detector::LifetimeProfile::Histogram::Bucket(
+    uint64_t value) noexcept
+{
+    size_t bucket = 0;
+    for (; value != 0 && bucket < buckets - 1; value >>= 1)
+        ++bucket;
+    return bucket;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LifetimeProfile::Site
+///////////////////////////////////////////////////////////////////////////////
+
+bool gtest_memleak_detector::LifetimeProfile::Site::ShortLived() const noexcept
+{
+    return frees >= min_site_frees && short_lived * 2u > frees;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LifetimeProfile::Profile
+///////////////////////////////////////////////////////////////////////////////
+
+bool gtest_memleak_detector::LifetimeProfile::Profile::ShortLived() const noexcept
+{
+    return frees >= min_frees && short_lived * 2u > frees;
+}
+
+bool gtest_memleak_detector::LifetimeProfile::Profile::Flagged() const noexcept
+{
+    if (ShortLived())
+        return true;
+    for (const auto& site : sites)
+    {
+        if (site.ShortLived())
+            return true;
+    }
+    return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LifetimeProfile
+///////////////////////////////////////////////////////////////////////////////
+
+void gtest_memleak_detector::LifetimeProfile::Reset(long first_request) noexcept
+{
+    // Live table entries of previous tests are never matched since request
+    // numbers are increasing, hence the table do not need to be cleared.
+    profile_ = Profile();
+    first_request_ = first_request;
+    if (frequency_ == 0)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        frequency_ = static_cast<uint64_t>(frequency.QuadPart);
+    }
+}
+
+void gtest_memleak_detector::LifetimeProfile::OnAllocation(long request,
+    size_t size, StackSignature::Value signature, uint64_t timestamp) noexcept
+{
+    ++profile_.allocations;
+    profile_.sizes.Add(size);
+    live_[static_cast<size_t>(request) & (live_capacity - 1)] =
+        Live{ request, signature, timestamp };
+}
+
+void gtest_memleak_detector::LifetimeProfile::OnFree(long request,
+    long last_request, uint64_t timestamp) noexcept
+{
+    if (request <= first_request_)
+        return; // allocated before the test started
+
+    const auto requests = static_cast<uint64_t>(last_request - request);
+    const auto short_lived = requests <= short_lived_requests;
+    ++profile_.frees;
+    profile_.requests.Add(requests);
+    if (short_lived)
+        ++profile_.short_lived;
+
+    auto& live = live_[static_cast<size_t>(request) & (live_capacity - 1)];
+    if (live.request != request)
+    {   // Evicted by a more recent allocation
+        ++profile_.untracked;
+        return;
+    }
+    live.request = 0;
+
+    // Split to avoid overflow of ticks * 10^9 for long-lived blocks
+    const auto ticks = timestamp - live.timestamp;
+    profile_.nanoseconds.Add((ticks / frequency_) * 1000000000u +
+        (ticks % frequency_) * 1000000000u / frequency_);
+
+    auto* site = FindSite(live.signature);
+    if (site != nullptr)
+    {
+        ++site->frees;
+        if (short_lived)
+            ++site->short_lived;
+    }
+}
+
+const gtest_memleak_detector::LifetimeProfile::Profile&
+gtest_memleak_detector::LifetimeProfile::Get() const noexcept
+{
+    return profile_;
+}
+
+gtest_memleak_detector::LifetimeProfile::Site*
+gtest_memleak_detector::LifetimeProfile::FindSite(
+    StackSignature::Value signature) noexcept
+{
+    if (signature == StackSignature::invalid)
+        return nullptr;
+    for (size_t i = 0; i < max_sites; ++i)
+    {   // Linear probing, sites beyond capacity are not tracked
+        auto& site = profile_.sites[(signature + i) & (max_sites - 1)];
+        if (site.signature == signature)
+            return &site;
+        if (site.signature == StackSignature::invalid)
+        {
+            site.signature = signature;
+            return &site;
+        }
+    }
+    return nullptr;
+}
+
+void gtest_memleak_detector::LifetimeProfile::Write(
+    FILE* out, const char* test, const Profile& profile)
+{
+    fprintf(out, "[ MEMLEAK  ] %s: %" PRIu64 " of %" PRIu64 " freed blocks lived "
+        "at most %" PRIu64 " allocation requests (%" PRIu64 " allocations)\n",
+        test, profile.short_lived, profile.frees, short_lived_requests,
+        profile.allocations);
+    fprintf(out, "[ MEMLEAK  ]   %-24s %12s %12s %12s\n",
+        "range", "size", "requests", "nanoseconds");
+    for (size_t i = 0; i < buckets; ++i)
+    {
+        const auto sizes = profile.sizes.counts[i];
+        const auto requests = profile.requests.counts[i];
+        const auto nanoseconds = profile.nanoseconds.counts[i];
+        if (sizes == 0 && requests == 0 && nanoseconds == 0)
+            continue;
+        char range[32];
+        if (i == 0)
+            snprintf(range, sizeof(range), "0");
+        else
+            snprintf(range, sizeof(range), "[2^%zu, 2^%zu)", i - 1, i);
+        fprintf(out, "[ MEMLEAK  ]   %-24s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n",
+            range, sizes, requests, nanoseconds);
+    }
+    if (profile.untracked != 0)
+    {
+        fprintf(out, "[ MEMLEAK  ]   %" PRIu64 " freed blocks without timestamp "
+            "or site\n", profile.untracked);
+    }
+    for (const auto& site : profile.sites)
+    {
+        if (!site.ShortLived())
+            continue;
+        fprintf(out, "[ MEMLEAK  ]   signature 0x%08" PRIx32 ": %" PRIu64 " of %"
+            PRIu64 " freed blocks short-lived\n",
+            site.signature, site.short_lived, site.frees);
+    }
+}
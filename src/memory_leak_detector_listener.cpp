@@ -20,11 +20,12 @@ void FailCurrentTest(
     long leak_alloc_no,
     const char* leak_file,
     unsigned long leak_line,
-    const char* leak_trace)
+    const char* leak_trace,
+    gtest_memleak_detector::MemoryLeakDetector::CaptureMode mode)
 {
     const auto message = 
         gtest_memleak_detector::MemoryLeakDetector::MakeFailureMessage(
-            leak_alloc_no, leak_file, leak_line, leak_trace);
+            leak_alloc_no, leak_file, leak_line, leak_trace, mode);
     if (leak_file && leak_file[0] != 0)
     {
         GTEST_MESSAGE_AT_(leak_file, 
@@ -39,6 +40,68 @@ void FailCurrentTest(
     }
 }
 
+void FailBatch(
+    const char* leak_test,
+    long leak_alloc_no,
+    size_t batch_tests)
+{
+    const auto message =
+        gtest_memleak_detector::MemoryLeakDetector::MakeBatchFailureMessage(
+            leak_test, leak_alloc_no, batch_tests);
+    GTEST_MESSAGE_(message.c_str(),
+        ::testing::TestPartResult::kNonFatalFailure);
+}
+
+void SweepAllocationFailures(
+    const gtest_memleak_detector::MemoryLeakDetector& detector,
+    const ::testing::TestInfo& test_info)
+{
+    using gtest_memleak_detector::MemoryLeakDetector;
+
+    std::string filter = test_info.test_suite_name();
+    filter += '.';
+    filter += test_info.name();
+    const auto result = detector.SweepAllocationFailures(filter.c_str());
+
+    ::testing::Test::RecordProperty("memleak_fail_sweep", 
+        MemoryLeakDetector::MakeSweepSummary(result).c_str());
+
+    if (result.leaked > 0)
+    {
+        const auto message = MemoryLeakDetector::MakeSweepLeakMessage(
+            result, filter.c_str());
+        GTEST_MESSAGE_(message.c_str(),
+            ::testing::TestPartResult::kNonFatalFailure);
+    }
+    if (result.crashed > 0)
+    {
+        const auto message = MemoryLeakDetector::MakeSweepCrashMessage(result);
+        GTEST_MESSAGE_(message.c_str(),
+            ::testing::TestPartResult::kNonFatalFailure);
+    }
+}
+
+void FailScope(
+    const gtest_memleak_detector::ScopedLeakCheck& check)
+{
+    size_t bytes = 0;
+    long first_alloc_no = 0;
+    const auto blocks = check.ForEachLeak(
+        [&](const gtest_memleak_detector::Leak& leak)
+    {
+        bytes += leak.size;
+        first_alloc_no = leak.request; // least recent visited last
+        return true;
+    });
+    if (blocks == 0)
+        return;
+
+    const auto message = gtest_memleak_detector::MemoryLeakDetector::
+        MakeScopeLeakMessage(blocks, bytes, first_alloc_no);
+    GTEST_MESSAGE_(message.c_str(),
+        ::testing::TestPartResult::kNonFatalFailure);
+}
+
 std::string DescribeTest(
     const ::testing::TestInfo& test_info)
 {
@@ -59,6 +122,124 @@ std::string DescribeTest(
     return ss.str();
 }
 
+std::string DescribeBatchTest(const void* test)
+{
+    return DescribeTest(*static_cast<const ::testing::TestInfo*>(test));
+}
+
+void RecordProcessStats(
+    const gtest_memleak_detector::ProcessMemory::Stats& stats)
+{
+    // Properties are recorded after the tracked window has been closed since
+    // recording allocates.
+    using ::testing::Test;
+    Test::RecordProperty("memleak_working_set_delta", 
+        std::to_string(stats.working_set_delta));
+    Test::RecordProperty("memleak_peak_working_set", 
+        std::to_string(stats.peak_working_set));
+    Test::RecordProperty("memleak_peak_working_set_delta", 
+        std::to_string(stats.peak_working_set_delta));
+    Test::RecordProperty("memleak_page_faults", 
+        std::to_string(stats.page_faults));
+    Test::RecordProperty("memleak_committed_pages", 
+        std::to_string(stats.committed_pages));
+}
+
+void RecordLifetimeProfile(
+    const gtest_memleak_detector::LifetimeProfile::Profile& profile)
+{
+    using ::testing::Test;
+    Test::RecordProperty("memleak_allocations", 
+        std::to_string(profile.allocations));
+    Test::RecordProperty("memleak_short_lived_blocks", 
+        std::to_string(profile.short_lived));
+    Test::RecordProperty("memleak_freed_blocks", 
+        std::to_string(profile.frees));
+}
+
+void RecordDivergence(const ::testing::TestInfo& test_info,
+    const gtest_memleak_detector::MemoryLeakDetector::FailureMessage& message)
+{
+    // Recorded rather than failed since the test itself may still be correct.
+    // The first differing allocation and its stack-trace, if located, are
+    // also printed with each line of the stack-trace indented.
+    ::testing::Test::RecordProperty("memleak_nondeterministic", message.c_str());
+    const auto* line = message.c_str();
+    const auto* end = strchr(line, '\n');
+    const auto length = end ? static_cast<size_t>(end - line) : strlen(line);
+    fprintf(stdout, "[ MEMLEAK  ] Warning: %s: %.*s\n", 
+        DescribeTest(test_info).c_str(), static_cast<int>(length), line);
+    while (end != nullptr && end[1] != 0)
+    {
+        line = end + 1;
+        end = strchr(line, '\n');
+        const auto next = end ? static_cast<size_t>(end - line) : strlen(line);
+        fprintf(stdout, "[ MEMLEAK  ]   %.*s\n", static_cast<int>(next), line);
+    }
+}
+
+void RecordQuiescence(const ::testing::TestInfo& test_info,
+    const gtest_memleak_detector::MemoryLeakDetector::Quiescence& quiescence,
+    long timeout)
+{
+    ::testing::Test::RecordProperty("memleak_quiescence_ms", 
+        std::to_string(quiescence.milliseconds));
+    if (quiescence.timed_out)
+    {   // Leaks reported by the test may be blocks about to be freed
+        fprintf(stdout, "[ MEMLEAK  ] Warning: %s: Heap did not settle within "
+            "%ld ms before checking for leaks.\n", 
+            DescribeTest(test_info).c_str(), timeout);
+    }
+}
+
+void WarnForeignOverflow(const ::testing::TestInfo& test_info, size_t count)
+{
+    fprintf(stdout, "[ MEMLEAK  ] Warning: %s: %zu allocations within leak "
+        "contexts of other tests could not be recorded, leaks of this test "
+        "may belong to them.\n", DescribeTest(test_info).c_str(), count);
+}
+
+void WarnAnnotationOverflow(const ::testing::TestInfo& test_info, size_t count)
+{
+    fprintf(stdout, "[ MEMLEAK  ] Warning: %s: %zu annotated blocks could not "
+        "be recorded, leaks of them are not detected.\n", 
+        DescribeTest(test_info).c_str(), count);
+}
+
+void WarnTraceOverflow(const ::testing::TestInfo& test_info, size_t count)
+{
+    fprintf(stdout, "[ MEMLEAK  ] Warning: %s: %zu threads could not be "
+        "recorded since all %zu trace buffers were in use, their allocation "
+        "events are missing from the trace.\n", DescribeTest(test_info).c_str(),
+        count, gtest_memleak_detector::EventRecorder::max_threads);
+}
+
+void MergeChildReport(const ::testing::TestInfo& test_info,
+    const gtest_memleak_detector::ChildReport::Totals& totals)
+{
+    if (totals.processes == 0)
+        return;
+    using ::testing::Test;
+    Test::RecordProperty("memleak_child_processes", 
+        std::to_string(totals.processes));
+    Test::RecordProperty("memleak_child_allocations", 
+        std::to_string(totals.allocations));
+    if (totals.exited_tests != 0)
+    {   // Held blocks of interrupted tests are not leaks of the code under test
+        Test::RecordProperty("memleak_child_exited_tests",
+            std::to_string(totals.exited_tests));
+        Test::RecordProperty("memleak_child_exited_blocks",
+            std::to_string(totals.exited_blocks));
+    }
+    if (totals.leaked_blocks != 0 && test_info.result()->Passed())
+    {
+        const auto message = gtest_memleak_detector::MemoryLeakDetector::
+            MakeChildLeakMessage(totals);
+        GTEST_MESSAGE_(message.c_str(),
+            ::testing::TestPartResult::kNonFatalFailure);
+    }
+}
+
 } // anonomous namespace
 
 #endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
@@ -69,7 +250,13 @@ gtest_memleak_detector::MemoryLeakDetectorListener::MemoryLeakDetectorListener(
 {
 #ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
 	impl_ = std::make_unique<MemoryLeakDetector>(argc, argv);
-    impl_->SetFailureCallback(FailCurrentTest);
+    auto* impl = impl_.get();
+    impl_->SetFailureCallback([impl](long leak_alloc_no, const char* leak_file,
+        unsigned long leak_line, const char* leak_trace) {
+        FailCurrentTest(leak_alloc_no, leak_file, leak_line, leak_trace, 
+            impl->GetCaptureMode());
+    });
+    impl_->SetBatchFailureCallback(FailBatch);
 #else
     UNREFERENCED_PARAMETER(argc);
     UNREFERENCED_PARAMETER(argv);
@@ -81,10 +268,23 @@ gtest_memleak_detector::MemoryLeakDetectorListener::~MemoryLeakDetectorListener(
 	// Empty but required for PIMPL idiom since opaque type in header
 }
 
+size_t gtest_memleak_detector::MemoryLeakDetectorListener::ForEachLeak(
+    const LeakCallback& callback) const
+{
+    return impl_->ForEachLeak(callback);
+}
+
 void gtest_memleak_detector::MemoryLeakDetectorListener::OnTestProgramStart(
 	const ::testing::UnitTest& unit_test)
 {
     UNREFERENCED_PARAMETER(unit_test);
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    if (impl_->GrowthEnabled())
+    {
+        fprintf(stdout, "[ MEMLEAK  ] Warning: Growth mode enabled, tests leaking "
+            "memory do not fail and are only reported if growing with iterations.\n");
+    }
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
 }
 
 void gtest_memleak_detector::MemoryLeakDetectorListener::OnTestStart(
@@ -95,7 +295,17 @@ void gtest_memleak_detector::MemoryLeakDetectorListener::OnTestStart(
     //            until memory checkpoint has been established.
     //            If string would be allocated here it would be reported as a
     //            memory leak which would be a false positive.
-	impl_->Start([&]() { return DescribeTest(test_info); });
+    const auto descriptor = [&]() { return DescribeTest(test_info); };
+    if (impl_->BatchEnabled() && !impl_->IsIsolated(descriptor))
+    {   // Batched tests only mark their request no range
+        if (!impl_->BatchOpen())
+            impl_->StartBatch();
+        impl_->StartBatchTest(&test_info);
+        return;
+    }
+    if (impl_->BatchOpen())
+        impl_->EndBatch(DescribeBatchTest); // check isolated test separately
+	impl_->Start(descriptor);
 #else
     UNREFERENCED_PARAMETER(test_info);
 #endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
@@ -109,25 +319,198 @@ void gtest_memleak_detector::MemoryLeakDetectorListener::OnTestEnd(
     //            until memory checkpoint has been established.
     //            If string would be allocated here it would be reported as a
     //            memory leak which would be a false positive.
+    if (impl_->BatchOpen())
+    {
+        if (impl_->EndBatchTest(test_info.result()->Passed()))
+            impl_->EndBatch(DescribeBatchTest); // batch is full
+        return;
+    }
     impl_->End([&]() { return DescribeTest(test_info); },
         test_info.result()->Passed());
+    if (impl_->ProcessStatsEnabled())
+        RecordProcessStats(impl_->GetProcessStats());
+    if (impl_->LifetimeEnabled())
+        RecordLifetimeProfile(impl_->GetLifetimeProfile());
+    if (!impl_->GetDivergenceMessage().empty())
+        RecordDivergence(test_info, impl_->GetDivergenceMessage());
+    if (impl_->ForeignOverflow() != 0)
+        WarnForeignOverflow(test_info, impl_->ForeignOverflow());
+    if (impl_->AnnotationOverflow() != 0)
+        WarnAnnotationOverflow(test_info, impl_->AnnotationOverflow());
+    if (impl_->TraceOverflow() != 0)
+        WarnTraceOverflow(test_info, impl_->TraceOverflow());
+    if (!impl_->GetContextLeakMessage().empty())
+    {   // Submitting test has ended, reported by the test running its work
+        GTEST_MESSAGE_(impl_->GetContextLeakMessage().c_str(),
+            ::testing::TestPartResult::kNonFatalFailure);
+    }
+    if (impl_->ChildProcessesEnabled())
+        MergeChildReport(test_info, impl_->GetChildTotals());
+    if (impl_->QuiescenceEnabled())
+    {
+        RecordQuiescence(test_info, impl_->GetQuiescence(), 
+            impl_->QuiescenceTimeout());
+    }
+    if (impl_->SweepEnabled() && test_info.result()->Passed())
+        SweepAllocationFailures(*impl_, test_info);
 #else
     UNREFERENCED_PARAMETER(test_info);
 #endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
 }
 
+void gtest_memleak_detector::MemoryLeakDetectorListener::OnTestSuiteEnd(
+	const ::testing::TestSuite& test_suite)
+{
+    UNREFERENCED_PARAMETER(test_suite);
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    if (impl_->BatchOpen())
+        impl_->EndBatch(DescribeBatchTest);
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+}
+
 void gtest_memleak_detector::MemoryLeakDetectorListener::OnTestProgramEnd(
 	const ::testing::UnitTest& unit_test)
 {
     UNREFERENCED_PARAMETER(unit_test);
 #ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    if (impl_->BatchOpen())
+        impl_->EndBatch(DescribeBatchTest);
+    if (impl_->FailureInjectionEnabled())
+    {   // Child of an allocation failure sweep, report leaks by exit code
+        // and leave the database to the parent process
+        if (impl_->LeakCount() > 0)
+        {
+            fflush(nullptr);
+            std::_Exit(static_cast<int>(FailureSweep::leak_exit_code));
+        }
+        return;
+    }
     impl_->WriteDatabase();
+    impl_->WriteLeakSummary(stdout);
+    impl_->WriteGrowthReport(stdout);
+    impl_->WriteLifetimeReport(stdout);
+    impl_->WriteProcessStats();
 #endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
 }
 
+void gtest_memleak_detector::AnnotateAlloc(
+    const void* pool, const void* ptr, size_t size) noexcept
+{
+    MemoryLeakDetector::AnnotateAlloc(pool, ptr, size);
+}
+
+void gtest_memleak_detector::AnnotateFree(
+    const void* pool, const void* ptr) noexcept
+{
+    MemoryLeakDetector::AnnotateFree(pool, ptr);
+}
+
 std::string gtest_memleak_detector::MemoryLeakDetectorListener::MakeDatabaseFilePath(
 	const char* binary_file_path)
 {
     return MemoryLeakDetector::MakeDatabaseFilePath(binary_file_path);
 }
 
+gtest_memleak_detector::ScopedLeakCheck::ScopedLeakCheck() noexcept
+    : sentinel_(MemoryLeakDetector::AllocateSentinel())
+{ }
+
+gtest_memleak_detector::ScopedLeakCheck::ScopedLeakCheck(
+    LeakCallback callback) noexcept
+    : sentinel_(MemoryLeakDetector::AllocateSentinel())
+    , callback_(std::move(callback))
+{ }
+
+gtest_memleak_detector::ScopedLeakCheck::~ScopedLeakCheck() noexcept
+{
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    try
+    {
+        if (callback_)
+            (void)ForEachLeak(callback_);
+        else
+            FailScope(*this);
+    }
+    catch (...)
+    {
+        // Ignore, e.g. failure thrown by --gtest_throw_on_failure
+    }
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+    MemoryLeakDetector::FreeSentinel(sentinel_);
+}
+
+size_t gtest_memleak_detector::ScopedLeakCheck::ForEachLeak(
+    const LeakCallback& callback) const
+{
+    return MemoryLeakDetector::ForEachBlockSince(sentinel_, callback);
+}
+
+gtest_memleak_detector::Snapshot::Snapshot() noexcept
+    : sentinel_(MemoryLeakDetector::AllocateSentinel())
+{ }
+
+gtest_memleak_detector::Snapshot::Snapshot(Snapshot&& other) noexcept
+    : sentinel_(other.sentinel_)
+{
+    other.sentinel_ = nullptr;
+}
+
+gtest_memleak_detector::Snapshot::~Snapshot() noexcept
+{
+    if (sentinel_ != nullptr)
+        MemoryLeakDetector::FreeSentinel(sentinel_);
+}
+
+long gtest_memleak_detector::Snapshot::Epoch() const noexcept
+{
+    return MemoryLeakDetector::SentinelRequest(sentinel_);
+}
+
+size_t gtest_memleak_detector::Diff(const Snapshot& first, 
+    const Snapshot& last, const LeakCallback& callback)
+{
+    return MemoryLeakDetector::ForEachBlockBetween(
+        first.sentinel_, last.sentinel_, callback);
+}
+
+std::vector<gtest_memleak_detector::Leak> gtest_memleak_detector::Diff(
+    const Snapshot& first, const Snapshot& last)
+{
+    std::vector<Leak> blocks;
+    (void)Diff(first, last, [&blocks](const Leak& leak)
+    {
+        blocks.push_back(leak);
+        return true;
+    });
+    return blocks;
+}
+
+gtest_memleak_detector::LeakContext 
+gtest_memleak_detector::LeakContext::Capture() noexcept
+{
+    // Propagate the entered context so that work submitted by work is
+    // charged to the same test
+    const auto* entered = MemoryLeakDetector::CurrentLeakContext();
+    return (entered != nullptr) ? *entered : 
+        LeakContext(MemoryLeakDetector::RunningTest());
+}
+
+gtest_memleak_detector::LeakContext::LeakContext(
+    unsigned long long test) noexcept
+    : test_(test)
+{ }
+
+unsigned long long gtest_memleak_detector::LeakContext::Test() const noexcept
+{
+    return test_;
+}
+
+gtest_memleak_detector::LeakContext::Scope::Scope(
+    const LeakContext& context) noexcept
+    : previous_(MemoryLeakDetector::SwapLeakContext(&context))
+{ }
+
+gtest_memleak_detector::LeakContext::Scope::~Scope() noexcept
+{
+    (void)MemoryLeakDetector::SwapLeakContext(previous_);
+}
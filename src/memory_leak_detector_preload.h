@@ -0,0 +1,20 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file 
+// found in the root directory of this distribution.
+
+// Names shared by the preload launcher and the detector running in the test
+// binary started by it. Kept free of dependencies so that it can be shared by
+// both.
+
+#ifndef GTEST_MEMLEAK_DETECTOR_PRELOAD_H
+#define GTEST_MEMLEAK_DETECTOR_PRELOAD_H
+
+namespace gtest_memleak_detector {
+
+// Environment variable holding the path of the preload launcher, exported by
+// it to the test binary so that failure sweep children are run via it as well
+constexpr const char preload_launcher_variable[] = "GTEST_MEMLEAK_DETECTOR_PRELOAD";
+
+} // namespace gtest_memleak_detector
+
+#endif // GTEST_MEMLEAK_DETECTOR_PRELOAD_H
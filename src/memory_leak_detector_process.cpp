@@ -0,0 +1,63 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include "memory_leak_detector.h"
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+#include <psapi.h>      // GetProcessMemoryInfo
+
+namespace {
+
+uint64_t PageSize() noexcept
+{
+    static const auto page_size = []() {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return static_cast<uint64_t>(info.dwPageSize);
+    }();
+    return page_size;
+}
+
+int64_t Delta(uint64_t pre, uint64_t post) noexcept
+{
+    return static_cast<int64_t>(post) - static_cast<int64_t>(pre);
+}
+
+} // anonymous namespace
+
+bool gtest_memleak_detector::ProcessMemory::Capture(Sample& sample) noexcept
+{
+    // Windows do not distinguish minor and major faults in process counters
+    // and do not expose mapped pages directly, private (committed) bytes is 
+    // the closest equivalent.
+    PROCESS_MEMORY_COUNTERS_EX counters{};
+    counters.cb = sizeof(counters);
+    if (!GetProcessMemoryInfo(GetCurrentProcess(),
+        reinterpret_cast<PPROCESS_MEMORY_COUNTERS>(&counters), sizeof(counters)))
+    {
+        return false;
+    }
+    sample.working_set = counters.WorkingSetSize;
+    sample.peak_working_set = counters.PeakWorkingSetSize;
+    sample.page_faults = counters.PageFaultCount;
+    sample.private_bytes = counters.PrivateUsage;
+    return true;
+}
+
+gtest_memleak_detector::ProcessMemory::Stats 
+gtest_memleak_detector::ProcessMemory::Difference(
+    const Sample& pre, const Sample& post) noexcept
+{
+    Stats stats;
+    stats.working_set_delta = Delta(pre.working_set, post.working_set);
+    stats.peak_working_set = post.peak_working_set;
+    stats.peak_working_set_delta = Delta(pre.peak_working_set, post.peak_working_set);
+    stats.page_faults = post.page_faults - pre.page_faults;
+    stats.committed_pages = Delta(pre.private_bytes, post.private_bytes) / 
+        static_cast<int64_t>(PageSize());
+    return stats;
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
@@ -0,0 +1,383 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include "memory_leak_detector.h"
+
+#include <new>           // placement new
+
+namespace {
+
+// Enabled recorders linked via next_, a thread exiting returns its ring only
+// to a recorder still alive
+std::mutex registry_mutex;
+gtest_memleak_detector::EventRecorder* registry = nullptr;
+
+constexpr size_t RingStride(size_t ring_bytes) noexcept
+{
+    // Align rings to allocation granularity to commit them individually
+    return (ring_bytes + 0xFFFFu) & ~size_t(0xFFFFu);
+}
+
+} // anonymous namespace
+
+std::atomic<uint64_t> gtest_memleak_detector::EventRecorder::generations_{ 0u };
+thread_local gtest_memleak_detector::EventRecorder::ThreadRing
+    gtest_memleak_detector::EventRecorder::thread_ring_ = { 0u, nullptr, 0u, 0u, false };
+thread_local gtest_memleak_detector::EventRecorder::ThreadExit
+    gtest_memleak_detector::EventRecorder::thread_exit_ = { false };
+
+gtest_memleak_detector::EventRecorder::ThreadExit::~ThreadExit() noexcept
+{
+    if (armed && thread_ring_.ring != nullptr)
+        ReleaseRing(thread_ring_.generation, thread_ring_.index);
+    thread_ring_.ring = nullptr;
+}
+
+gtest_memleak_detector::EventRecorder::~EventRecorder() noexcept
+{
+    if (generation_ != 0u)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (auto** it = &registry; *it != nullptr; it = &(*it)->next_)
+        {
+            if (*it == this)
+            {
+                *it = next_;
+                break;
+            }
+        }
+    }
+    if (flusher_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_one();
+        flusher_.join();
+    }
+    if (file_ != INVALID_HANDLE_VALUE)
+        CloseHandle(file_);
+    if (base_ != nullptr)
+        VirtualFree(base_, 0, MEM_RELEASE);
+}
+
+bool gtest_memleak_detector::EventRecorder::Enable()
+{
+    if (base_ != nullptr)
+        return true;
+
+    // Reserve buffers for all threads once, committed on first use
+    base_ = static_cast<char*>(VirtualAlloc(nullptr, 
+        max_threads * RingStride(sizeof(Ring)), MEM_RESERVE, PAGE_NOACCESS));
+    if (base_ == nullptr)
+        return false;
+    generation_ = ++generations_;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        next_ = registry;
+        registry = this;
+    }
+    flusher_ = std::thread([this]() { Run(); });
+    return true;
+}
+
+bool gtest_memleak_detector::EventRecorder::Enabled() const noexcept
+{
+    return base_ != nullptr;
+}
+
+uint64_t gtest_memleak_detector::EventRecorder::Timestamp() noexcept
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return static_cast<uint64_t>(counter.QuadPart);
+}
+
+bool gtest_memleak_detector::EventRecorder::BeginTest(
+    const char* path, const char* test)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Drain(); // discard events recorded in between tests
+
+    file_ = CreateFileA(path, GENERIC_WRITE, 0, nullptr, 
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    header_ = TraceFileHeader{};
+    memcpy(header_.magic, TraceFileHeader::Magic(), sizeof(header_.magic));
+    header_.version = TraceFileHeader::current_version;
+    header_.event_size = sizeof(TraceEvent);
+    header_.frequency = static_cast<uint64_t>(frequency.QuadPart);
+    header_.start = Timestamp();
+    strncpy_s(header_.test, test, _TRUNCATE);
+
+    // Written again when the test ends to update counts
+    DWORD written;
+    dropped_.store(0u, std::memory_order_relaxed);
+    dropped_threads_.store(0u, std::memory_order_relaxed);
+    tests_.fetch_add(1u, std::memory_order_relaxed);
+    return WriteFile(file_, &header_, sizeof(header_), &written, nullptr) != FALSE;
+}
+
+void gtest_memleak_detector::EventRecorder::EndTest() noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ == INVALID_HANDLE_VALUE)
+        return;
+    Drain();
+
+    DWORD written;
+    header_.dropped = dropped_.exchange(0u, std::memory_order_relaxed);
+    ended_dropped_threads_ = dropped_threads_.exchange(0u, std::memory_order_relaxed);
+    if (SetFilePointer(file_, 0, nullptr, FILE_BEGIN) != INVALID_SET_FILE_POINTER)
+        (void)WriteFile(file_, &header_, sizeof(header_), &written, nullptr);
+    CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+}
+
+size_t gtest_memleak_detector::EventRecorder::DroppedThreads() const noexcept
+{
+    return ended_dropped_threads_;
+}
+
+gtest_memleak_detector::EventRecorder::Ring* 
+gtest_memleak_detector::EventRecorder::AcquireRing() noexcept
+{
+    auto& cached = thread_ring_;
+    if (cached.generation == generation_ && cached.ring != nullptr)
+        return cached.ring;
+    if (cached.suppress)
+        return nullptr;
+    if (cached.ring != nullptr)
+    {   // Ring of another recorder
+        ReleaseRing(cached.generation, cached.index);
+        cached.ring = nullptr;
+    }
+
+    const auto index = ClaimRing();
+    if (index >= max_threads)
+    {   // All rings in use, counted once per thread and test
+        const auto test = tests_.load(std::memory_order_relaxed);
+        if (cached.generation != generation_ || cached.dropped_test != test)
+        {
+            cached.generation = generation_;
+            cached.dropped_test = test;
+            dropped_threads_.fetch_add(1u, std::memory_order_relaxed);
+        }
+        return nullptr;
+    }
+
+    cached.generation = generation_;
+    cached.ring = rings_[index].load(std::memory_order_acquire);
+    cached.index = index;
+    thread_exit_.armed = true; // registers the destructor of this thread
+    return cached.ring;
+}
+
+size_t gtest_memleak_detector::EventRecorder::ClaimRing() noexcept
+{
+    // Rings of exited threads are reused first. A reused ring is drained by
+    // the flush thread as before, events of the exited thread included.
+    auto released = released_.load(std::memory_order_acquire);
+    while (released != 0u)
+    {
+        const auto bit = released & (~released + 1u); // lowest set
+        if (released_.compare_exchange_weak(released, released & ~bit,
+            std::memory_order_acq_rel, std::memory_order_acquire))
+        {
+            size_t index = 0;
+            while ((bit >> index) != 1u)
+                ++index;
+            return index;
+        }
+    }
+
+    // Register a new ring, the slot index is claimed lock-free and the ring
+    // is published to the flush thread once initialized.
+    if (ring_count_.load(std::memory_order_relaxed) >= max_threads)
+        return max_threads;
+    const auto index = ring_count_.fetch_add(1u, std::memory_order_relaxed);
+    if (index >= max_threads)
+        return max_threads;
+    auto* memory = VirtualAlloc(base_ + index * RingStride(sizeof(Ring)), 
+        sizeof(Ring), MEM_COMMIT, PAGE_READWRITE);
+    if (memory == nullptr)
+        return max_threads;
+    auto* ring = new (memory) Ring; // committed pages are zeroed
+    rings_[index].store(ring, std::memory_order_release);
+    return index;
+}
+
+void gtest_memleak_detector::EventRecorder::ReleaseRing(
+    uint64_t generation, size_t index) noexcept
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto* recorder = registry; recorder != nullptr; recorder = recorder->next_)
+    {
+        if (recorder->generation_ == generation)
+        {
+            recorder->released_.fetch_or(uint64_t(1u) << index, 
+                std::memory_order_release);
+            return;
+        }
+    }
+}
+
+void gtest_memleak_detector::EventRecorder::Push(const TraceEvent& event) noexcept
+{
+    auto* ring = AcquireRing();
+    if (ring == nullptr)
+    {
+        dropped_.fetch_add(1u, std::memory_order_relaxed);
+        return;
+    }
+
+    const auto head = ring->head.load(std::memory_order_relaxed);
+    const auto tail = ring->tail.load(std::memory_order_acquire);
+    if (head - tail >= ring_capacity)
+    {   // Full, never block the allocating thread
+        dropped_.fetch_add(1u, std::memory_order_relaxed);
+        return;
+    }
+    ring->events[head & (ring_capacity - 1u)] = event;
+    ring->head.store(head + 1u, std::memory_order_release);
+}
+
+void gtest_memleak_detector::EventRecorder::Drain() noexcept
+{
+    const auto count = (std::min)(
+        ring_count_.load(std::memory_order_relaxed), max_threads);
+    for (size_t i = 0; i < count; ++i)
+    {
+        auto* ring = rings_[i].load(std::memory_order_acquire);
+        if (ring == nullptr)
+            continue; // being registered
+
+        const auto tail = ring->tail.load(std::memory_order_relaxed);
+        const auto head = ring->head.load(std::memory_order_acquire);
+        if (head == tail)
+            continue;
+
+        if (file_ != INVALID_HANDLE_VALUE)
+        {   // Write in at most two contiguous chunks due to wrap-around
+            const auto first = static_cast<size_t>(tail & (ring_capacity - 1u));
+            const auto n = static_cast<size_t>(head - tail);
+            const auto chunk = (std::min)(n, ring_capacity - first);
+            DWORD written;
+            (void)WriteFile(file_, &ring->events[first], 
+                static_cast<DWORD>(chunk * sizeof(TraceEvent)), &written, nullptr);
+            if (chunk < n)
+            {
+                (void)WriteFile(file_, &ring->events[0], 
+                    static_cast<DWORD>((n - chunk) * sizeof(TraceEvent)), &written, nullptr);
+            }
+            header_.events += n;
+        }
+        ring->tail.store(head, std::memory_order_release);
+    }
+}
+
+void gtest_memleak_detector::EventRecorder::Run() noexcept
+{
+    thread_ring_.suppress = true;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_)
+    {
+        Drain();
+        (void)wake_.wait_for(lock, std::chrono::milliseconds(2));
+    }
+}
+
+bool gtest_memleak_detector::EventRecorder::WriteWorkload(
+    const char* trace_path, const char* workload_path)
+{
+    std::ifstream in(trace_path, std::ios::binary);
+    TraceFileHeader trace{};
+    if (!in.read(reinterpret_cast<char*>(&trace), sizeof(trace)) ||
+        trace.event_size != sizeof(TraceEvent))
+    {
+        return false;
+    }
+    std::vector<TraceEvent> events(static_cast<size_t>(trace.events));
+    if (!in.read(reinterpret_cast<char*>(events.data()), 
+        static_cast<std::streamsize>(events.size() * sizeof(TraceEvent))))
+    {
+        return false;
+    }
+
+    // Events of different threads are flushed in chunks
+    std::stable_sort(events.begin(), events.end(), 
+        [](const TraceEvent& lhs, const TraceEvent& rhs) {
+            return lhs.timestamp < rhs.timestamp; 
+        });
+
+    // Number blocks and threads densely, operations on blocks allocated 
+    // before the test cannot be replayed and are skipped.
+    std::unordered_map<int32_t, uint32_t> slots;
+    std::unordered_map<uint32_t, uint16_t> threads;
+    std::vector<WorkloadOp> ops;
+    ops.reserve(events.size());
+    for (const auto& event : events)
+    {
+        WorkloadOp op{};
+        op.thread = threads.emplace(event.thread, 
+            static_cast<uint16_t>(threads.size())).first->second;
+        auto previous = slots.end();
+        if (event.previous != 0)
+            previous = slots.find(event.previous);
+
+        if (event.GetType() == TraceEvent::Type::Free)
+        {
+            if (previous == slots.end())
+                continue;
+            op.type = WorkloadOp::Free;
+            op.slot = previous->second;
+            slots.erase(previous);
+        }
+        else
+        {
+            op.type = (previous != slots.end()) ? WorkloadOp::Realloc : WorkloadOp::Alloc;
+            op.size = static_cast<uint32_t>((std::min)(event.size, uint64_t(UINT32_MAX)));
+            if (previous != slots.end())
+            {
+                op.previous = previous->second;
+                slots.erase(previous);
+            }
+            op.slot = static_cast<uint32_t>(ops.size()); // unique, renumbered below
+            slots.emplace(event.request, op.slot);
+        }
+        ops.push_back(op);
+    }
+
+    // Slots are renumbered densely in order of allocation
+    std::unordered_map<uint32_t, uint32_t> dense;
+    const auto renumber = [&dense](uint32_t slot) {
+        return dense.emplace(slot, static_cast<uint32_t>(dense.size())).first->second;
+    };
+    for (auto& op : ops)
+    {
+        if (op.type == WorkloadOp::Realloc)
+            op.previous = renumber(op.previous);
+        op.slot = renumber(op.slot);
+    }
+
+    WorkloadFileHeader header{};
+    memcpy(header.magic, WorkloadFileHeader::Magic(), sizeof(header.magic));
+    header.version = WorkloadFileHeader::current_version;
+    header.op_size = sizeof(WorkloadOp);
+    header.ops = ops.size();
+    header.threads = static_cast<uint32_t>(threads.size());
+    header.slots = static_cast<uint32_t>(dense.size());
+    memcpy(header.test, trace.test, sizeof(header.test));
+
+    std::ofstream out(workload_path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(ops.data()), 
+        static_cast<std::streamsize>(ops.size() * sizeof(WorkloadOp)));
+    return out.good();
+}
@@ -0,0 +1,118 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include "memory_leak_detector.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// SequenceFingerprint
+///////////////////////////////////////////////////////////////////////////////
+
+void gtest_memleak_detector::SequenceFingerprint::Begin(
+    const Baseline* baseline) noexcept
+{
+    has_baseline_ = baseline != nullptr;
+    if (has_baseline_)
+        baseline_ = *baseline;
+    current_ = Baseline();
+    current_.hash = 14695981039346656037ull; // FNV-1a
+    mismatch_ = no_window;
+    located_ = 0;
+    located_size_ = 0;
+}
+
+bool gtest_memleak_detector::SequenceFingerprint::Add(size_t size) noexcept
+{
+    const auto request = ++current_.length;
+    current_.hash = (current_.hash ^ static_cast<Value>(size)) * 1099511628211ull;
+    const auto window = (request - 1) / stride;
+    const auto offset = static_cast<size_t>((request - 1) % stride);
+    ring_[offset] = size;
+
+    // Compare sizes one by one within the window kept by the previous run
+    auto located = false;
+    if (has_baseline_ && located_ == 0 && window == baseline_.window)
+    {
+        const auto expected = (request <= baseline_.length) ?
+            baseline_.sizes[offset] : 0u;
+        if (size != expected)
+        {
+            located_ = request;
+            located_size_ = size;
+            located = true;
+        }
+    }
+
+    if (offset == stride - 1 && window < static_cast<long>(max_checkpoints))
+    {
+        const auto checkpoint = static_cast<size_t>(window);
+        current_.prefix[checkpoint] = current_.hash;
+        current_.checkpoints = checkpoint + 1;
+        if (has_baseline_ && mismatch_ == no_window &&
+            checkpoint < baseline_.checkpoints &&
+            baseline_.prefix[checkpoint] != current_.hash)
+        {
+            mismatch_ = window;
+            KeepWindow(window, stride);
+        }
+    }
+    return located;
+}
+
+void gtest_memleak_detector::SequenceFingerprint::End() noexcept
+{
+    if (!has_baseline_ || mismatch_ != no_window || current_.length == 0 ||
+        (current_.hash == baseline_.hash && current_.length == baseline_.length))
+        return;
+
+    // Checkpoints match, keep the trailing partial window if it is the first
+    // window not covered by checkpoints of both runs
+    const auto window = (current_.length - 1) / stride;
+    const auto compared = (std::min)(current_.checkpoints, baseline_.checkpoints);
+    if (current_.length % stride != 0 && window == static_cast<long>(compared))
+        KeepWindow(window, static_cast<size_t>(current_.length % stride));
+}
+
+bool gtest_memleak_detector::SequenceFingerprint::Diverged(
+    Divergence& divergence) const noexcept
+{
+    if (!has_baseline_ ||
+        (current_.hash == baseline_.hash && current_.length == baseline_.length))
+        return false;
+
+    if (located_ != 0 && (mismatch_ == no_window || located_ <= (mismatch_ + 1) * stride))
+    {
+        const auto offset = static_cast<size_t>((located_ - 1) % stride);
+        divergence.first = located_;
+        divergence.last = located_;
+        divergence.size = located_size_;
+        divergence.expected = (located_ <= baseline_.length) ?
+            baseline_.sizes[offset] : 0u;
+    }
+    else if (mismatch_ != no_window)
+    {
+        divergence.first = mismatch_ * stride + 1;
+        divergence.last = (mismatch_ + 1) * stride;
+    }
+    else
+    {   // Beyond checkpoints of either run
+        const auto compared = (std::min)(current_.checkpoints, baseline_.checkpoints);
+        divergence.first = static_cast<long>(compared) * stride + 1;
+        divergence.last = (std::max)(current_.length, baseline_.length);
+    }
+    return true;
+}
+
+const gtest_memleak_detector::SequenceFingerprint::Baseline&
+gtest_memleak_detector::SequenceFingerprint::Current() const noexcept
+{
+    return current_;
+}
+
+void gtest_memleak_detector::SequenceFingerprint::KeepWindow(
+    long window, size_t count) noexcept
+{
+    current_.window = window;
+    std::copy(ring_, ring_ + count, current_.sizes);
+    std::fill(current_.sizes + count, current_.sizes + stride, 0u);
+}
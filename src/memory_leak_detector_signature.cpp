@@ -0,0 +1,110 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include "memory_leak_detector.h"
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+namespace {
+
+struct ModuleRange
+{
+    uintptr_t base;
+    uintptr_t end;
+};
+
+constexpr size_t module_cache_size = 8u;
+
+// Per-thread cache of recently resolved module address ranges since resolving
+// the module of an address is significantly slower than hashing it.
+thread_local ModuleRange module_cache[module_cache_size];
+thread_local size_t module_cache_next = 0;
+
+uintptr_t ModuleRelativeAddress(uintptr_t address) noexcept
+{
+    for (const auto& module : module_cache)
+    {
+        if (address >= module.base && address < module.end)
+            return address - module.base;
+    }
+
+    PVOID base = nullptr;
+    if (RtlPcToFileHeader(reinterpret_cast<PVOID>(address), &base) == nullptr)
+        return address; // not part of any module, e.g. generated code
+
+    const auto module_base = reinterpret_cast<uintptr_t>(base);
+    const auto* dos_header = reinterpret_cast<const IMAGE_DOS_HEADER*>(base);
+    const auto* nt_headers = reinterpret_cast<const IMAGE_NT_HEADERS*>(
+        module_base + static_cast<uintptr_t>(dos_header->e_lfanew));
+
+    auto& module = module_cache[module_cache_next++ % module_cache_size];
+    module.base = module_base;
+    module.end = module_base + nt_headers->OptionalHeader.SizeOfImage;
+    return address - module_base;
+}
+
+} // anonymous namespace
+
+gtest_memleak_detector::StackSignature::Value 
+gtest_memleak_detector::StackSignature::Capture() noexcept
+{
+    PVOID frames[max_frames];
+    const auto n = RtlCaptureStackBackTrace(skip_frames, max_frames, frames, nullptr);
+
+    // FNV-1a over module-relative return addresses folded to 32-bits
+    auto hash = 14695981039346656037ull;
+    for (auto i = 0u; i < n; ++i)
+    {
+        const auto offset = static_cast<unsigned long long>(
+            ModuleRelativeAddress(reinterpret_cast<uintptr_t>(frames[i])));
+        hash ^= offset;
+        hash *= 1099511628211ull;
+    }
+
+    const auto value = static_cast<Value>(hash ^ (hash >> 32));
+    return value != invalid ? value : Value(1);
+}
+
+gtest_memleak_detector::SignatureCounter::SignatureCounter() noexcept
+    : entries_(nullptr)
+    , generation_(1)
+{ }
+
+bool gtest_memleak_detector::SignatureCounter::Next(
+    StackSignature::Value signature, uint32_t& ordinal)
+{
+    if (entries_ == nullptr)
+    {   // Lazily allocate since only required if identifying by signature
+        entries_ = static_cast<Entry*>(
+            DatabaseArena::Get().Allocate(capacity * sizeof(Entry)));
+        memset(entries_, 0, capacity * sizeof(Entry));
+    }
+
+    // Linear probing, bounded to keep allocation hook fast
+    auto index = static_cast<size_t>(signature) & (capacity - 1);
+    for (auto probe = 0u; probe < max_probes; ++probe)
+    {
+        auto& entry = entries_[index];
+        if (entry.generation != generation_)
+        {
+            entry.signature = signature;
+            entry.count = 0;
+            entry.generation = generation_;
+        }
+        if (entry.signature == signature)
+        {
+            ordinal = entry.count++;
+            return true;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+    return false; // table exhausted
+}
+
+void gtest_memleak_detector::SignatureCounter::Clear() noexcept
+{
+    ++generation_;
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
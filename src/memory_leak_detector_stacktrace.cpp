@@ -6,8 +6,9 @@
 
 #ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
 
-gtest_memleak_detector::StackTrace::StackTrace()
+gtest_memleak_detector::StackTrace::StackTrace(FileTable& files)
     : StackWalker(StackWalker::StackWalkOptions::RetrieveLine)
+    , files(files)
     , state(State::Scanning)
 { 
     Reset();
@@ -19,8 +20,8 @@ gtest_memleak_detector::StackTrace::CurrentState() const noexcept
     return state;
 }
 
-const std::stringstream& 
-gtest_memleak_detector::StackTrace::Stream() const noexcept
+const gtest_memleak_detector::StackTrace::Buffer& 
+gtest_memleak_detector::StackTrace::GetBuffer() const noexcept
 {
     return buffer;
 }
@@ -34,12 +35,7 @@ gtest_memleak_detector::StackTrace::GetLocation() const noexcept
 void 
 gtest_memleak_detector::StackTrace::Reset(State reset_to_state)
 {
-    const static std::stringstream initial;
-
-    buffer.str(std::string(4096 * 4, '\0'));
     buffer.clear();
-    buffer.copyfmt(initial);
-
     location = Location();
 
     state = reset_to_state;
@@ -53,6 +49,8 @@ gtest_memleak_detector::StackTrace::Filter(const CallstackEntry& entry) noexcept
     {
         if (strcmp(entry.undName, "operator new") == 0)
             filter = true;
+        else if (strncmp(entry.undName, "GTestMemoryLeakDetector", 23) == 0)
+            filter = true; // import hooks
         else if (entry.lineFileName[0] == 0)
         {
             if (strcmp(entry.undName, "calloc_base") == 0)
@@ -72,28 +70,34 @@ gtest_memleak_detector::StackTrace::Filter(const CallstackEntry& entry) noexcept
 
 void 
 gtest_memleak_detector::StackTrace::Format(CallstackEntry& entry)
-{   // Format stack trace to string buffer
+{   // Format stack trace to fixed-capacity buffer
     if (entry.lineFileName[0] == 0)
     {
-        buffer << "- 0x" << (LPVOID)entry.offset << " (";
+        buffer.Append("- 0x")
+            .Append(reinterpret_cast<const void*>(
+                static_cast<uintptr_t>(entry.offset)))
+            .Append(" (");
         if (entry.moduleName[0] == 0)
-            buffer << entry.moduleName;
+            buffer.Append(entry.moduleName);
         else
-            buffer << "[module-name not available]";
-        buffer << "): [filename not available]: ";
+            buffer.Append("[module-name not available]");
+        buffer.Append("): [filename not available]: ");
     }
     else
     {
-        buffer << "- " << entry.lineFileName << " (" << entry.lineNumber << "): ";
+        buffer.Append("- ")
+            .Append(entry.lineFileName)
+            .Append(" (")
+            .Append(static_cast<unsigned long>(entry.lineNumber))
+            .Append("): ");
     }
     if (entry.undFullName[0] != 0)
-        buffer << entry.undFullName;
+        buffer.Append(entry.undFullName);
     else if (entry.undName[0] != 0)
-        buffer << entry.undName;
+        buffer.Append(entry.undName);
     else if (entry.name[0] != 0)
-        buffer << entry.name;
-    buffer << '\n';
-
+        buffer.Append(entry.name);
+    buffer.Append('\n');
 }
 
 void 
@@ -113,7 +117,8 @@ gtest_memleak_detector::StackTrace::HandleCallstackEntry(CallstackEntry& entry)
     {
     case State::Scanning:
         if (entry.undName[0] != 0 &&
-            strcmp(entry.undName, "GTestMemoryLeakDetector4ll0c470rh00k") == 0)
+            (strcmp(entry.undName, "GTestMemoryLeakDetector4ll0c470rh00k") == 0 ||
+             strcmp(entry.undName, "gtest_memleak_detector::AnnotateAlloc") == 0))
         {
             state = State::Capture;
         }
@@ -129,7 +134,7 @@ gtest_memleak_detector::StackTrace::HandleCallstackEntry(CallstackEntry& entry)
             if (location.line == Location::invalid_line &&
                 entry.lineFileName[0] != 0)
             {
-                location.file = entry.lineFileName;
+                location.file = files.Intern(entry.lineFileName);
                 location.line = entry.lineNumber;
             }
 
@@ -169,4 +174,40 @@ gtest_memleak_detector::StackTrace::OnCallstackEntry(
     }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// FileTable
+///////////////////////////////////////////////////////////////////////////////
+
+gtest_memleak_detector::FileTable::Id 
+gtest_memleak_detector::FileTable::Intern(const char* file)
+{
+    if (file == nullptr || file[0] == 0)
+        return invalid_id;
+
+    const DatabaseString name(file);
+    const auto it = index_.find(name);
+    if (it != index_.end())
+        return it->second;
+
+    // Node-based index, i.e. key storage is stable and may be referenced
+    const auto id = static_cast<Id>(names_.size() + 1);
+    const auto result = index_.emplace(name, id);
+    names_.push_back(result.first->first.c_str());
+    return id;
+}
+
+const char* 
+gtest_memleak_detector::FileTable::Name(Id id) const noexcept
+{
+    if (id == invalid_id || id > names_.size())
+        return "";
+    return names_[id - 1];
+}
+
+size_t 
+gtest_memleak_detector::FileTable::Size() const noexcept
+{
+    return names_.size();
+}
+
 #endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
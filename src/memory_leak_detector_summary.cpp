@@ -0,0 +1,192 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include "memory_leak_detector.h"
+
+#include <cinttypes>
+#include <exception>
+#include <thread>
+
+namespace {
+
+using Groups = std::unordered_map<gtest_memleak_detector::LeakSummary::Key,
+    gtest_memleak_detector::LeakSummary::Group>;
+
+void Merge(gtest_memleak_detector::LeakSummary::Group& dst,
+    const gtest_memleak_detector::LeakSummary::Group& src) noexcept
+{
+    // Prefer a representative with a stack-trace, otherwise the first one
+    if (dst.representative == nullptr ||
+        (dst.representative->trace.empty() && !src.representative->trace.empty()))
+    {
+        dst.representative = src.representative;
+    }
+    dst.key = src.key;
+    dst.tests += src.tests;
+    dst.bytes += src.bytes;
+}
+
+// Invokes task(index) for index in [0, n) with index 0 on the calling thread
+// and rethrows the first exception thrown by any task
+template<class Task>
+void RunParallel(size_t n, const Task& task)
+{
+    std::vector<std::exception_ptr> errors(n);
+    const auto run = [&](size_t index) {
+        try
+        {
+            task(index);
+        }
+        catch (...)
+        {
+            errors[index] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(n - 1u);
+    for (size_t i = 1u; i < n; ++i)
+        workers.emplace_back(run, i);
+    run(0u);
+    for (auto& worker : workers)
+        worker.join();
+    for (const auto& error : errors)
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+}
+
+} // anonymous namespace
+
+gtest_memleak_detector::LeakSummary::Key 
+gtest_memleak_detector::LeakSummary::MakeKey(StackSignature::Value signature, 
+    const Location& location, uint32_t fingerprint) noexcept
+{
+    if (signature != StackSignature::invalid)
+        return (static_cast<Key>(KeyKind::Signature) << 32u) | signature;
+    if (location.file != FileTable::invalid_id)
+    {   // File ids are only unique within a run, as are summaries
+        const auto site = (static_cast<uint64_t>(location.file) << 32u) ^ 
+            location.line;
+        return (static_cast<Key>(KeyKind::Location) << 32u) | 
+            static_cast<uint32_t>(site ^ (site >> 32u));
+    }
+    if (fingerprint != 0)
+        return (static_cast<Key>(KeyKind::Fingerprint) << 32u) | fingerprint;
+    return static_cast<Key>(KeyKind::None) << 32u;
+}
+
+gtest_memleak_detector::LeakSummary::KeyKind 
+gtest_memleak_detector::LeakSummary::Kind(Key key) noexcept
+{
+    return static_cast<KeyKind>(key >> 32u);
+}
+
+void gtest_memleak_detector::LeakSummary::Add(
+    Key key, uint64_t bytes, const char* test, const char* trace)
+{
+    if (Kind(key) == KeyKind::None) // unique, i.e. a group of its own
+        key |= static_cast<uint32_t>(records_.size());
+    records_.push_back(Record{ key, bytes, 
+        DatabaseString(test ? test : ""), DatabaseString(trace ? trace : "") });
+}
+
+size_t gtest_memleak_detector::LeakSummary::Size() const noexcept
+{
+    return records_.size();
+}
+
+std::vector<gtest_memleak_detector::LeakSummary::Group>
+gtest_memleak_detector::LeakSummary::Aggregate(unsigned threads) const
+{
+    // Avoid thread overhead unless there are enough records to split
+    const auto count = records_.size();
+    const auto max_threads = count / min_records_per_thread + 1u;
+    const auto n = (std::max)(size_t(1), (std::min)(size_t(threads), max_threads));
+    const auto chunk = (count + n - 1u) / n;
+
+    // Group disjoint record ranges in parallel
+    std::vector<Groups> partial(n);
+    RunParallel(n, [&](size_t index) {
+        auto& groups = partial[index];
+        const auto first = index * chunk;
+        const auto last = (std::min)(first + chunk, count);
+        for (auto i = first; i < last; ++i)
+        {
+            const auto& record = records_[i];
+            Group group;
+            group.key = record.key;
+            group.tests = 1u;
+            group.bytes = record.bytes;
+            group.representative = &record;
+            Merge(groups[record.key], group);
+        }
+    });
+
+    // Merge partial groups in parallel where each thread owns a disjoint set
+    // of keys. Partials are merged in range order so that representatives 
+    // are stable regardless of the number of threads.
+    std::vector<Groups> merged(n);
+    RunParallel(n, [&](size_t index) {
+        auto& groups = merged[index];
+        for (const auto& range : partial)
+        {
+            for (const auto& kvp : range)
+            {
+                if (Groups::hasher()(kvp.first) % n == index)
+                    Merge(groups[kvp.first], kvp.second);
+            }
+        }
+    });
+
+    std::vector<Group> result;
+    for (const auto& groups : merged)
+    {
+        for (const auto& kvp : groups)
+            result.push_back(kvp.second);
+    }
+    std::sort(result.begin(), result.end(), [](const Group& lhs, const Group& rhs) {
+        if (lhs.tests != rhs.tests)
+            return lhs.tests > rhs.tests;
+        if (lhs.bytes != rhs.bytes)
+            return lhs.bytes > rhs.bytes;
+        return lhs.key < rhs.key;
+    });
+    return result;
+}
+
+size_t gtest_memleak_detector::LeakSummary::Write(FILE* out, unsigned threads) const
+{
+    if (records_.empty())
+        return 0u;
+
+    const auto groups = Aggregate(threads);
+    fprintf(out, "[ MEMLEAK  ] %zu leaking test(s) in %zu group(s) by allocation site\n",
+        records_.size(), groups.size());
+    for (const auto& group : groups)
+    {
+        const auto& representative = *group.representative;
+        fprintf(out, "[ MEMLEAK  ] %zu test(s), %" PRIu64 " bytes, e.g. %s\n",
+            group.tests, group.bytes, representative.test.c_str());
+
+        if (representative.trace.empty())
+        {
+            fprintf(out, "[ MEMLEAK  ]   %s\n", (Kind(group.key) == KeyKind::None) ?
+                "allocation site unknown, re-run to obtain stack-trace" :
+                "re-run to obtain stack-trace");
+        }
+
+        // Indent each line of the representative stack-trace
+        const auto* line = representative.trace.c_str();
+        while (*line != 0)
+        {
+            const auto* end = strchr(line, '\n');
+            const auto length = end ? static_cast<size_t>(end - line) : strlen(line);
+            fprintf(out, "[ MEMLEAK  ]   %.*s\n", static_cast<int>(length), line);
+            line += length + (end ? 1u : 0u);
+        }
+    }
+    return groups.size();
+}
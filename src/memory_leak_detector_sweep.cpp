@@ -0,0 +1,268 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+#include "memory_leak_detector.h"
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+#include <shellapi.h>   // CommandLineToArgvW
+
+namespace {
+
+struct Child
+{
+    HANDLE  process;
+    long    request;
+};
+
+HANDLE OpenNullDevice() noexcept
+{
+    SECURITY_ATTRIBUTES attributes{};
+    attributes.nLength = sizeof(attributes);
+    attributes.bInheritHandle = TRUE;
+    return CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        &attributes, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+}
+
+// Returns true if arg is flag --name or --name=value
+bool IsFlag(const char* arg, const char* name) noexcept
+{
+    if (strncmp(arg, "--", 2u) != 0)
+        return false;
+    const auto length = strlen(name);
+    return strncmp(arg + 2, name, length) == 0 &&
+        (arg[2 + length] == 0 || arg[2 + length] == '=');
+}
+
+void AppendQuoted(std::string& command_line, const std::string& arg)
+{
+    // Quoted as parsed by CommandLineToArgvW, i.e. backslashes only escape
+    // when followed by a quote
+    if (!arg.empty() && arg.find_first_of(" \t\"") == std::string::npos)
+    {
+        command_line += arg;
+        return;
+    }
+    command_line += '"';
+    size_t backslashes = 0;
+    for (const auto c : arg)
+    {
+        if (c == '\\')
+        {
+            ++backslashes;
+            continue;
+        }
+        command_line.append((c == '"') ? backslashes * 2 + 1 : backslashes, '\\');
+        command_line += c;
+        backslashes = 0;
+    }
+    command_line.append(backslashes * 2, '\\');
+    command_line += '"';
+}
+
+std::string ForwardedArguments()
+{
+    // Google Test removes its flags from argv when initialized, hence the 
+    // original command line of the process is used
+    int argc = 0;
+    auto* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    if (argv == nullptr)
+        return std::string();
+
+    std::string arguments;
+    std::string arg;
+    for (auto i = 1; i < argc; ++i)
+    {
+        const auto length = WideCharToMultiByte(CP_ACP, 0, argv[i], -1, 
+            nullptr, 0, nullptr, nullptr);
+        if (length <= 0)
+            continue;
+        arg.resize(static_cast<size_t>(length));
+        (void)WideCharToMultiByte(CP_ACP, 0, argv[i], -1, &arg[0], length, 
+            nullptr, nullptr);
+        arg.resize(static_cast<size_t>(length - 1)); // terminator
+        if (!gtest_memleak_detector::FailureSweep::IsForwarded(arg.c_str()))
+            continue;
+        arguments += ' ';
+        AppendQuoted(arguments, arg);
+    }
+    LocalFree(argv);
+    return arguments;
+}
+
+HANDLE Spawn(const std::string& binary, const std::string& arguments, 
+    const char* test_filter, long request, HANDLE output)
+{
+    // Re-inject the detector DLL if preloaded, the launcher returns the exit
+    // code of the child
+    char launcher[MAX_PATH];
+    const auto length = GetEnvironmentVariableA(
+        gtest_memleak_detector::preload_launcher_variable, 
+        launcher, static_cast<DWORD>(sizeof(launcher)));
+    const auto preloaded = length != 0 && length < sizeof(launcher);
+    std::string command_line;
+    if (preloaded)
+        command_line = "\"" + std::string(launcher) + "\" ";
+    command_line += "\"" + binary + "\" --gtest_filter=";
+    command_line += test_filter;
+    command_line += " --memleak_fail_alloc=";
+    command_line += std::to_string(request);
+    command_line += arguments;
+
+    STARTUPINFOA startup_info{};
+    startup_info.cb = sizeof(startup_info);
+    if (output != INVALID_HANDLE_VALUE)
+    {   // Discard child output, results are reported by the parent
+        startup_info.dwFlags = STARTF_USESTDHANDLES;
+        startup_info.hStdOutput = output;
+        startup_info.hStdError = output;
+    }
+
+    PROCESS_INFORMATION process_info{};
+    if (!CreateProcessA(preloaded ? launcher : binary.c_str(), 
+        &command_line[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr, 
+        &startup_info, &process_info))
+    {
+        throw std::exception("failed to create failure injection process");
+    }
+    CloseHandle(process_info.hThread);
+    return process_info.hProcess;
+}
+
+void Collect(gtest_memleak_detector::FailureSweep::Result& result, 
+    const Child& child)
+{
+    using gtest_memleak_detector::FailureSweep;
+
+    DWORD exit_code = 0;
+    if (!GetExitCodeProcess(child.process, &exit_code))
+        exit_code = static_cast<DWORD>(-1);
+    CloseHandle(child.process);
+
+    ++result.runs;
+    switch (FailureSweep::Classify(exit_code))
+    {
+    case FailureSweep::Outcome::Passed:
+        ++result.passed;
+        break;
+    case FailureSweep::Outcome::Failed:
+        ++result.failed;
+        break;
+    case FailureSweep::Outcome::Leaked:
+        if (result.leaked++ == 0 || child.request < result.first_leak)
+            result.first_leak = child.request;
+        break;
+    case FailureSweep::Outcome::Crashed:
+    default:
+        if (result.crashed++ == 0 || child.request < result.first_crash)
+        {
+            result.first_crash = child.request;
+            result.crash_code = exit_code;
+        }
+        break;
+    }
+}
+
+} // anonymous namespace
+
+gtest_memleak_detector::FailureSweep::Outcome 
+gtest_memleak_detector::FailureSweep::Classify(unsigned long exit_code) noexcept
+{
+    if (exit_code == 0u)
+        return Outcome::Passed;
+    if (exit_code == 1u) // RUN_ALL_TESTS() failure
+        return Outcome::Failed;
+    if (exit_code == leak_exit_code)
+        return Outcome::Leaked;
+    return Outcome::Crashed;
+}
+
+bool gtest_memleak_detector::FailureSweep::IsForwarded(const char* arg) noexcept
+{
+    // Children run a single test with a single allocation failing and report
+    // leaks by exit code only, hence flags changing any of that or writing 
+    // files of the parent are not forwarded
+    static const char* const excluded[] = {
+        "gtest_filter", "gtest_output", "gtest_repeat", "gtest_list_tests",
+        "gtest_break_on_failure", "gtest_throw_on_failure",
+        "memleak_fail_alloc", "memleak_fail_sweep", "memleak_fail_sweep_max",
+        "memleak_growth", "memleak_growth_min_iterations", "memleak_batch",
+        "memleak_record", "memleak_workload", "memleak_process_stats" };
+    if (arg == nullptr || 
+        (strncmp(arg, "--gtest_", 8u) != 0 && strncmp(arg, "--memleak_", 10u) != 0))
+    {
+        return false;
+    }
+    for (const auto* name : excluded)
+    {
+        if (IsFlag(arg, name))
+            return false;
+    }
+    return true;
+}
+
+gtest_memleak_detector::FailureSweep::Result 
+gtest_memleak_detector::FailureSweep::Run(
+    const char* test_filter, long allocations, unsigned parallelism)
+{
+    char binary[MAX_PATH];
+    const auto length = GetModuleFileNameA(nullptr, binary, MAX_PATH);
+    if (length == 0 || length >= MAX_PATH)
+        throw std::exception("failed to obtain test binary path");
+
+    // Child processes are waited for in groups limited by what a single 
+    // wait may observe
+    const auto max_children = (std::max)(1u, 
+        (std::min)(parallelism, static_cast<unsigned>(MAXIMUM_WAIT_OBJECTS)));
+    const auto arguments = ForwardedArguments();
+    const auto output = OpenNullDevice();
+
+    Result result;
+    std::vector<Child> children;
+    std::vector<HANDLE> handles;
+    children.reserve(max_children);
+    handles.reserve(max_children);
+    try
+    {
+        auto next = 1L;
+        while (next <= allocations || !children.empty())
+        {
+            while (next <= allocations && children.size() < max_children)
+            {
+                children.push_back(Child{ Spawn(binary, arguments, test_filter, 
+                    next, output), next });
+                ++next;
+            }
+
+            handles.clear();
+            for (const auto& child : children)
+                handles.push_back(child.process);
+            const auto signaled = WaitForMultipleObjects(
+                static_cast<DWORD>(handles.size()), handles.data(), FALSE, INFINITE);
+            if (signaled == WAIT_FAILED || signaled >= WAIT_OBJECT_0 + handles.size())
+                throw std::exception("failed to wait for failure injection process");
+
+            const auto index = static_cast<size_t>(signaled - WAIT_OBJECT_0);
+            Collect(result, children[index]);
+            children.erase(children.begin() + static_cast<std::ptrdiff_t>(index));
+        }
+    }
+    catch (...)
+    {
+        for (const auto& child : children)
+        {
+            TerminateProcess(child.process, 1u);
+            CloseHandle(child.process);
+        }
+        if (output != INVALID_HANDLE_VALUE)
+            CloseHandle(output);
+        throw;
+    }
+
+    if (output != INVALID_HANDLE_VALUE)
+        CloseHandle(output);
+    return result;
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
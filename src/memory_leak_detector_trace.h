@@ -0,0 +1,120 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file 
+// found in the root directory of this distribution.
+
+// Binary allocation trace file format written by the detector when recording
+// and read by the trace analyzer tool. Kept free of dependencies so that it
+// can be shared by both.
+
+#ifndef GTEST_MEMLEAK_DETECTOR_TRACE_H
+#define GTEST_MEMLEAK_DETECTOR_TRACE_H
+
+#include <cstddef>       // size_t
+#include <cstdint>       // uint64_t
+
+namespace gtest_memleak_detector {
+
+///////////////////////////////////////////////////////////////////////////////
+// TraceFileHeader
+//
+// Header preceding the events of a trace file. Event and dropped counts are
+// updated when the test ends.
+///////////////////////////////////////////////////////////////////////////////
+
+struct TraceFileHeader
+{
+    static constexpr uint32_t current_version = 1u;
+    static constexpr size_t max_test_length = 191u;
+
+    char        magic[8];       // "GTMLTRC" including terminator
+    uint32_t    version;
+    uint32_t    event_size;     // sizeof(TraceEvent)
+    uint64_t    frequency;      // timestamp ticks per second
+    uint64_t    start;          // timestamp of test start
+    uint64_t    events;         // number of events following the header
+    uint64_t    dropped;        // events dropped due to full buffers
+    char        test[max_test_length + 1];
+
+    static constexpr const char* Magic() noexcept { return "GTMLTRC"; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// TraceEvent
+//
+// A single allocation, reallocation or free. The CRT allocation hook is 
+// invoked before a block is allocated so allocated blocks are identified by 
+// their request no rather than their address. Events of different threads are
+// interleaved in chunks and need to be ordered by timestamp.
+///////////////////////////////////////////////////////////////////////////////
+
+struct TraceEvent
+{
+    enum class Type { Alloc, Realloc, Free };
+
+    uint64_t    timestamp;
+    uint64_t    address;        // block freed or reallocated, 0 if allocation
+    uint64_t    size;           // size allocated, 0 if free
+    uint64_t    freed;          // size of block freed or reallocated
+    int32_t     request;        // request no of allocated block, 0 if free
+    int32_t     previous;       // request no of block freed or reallocated
+    uint32_t    thread;
+    uint32_t    stack;          // call-site signature of allocation
+
+    Type GetType() const noexcept
+    {
+        if (previous == 0)
+            return Type::Alloc;
+        return (request == 0) ? Type::Free : Type::Realloc;
+    }
+};
+
+static_assert(sizeof(TraceEvent) == 48u, "unexpected trace event padding");
+
+///////////////////////////////////////////////////////////////////////////////
+// WorkloadFileHeader
+//
+// Header preceding the operations of a workload file, i.e. the allocation 
+// sequence of a test converted from its trace for replay against other 
+// allocators.
+///////////////////////////////////////////////////////////////////////////////
+
+struct WorkloadFileHeader
+{
+    static constexpr uint32_t current_version = 1u;
+
+    char        magic[8];       // "GTMLWKL" including terminator
+    uint32_t    version;
+    uint32_t    op_size;        // sizeof(WorkloadOp)
+    uint64_t    ops;            // number of operations following the header
+    uint32_t    threads;        // number of replay threads
+    uint32_t    slots;          // number of distinct blocks
+    char        test[TraceFileHeader::max_test_length + 1];
+
+    static constexpr const char* Magic() noexcept { return "GTMLWKL"; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// WorkloadOp
+//
+// A single operation of a workload. Blocks are numbered by dense slots in
+// order of allocation and threads by dense indices in order of appearance. 
+// Blocks allocated before the test are not part of the workload.
+///////////////////////////////////////////////////////////////////////////////
+
+struct WorkloadOp
+{
+    enum Type : uint8_t { Alloc, Realloc, Free };
+
+    uint32_t    slot;           // block allocated, or block freed if Free
+    uint32_t    previous;       // block reallocated if Realloc
+    uint32_t    size;           // size allocated, 0 if Free
+    uint16_t    thread;         // replay thread index
+    uint8_t     type;
+    uint8_t     reserved;
+};
+
+static_assert(sizeof(WorkloadOp) == 16u, "unexpected workload op padding");
+
+} // namespace gtest_memleak_detector
+
+#endif // GTEST_MEMLEAK_DETECTOR_TRACE_H
@@ -0,0 +1,69 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file 
+// found in the root directory of this distribution.
+
+#include <memory_leak_detector.h>
+
+#include <gtest_memleak_detector/gtest_memleak_detector.h>
+
+using namespace gtest_memleak_detector;
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+class memory_leak_detector_arena_test : public ::testing::Test
+{
+public:
+    memory_leak_detector_arena_test()
+        : sut(1024u * 1024u)
+    { }
+
+    Arena sut;
+};
+
+TEST_F(memory_leak_detector_arena_test,
+    allocate__should_return_aligned_memory__if_given_alignment)
+{
+    auto* ptr = sut.Allocate(3, 64);
+    EXPECT_NE(ptr, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % 64u, 0u);
+}
+
+TEST_F(memory_leak_detector_arena_test,
+    allocate__should_recycle_block__if_block_of_same_size_class_has_been_deallocated)
+{
+    auto* first = sut.Allocate(24);
+    sut.Deallocate(first, 24);
+    auto* second = sut.Allocate(32);
+    EXPECT_EQ(first, second);
+}
+
+TEST_F(memory_leak_detector_arena_test,
+    reset__should_make_all_memory_available__if_previously_allocated)
+{
+    auto* first = sut.Allocate(4096);
+    sut.Reset();
+    EXPECT_EQ(sut.Used(), 0u);
+    EXPECT_EQ(sut.Allocate(4096), first);
+}
+
+TEST_F(memory_leak_detector_arena_test,
+    allocate__should_throw_bad_alloc__if_reserved_memory_is_exhausted)
+{
+    EXPECT_THROW(sut.Allocate(2u * 1024u * 1024u), std::bad_alloc);
+}
+
+TEST_F(memory_leak_detector_arena_test,
+    allocate__should_not_allocate_from_crt_heap__if_used_via_arena_allocator)
+{
+    _CrtMemState pre_state;
+    _CrtMemCheckpoint(&pre_state);
+    
+    TraceString str(4096, 'x');
+
+    _CrtMemState post_state;
+    _CrtMemCheckpoint(&post_state);
+    _CrtMemState diff;
+    EXPECT_EQ(_CrtMemDifference(&diff, &pre_state, &post_state), 0);
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
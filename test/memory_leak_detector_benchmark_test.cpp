@@ -0,0 +1,55 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file 
+// found in the root directory of this distribution.
+
+#include <gtest_memleak_detector/gtest_memleak_detector_benchmark.h>
+
+#include <cstdlib>
+
+using namespace gtest_memleak_detector;
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+TEST(memory_leak_detector_benchmark_test,
+    stop__should_report_allocations_peak_and_leaks__if_blocks_allocated_after_start)
+{
+    BenchmarkMemoryManager sut;
+    ::benchmark::MemoryManager::Result result;
+    sut.Start();
+    auto* first = malloc(100);
+    auto* second = malloc(50);
+    free(first);
+    auto* third = malloc(20);
+    sut.Stop(result);
+    free(third);                        // cleanup
+    free(second);                       // cleanup
+
+    EXPECT_EQ(result.num_allocs, 3);
+    EXPECT_EQ(result.total_allocated_bytes, 170);
+    EXPECT_EQ(result.max_bytes_used, 150);
+    EXPECT_EQ(result.net_heap_growth, 70);
+    EXPECT_EQ(sut.LeakedBlocks(), 2);
+}
+
+TEST(memory_leak_detector_benchmark_test,
+    stop__should_report_no_leaks_and_reset_counters__if_run_is_balanced)
+{
+    BenchmarkMemoryManager sut;
+    ::benchmark::MemoryManager::Result result;
+    sut.Start();
+    auto* leak = malloc(64);
+    sut.Stop(result);
+    free(leak);                         // cleanup
+
+    sut.Start();
+    free(malloc(32));
+    sut.Stop(result);
+
+    EXPECT_EQ(result.num_allocs, 1);
+    EXPECT_EQ(result.total_allocated_bytes, 32);
+    EXPECT_EQ(result.max_bytes_used, 32);
+    EXPECT_EQ(result.net_heap_growth, 0);
+    EXPECT_EQ(sut.LeakedBlocks(), 0);
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
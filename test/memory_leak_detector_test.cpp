@@ -5,9 +5,19 @@
 
 #include <memory_leak_detector.h>
 
+#include <gtest/gtest-spi.h> // enables testing test failures
+
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <cstring>
+#include <malloc.h>
+#include <memory>
+#include <new>
 #include <string>
+#include <thread>
+#include <vector>
 
 using namespace gtest_memleak_detector;
 
@@ -46,7 +56,12 @@ public:
 
     void GivenFailCallbackSet()
     {
-        sut.SetFailureCallback(
+        GivenFailCallbackSet(sut);
+    }
+
+    void GivenFailCallbackSet(MemoryLeakDetector& detector)
+    {
+        detector.SetFailureCallback(
             [this](long n, const char* f, unsigned long l, const char* t)
         { this->Fail(n, f, l, t); });
     }
@@ -96,6 +111,13 @@ TEST_F(memory_leak_detector_test,
         "/user/myuser/test.gt.memleaks");
 }
 
+TEST_F(memory_leak_detector_test,
+    make_trace_file_path__should_return_path_with_test_name_and_suffix__if_given_test_name)
+{
+    EXPECT_STREQ(MemoryLeakDetector::MakeTraceFilePath("test.exe", "suite::test/1").c_str(),
+        "test.exe.suite__test_1.gt.memtrace");
+}
+
 TEST_F(memory_leak_detector_test,
     make_failure_message__should_return_message_containing_all_info__if_given_only_valid_input)
 {
@@ -150,6 +172,313 @@ TEST_F(memory_leak_detector_test,
         GTEST_MEMLEAK_DETECTOR_RERUN_MESSAGE_PART_2);
 }
 
+TEST_F(memory_leak_detector_test,
+    make_failure_message__should_mention_count_mode__if_given_count_mode)
+{
+    EXPECT_STREQ(MemoryLeakDetector::MakeFailureMessage(
+        3456, nullptr, 0, nullptr, MemoryLeakDetector::CaptureMode::Count).c_str(),
+        GTEST_MEMLEAK_DETECTOR_LEAK_MSG_PART
+        GTEST_MEMLEAK_DETECTOR_REQUEST_MSG_PART "3456)"
+        " [count mode: allocation-heavy test, identified by request no only]"
+        GTEST_MEMLEAK_DETECTOR_RERUN_MESSAGE_PART_2);
+}
+
+TEST_F(memory_leak_detector_test,
+    make_failure_message__should_truncate_message__if_stacktrace_exceeds_buffer_capacity)
+{
+    const std::string long_trace(MemoryLeakDetector::FailureMessage::capacity, 'x');
+    const auto message = MemoryLeakDetector::MakeFailureMessage(
+        1234, nullptr, 0, long_trace.c_str());
+    EXPECT_TRUE(message.truncated());
+    EXPECT_EQ(message.size(), MemoryLeakDetector::FailureMessage::capacity - 1);
+}
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+TEST_F(memory_leak_detector_test,
+    file_table_intern__should_return_same_id__if_given_equal_file_names)
+{
+    FileTable files;
+    const auto id = files.Intern("somefile.cpp");
+    EXPECT_NE(id, FileTable::invalid_id);
+    EXPECT_EQ(files.Intern(std::string("somefile.cpp").c_str()), id);
+    EXPECT_NE(files.Intern("otherfile.cpp"), id);
+    EXPECT_STREQ(files.Name(id), "somefile.cpp");
+    EXPECT_STREQ(files.Name(FileTable::invalid_id), "");
+    EXPECT_EQ(files.Size(), 2u);
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+TEST_F(memory_leak_detector_test,
+    parse_options__should_identify_by_request__if_not_given_any_options)
+{
+    EXPECT_EQ(MemoryLeakDetector::ParseOptions(1, argv).identity, 
+        MemoryLeakDetector::IdentityMode::Request);
+}
+
+TEST_F(memory_leak_detector_test,
+    parse_options__should_identify_by_signature__if_given_signature_identity_option)
+{
+    char* args[] = { "test.exe", "--memleak_identity=signature" };
+    EXPECT_EQ(MemoryLeakDetector::ParseOptions(2, args).identity,
+        MemoryLeakDetector::IdentityMode::Signature);
+}
+
+TEST_F(memory_leak_detector_test,
+    parse_options__should_throw__if_given_invalid_identity_option)
+{
+    char* args[] = { "test.exe", "--memleak_identity=something" };
+    EXPECT_ANY_THROW(MemoryLeakDetector::ParseOptions(2, args));
+}
+
+TEST_F(memory_leak_detector_test,
+    parse_options__should_enable_growth__if_given_growth_min_iterations_option)
+{
+    char* args[] = { "test.exe", "--memleak_growth_min_iterations=10" };
+    const auto options = MemoryLeakDetector::ParseOptions(2, args);
+    EXPECT_TRUE(options.growth);
+    EXPECT_EQ(options.growth_min_iterations, 10);
+}
+
+TEST_F(memory_leak_detector_test,
+    parse_options__should_enable_process_stats__if_given_process_stats_option)
+{
+    char* args[] = { "test.exe", "--memleak_process_stats" };
+    EXPECT_FALSE(MemoryLeakDetector::ParseOptions(1, args).process_stats);
+    EXPECT_TRUE(MemoryLeakDetector::ParseOptions(2, args).process_stats);
+}
+
+TEST_F(memory_leak_detector_test,
+    parse_options__should_enable_lifetime__if_given_lifetime_option)
+{
+    char* args[] = { "test.exe", "--memleak_lifetime" };
+    EXPECT_FALSE(MemoryLeakDetector::ParseOptions(1, args).lifetime);
+    EXPECT_TRUE(MemoryLeakDetector::ParseOptions(2, args).lifetime);
+}
+
+TEST_F(memory_leak_detector_test,
+    parse_options__should_enable_quiescence__if_given_quiescence_option)
+{
+    char* args[] = { "test.exe", "--memleak_quiescence=500",
+        "--memleak_quiescence_window=20" };
+    EXPECT_EQ(MemoryLeakDetector::ParseOptions(1, args).quiescence_timeout, 0);
+    const auto options = MemoryLeakDetector::ParseOptions(3, args);
+    EXPECT_EQ(options.quiescence_timeout, 500);
+    EXPECT_EQ(options.quiescence_window, 20);
+    EXPECT_EQ(options.quiescence_condition, 
+        MemoryLeakDetector::QuiescenceCondition::Any);
+
+    char* all_args[] = { "test.exe", "--memleak_quiescence_condition=all" };
+    EXPECT_EQ(MemoryLeakDetector::ParseOptions(2, all_args).quiescence_condition,
+        MemoryLeakDetector::QuiescenceCondition::All);
+}
+
+TEST_F(memory_leak_detector_test,
+    parse_options__should_enable_child_processes__if_given_child_processes_option)
+{
+    char* args[] = { "test.exe", "--memleak_child_processes" };
+    EXPECT_FALSE(MemoryLeakDetector::ParseOptions(1, args).children);
+    EXPECT_TRUE(MemoryLeakDetector::ParseOptions(2, args).children);
+}
+
+#ifdef GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+TEST_F(memory_leak_detector_test,
+    process_memory_difference__should_return_deltas__if_given_two_samples)
+{
+    ProcessMemory::Sample pre;
+    ASSERT_TRUE(ProcessMemory::Capture(pre));
+    auto post = pre;
+    post.working_set -= 4096;
+    post.peak_working_set += 8192;
+    post.page_faults += 3;
+    post.private_bytes += 1024 * 1024;
+
+    const auto stats = ProcessMemory::Difference(pre, post);
+    EXPECT_EQ(stats.working_set_delta, -4096);
+    EXPECT_EQ(stats.peak_working_set, post.peak_working_set);
+    EXPECT_EQ(stats.peak_working_set_delta, 8192);
+    EXPECT_EQ(stats.page_faults, 3u);
+    EXPECT_GT(stats.committed_pages, 0);
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+
+TEST_F(memory_leak_detector_test,
+    leak_summary_aggregate__should_group_leaks_by_site__if_given_records_from_many_tests)
+{
+    LeakSummary summary;
+    const auto signature_key = LeakSummary::MakeKey(1234u, Location(), 5678u);
+    const auto fingerprint_key = LeakSummary::MakeKey(StackSignature::invalid, Location(), 5678u);
+    for (auto i = 0; i < 10000; ++i)
+    {
+        const auto key = (i % 4 == 0) ? fingerprint_key : signature_key;
+        summary.Add(key, 64u, "some_test", (i == 9999) ? "- trace\n" : nullptr);
+    }
+
+    const auto groups = summary.Aggregate(4u);
+    ASSERT_EQ(groups.size(), 2u);
+    EXPECT_EQ(groups[0].key, signature_key);
+    EXPECT_EQ(groups[0].tests, 7500u);
+    EXPECT_EQ(groups[0].bytes, 7500u * 64u);
+    EXPECT_STREQ(groups[0].representative->trace.c_str(), "- trace\n");
+    EXPECT_EQ(groups[1].key, fingerprint_key);
+    EXPECT_EQ(groups[1].tests, 2500u);
+}
+
+TEST_F(memory_leak_detector_test,
+    leak_summary_aggregate__should_not_group_leaks__if_site_unknown)
+{
+    LeakSummary summary;
+    const auto key = LeakSummary::MakeKey(StackSignature::invalid, Location(), 0u);
+    EXPECT_EQ(LeakSummary::Kind(key), LeakSummary::KeyKind::None);
+    summary.Add(key, 64u, "first_test", nullptr);
+    summary.Add(key, 64u, "second_test", nullptr);
+    EXPECT_EQ(summary.Aggregate(1u).size(), 2u);
+}
+
+TEST_F(memory_leak_detector_test,
+    growth_tracker__should_report_growth__if_retained_memory_grows_linearly)
+{
+    GrowthTracker tracker;
+    FileTable files;
+    const DatabaseString key("some_test");
+    for (auto i = 0; i < 10; ++i)
+        tracker.Sample(key, 64, 1).AddSite(files.Intern("cache.cpp"), 42, StackSignature::invalid, 64);
+
+    const auto& trend = tracker.Sample(key, 64, 1);
+    EXPECT_TRUE(trend.Growing(5));
+    EXPECT_DOUBLE_EQ(trend.bytes.Slope(), 64.0);
+    EXPECT_EQ(trend.sites[0].blocks, 10u);
+}
+
+TEST_F(memory_leak_detector_test,
+    growth_tracker__should_not_report_growth__if_retained_memory_is_bounded)
+{
+    GrowthTracker tracker;
+    const DatabaseString key("some_test");
+    tracker.Sample(key, 1024, 16);
+    for (auto i = 0; i < 10; ++i)
+        tracker.Sample(key, 0, 0);
+    EXPECT_FALSE(tracker.Sample(key, 0, 0).Growing(5));
+}
+
+TEST_F(memory_leak_detector_test,
+    write_growth_report__should_report_call_site_signature__if_allocation_rate_exceeds_trace_limit)
+{
+    char* args[] = { "test.exe", "--memleak_growth", "--memleak_trace_limit=1" };
+    MemoryLeakDetector detector(3, args);
+
+    auto descriptor = []() { return std::string("some_test"); };
+    void* retained[5]{};
+    for (auto& ptr : retained)
+    {
+        detector.Start(descriptor);
+        for (auto i = 0; i < 2 * MemoryLeakDetector::trace_rate_window; ++i)
+            free(malloc(16));           // faster than one per second
+        ptr = malloc(64);               // retained, grows every iteration
+        detector.End(descriptor, true); // true: passed
+    }
+
+    const char* path = "growth_report_test.txt";
+    auto* file = fopen(path, "w+");
+    ASSERT_NE(file, nullptr);
+    detector.WriteGrowthReport(file);
+    rewind(file);
+    char report[1024]{};
+    (void)fread(report, 1, sizeof(report) - 1, file);
+    fclose(file);
+    std::remove(path);
+    for (auto* ptr : retained)
+        free(ptr);                      // cleanup
+
+    EXPECT_NE(strstr(report, "some_test grows 64.0 bytes"), nullptr);
+    EXPECT_NE(strstr(report, "signature 0x"), nullptr);
+    EXPECT_EQ(strstr(report, "site unknown"), nullptr);
+}
+
+TEST_F(memory_leak_detector_test,
+    sequence_fingerprint__should_locate_first_differing_request__if_sequence_changes_between_runs)
+{
+    auto sequence = std::make_unique<SequenceFingerprint>();
+    const auto run = [&sequence](const SequenceFingerprint::Baseline* baseline,
+        size_t size_of_request_70)
+    {
+        long located = 0;
+        sequence->Begin(baseline);
+        for (long request = 1; request <= 200; ++request)
+        {
+            if (sequence->Add((request == 70) ? size_of_request_70 : 16u))
+                located = request;
+        }
+        sequence->End();
+        return located;
+    };
+
+    EXPECT_EQ(run(nullptr, 16u), 0);
+    const auto first = sequence->Current();
+    SequenceFingerprint::Divergence divergence;
+    EXPECT_FALSE(sequence->Diverged(divergence));
+
+    // Located within a window on the next run
+    EXPECT_EQ(run(&first, 24u), 0);
+    const auto second = sequence->Current();
+    ASSERT_TRUE(sequence->Diverged(divergence));
+    EXPECT_EQ(divergence.first, 65);
+    EXPECT_EQ(divergence.last, 128);
+
+    // Located exactly on the run after
+    EXPECT_EQ(run(&second, 16u), 70);
+    ASSERT_TRUE(sequence->Diverged(divergence));
+    EXPECT_EQ(divergence.first, 70);
+    EXPECT_EQ(divergence.last, 70);
+    EXPECT_EQ(divergence.size, 16u);
+    EXPECT_EQ(divergence.expected, 24u);
+}
+
+TEST_F(memory_leak_detector_test,
+    make_divergence_message__should_return_message_with_ordinal_and_sizes__if_located)
+{
+    SequenceFingerprint::Divergence divergence;
+    divergence.first = divergence.last = 70;
+    divergence.size = 16u;
+    divergence.expected = 24u;
+    EXPECT_STREQ(MemoryLeakDetector::MakeDivergenceMessage(divergence, "stacktrace_data").c_str(),
+        "Allocation sequence differs from previous run at allocation 70 of the "
+        "test's allocation sequence (size 16, previously 24) at:\nstacktrace_data");
+}
+
+TEST_F(memory_leak_detector_test,
+    lifetime_profile__should_flag_site__if_most_blocks_die_within_few_requests)
+{
+    auto lifetime = std::make_unique<LifetimeProfile>();
+    lifetime->Reset(100);
+    long request = 100;
+    for (auto i = 0; i < 100; ++i)
+    {   // Temporary freed immediately, long-lived block freed at the end
+        ++request;
+        lifetime->OnAllocation(request, 24u, 1234u, 0u);
+        lifetime->OnFree(request, request, 0u);
+        ++request;
+        lifetime->OnAllocation(request, 4096u, 5678u, 0u);
+    }
+    for (long i = 102; i <= request; i += 2)
+        lifetime->OnFree(i, request + 100, 0u);
+    lifetime->OnFree(50, request, 0u); // allocated before test
+
+    const auto& profile = lifetime->Get();
+    EXPECT_EQ(profile.allocations, 200u);
+    EXPECT_EQ(profile.frees, 200u);
+    EXPECT_EQ(profile.short_lived, 100u);
+    EXPECT_EQ(profile.untracked, 0u);
+    EXPECT_EQ(profile.sizes.counts[LifetimeProfile::Histogram::Bucket(24u)], 100u);
+    EXPECT_EQ(profile.requests.counts[0], 100u);
+    EXPECT_TRUE(profile.Flagged());
+    for (const auto& site : profile.sites)
+        EXPECT_EQ(site.ShortLived(), site.signature == 1234u);
+}
+
 TEST_F(memory_leak_detector_test, 
     end__should_not_report_failure__if_not_leaking_and_test_has_no_assertion_failures)
 {
@@ -248,5 +577,1115 @@ TEST_F(memory_leak_detector_test,
     EXPECT_STREQ(trace.c_str(), expected_trace.c_str());    // first run, no trace info
 }
 
-#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
+TEST_F(memory_leak_detector_test,
+    end__should_group_leaks_in_summary_by_call_site__if_identified_by_request)
+{
+    GivenFailCallbackSet();
+
+    // Leaks from two call sites, one of them shared by two tests, e.g. 
+    // instantiations of a parameterized test
+    const auto run = [this](const char* name, bool shared_site)
+    {
+        const auto descriptor = [name]() { return std::string(name); };
+        sut.Start(descriptor);
+        auto* ptr = shared_site ? leaking_test_case(64) : malloc(64);
+        sut.End(descriptor, true);      // true: passed
+        free(ptr);                      // cleanup
+    };
+    const auto run_all = [&run]()
+    {
+        for (const auto* name : { "first_test", "second_test", "third_test" })
+            run(name, strcmp(name, "second_test") != 0);
+    };
+    run_all();
+
+    // Signatures are recorded on first run without a stack-trace
+    auto groups = sut.GetLeakSummary().Aggregate(1u);
+    ASSERT_EQ(groups.size(), 2u);
+    for (const auto& group : groups)
+        EXPECT_EQ(LeakSummary::Kind(group.key), LeakSummary::KeyKind::Signature);
+    EXPECT_EQ(groups[0].tests, 2u);
+    EXPECT_TRUE(groups[0].representative->trace.empty());
+
+    // Rerun to obtain stack traces of the same groups
+    run_all();
+
+    groups = sut.GetLeakSummary().Aggregate(1u);
+    ASSERT_EQ(groups.size(), 2u);
+    EXPECT_EQ(groups[0].tests, 4u);
+    EXPECT_NE(groups[0].representative->trace.find("leaking_test_case"), 
+        std::string::npos);
+    EXPECT_EQ(groups[1].tests, 2u);
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_report_trace__if_leaking_and_rerun_with_shifted_request_no_in_signature_identity_mode)
+{
+    char* args[] = { "test.exe", "--memleak_identity=signature" };
+    MemoryLeakDetector detector(2, args);
+    GivenFailCallbackSet(detector);
+
+    auto descriptor = []() { return std::string("some_test"); };
+    for (auto run = 0; run < 2; ++run)
+    {
+        Reset();
+        detector.Start(descriptor);
+        if (run == 1)
+            free(malloc(32));           // shifts request no of leak on re-run
+        auto* ptr = leaking_test_case(64);
+        detector.End(descriptor, true); // true: passed
+        free(ptr);                      // cleanup
+    }
+
+    ASSERT_EQ(fail_count, 1u);
+    EXPECT_EQ(line, leaking_test_case_line);
+    EXPECT_STREQ(file.c_str(), this_file.c_str());
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_report_trace_in_count_mode__if_leaking_and_allocation_rate_exceeds_trace_limit)
+{
+    char* args[] = { "test.exe", "--memleak_identity=signature", "--memleak_trace_limit=1" };
+    MemoryLeakDetector detector(3, args);
+    GivenFailCallbackSet(detector);
+
+    auto descriptor = []() { return std::string("some_test"); };
+    for (auto run = 0; run < 2; ++run)
+    {
+        Reset();
+        detector.Start(descriptor);
+        for (auto i = 0; i < 2 * MemoryLeakDetector::trace_rate_window; ++i)
+            free(malloc(16));           // faster than one per second
+        auto* ptr = leaking_test_case(64);
+        detector.End(descriptor, true); // true: passed
+        free(ptr);                      // cleanup
+        EXPECT_EQ(detector.GetCaptureMode(), MemoryLeakDetector::CaptureMode::Count);
+    }
+
+    ASSERT_EQ(fail_count, 1u);
+    EXPECT_EQ(line, leaking_test_case_line);
+    EXPECT_STREQ(file.c_str(), this_file.c_str());
+}
+
+TEST_F(memory_leak_detector_test,
+    start__should_begin_in_trace_mode__if_previous_run_allocated_slower_than_trace_limit)
+{
+    char* args[] = { "test.exe", "--memleak_trace_limit=1" };
+    MemoryLeakDetector detector(2, args);
+
+    auto descriptor = []() { return std::string("some_test"); };
+    const auto run = [&](long allocations)
+    {
+        detector.Start(descriptor);
+        const auto mode = detector.GetCaptureMode();
+        for (auto i = 0; i < allocations; ++i)
+            free(malloc(16));
+        detector.End(descriptor, true); // true: passed
+        return mode;
+    };
+
+    EXPECT_EQ(run(2 * MemoryLeakDetector::trace_rate_window), 
+        MemoryLeakDetector::CaptureMode::Trace);
+    EXPECT_EQ(run(1), MemoryLeakDetector::CaptureMode::Count); // downgraded
+    EXPECT_EQ(run(1), MemoryLeakDetector::CaptureMode::Trace); // re-evaluated
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_report_trace__if_leaking_and_rerun_with_request_no_shifted_within_break_window)
+{
+    GivenFailCallbackSet();
+
+    auto descriptor = []() { return std::string("some_test"); };
+    for (auto run = 0; run < 2; ++run)
+    {
+        Reset();
+        sut.Start(descriptor);
+        if (run == 1)
+            free(malloc(32));           // different size at recorded request no
+        auto* ptr = leaking_test_case(64);
+        sut.End(descriptor, true);      // true: passed
+        free(ptr);                      // cleanup
+    }
+
+    ASSERT_EQ(fail_count, 1u);
+    EXPECT_EQ(line, leaking_test_case_line);
+    EXPECT_STREQ(file.c_str(), this_file.c_str());
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_not_report_trace__if_leaking_and_rerun_with_different_size_at_recorded_request_no)
+{
+    GivenFailCallbackSet();
+
+    auto descriptor = []() { return std::string("some_test"); };
+    for (auto run = 0; run < 2; ++run)
+    {
+        Reset();
+        sut.Start(descriptor);
+        auto* ptr = leaking_test_case(run == 0 ? 64 : 128);
+        sut.End(descriptor, true);      // true: passed
+        free(ptr);                      // cleanup
+    }
+
+    ASSERT_EQ(fail_count, 1u);
+    EXPECT_EQ(line, unsigned long(-1)); // no line
+    EXPECT_STREQ(trace.c_str(), "");    // no trace since block differs
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_report_annotated_leak_with_trace__if_pool_object_not_freed_and_rerun)
+{
+    GivenFailCallbackSet();
+
+    static char pool[256];
+    auto descriptor = []() { return std::string("some_test"); };
+    unsigned long annotate_line = 0;
+    for (auto run = 0; run < 2; ++run)
+    {
+        Reset();
+        sut.Start(descriptor);
+        AnnotateAlloc(pool, pool + 0, 32);
+        AnnotateFree(pool, pool + 0);
+        annotate_line = unsigned long(__LINE__) + 1;
+        AnnotateAlloc(pool, pool + 32, 64);
+        sut.End(descriptor, true);      // true: passed
+    }
+
+    ASSERT_EQ(fail_count, 1u);
+    EXPECT_EQ(alloc_no, 2);             // second annotated allocation
+    EXPECT_EQ(line, annotate_line);
+    EXPECT_STREQ(file.c_str(), this_file.c_str());
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_not_report_leak__if_annotated_pool_objects_are_freed)
+{
+    GivenFailCallbackSet();
+
+    static char pool[256];
+    auto descriptor = []() { return std::string("some_test"); };
+    sut.Start(descriptor);
+    AnnotateAlloc(pool, pool + 0, 32);
+    AnnotateAlloc(pool, pool + 32, 64);
+    AnnotateFree(pool, pool + 32);
+    AnnotateFree(pool, pool + 0);
+    sut.End(descriptor, true);          // true: passed
+
+    EXPECT_EQ(fail_count, 0u);
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_report_annotated_leaks__if_pool_is_used_concurrently_by_many_threads)
+{
+    GivenFailCallbackSet();
+
+    constexpr size_t thread_count = 8u;
+    constexpr size_t slots = 64u;       // per thread
+    static char pool[thread_count * slots];
+    std::atomic<bool> start{ false };
+    std::atomic<bool> release{ false };
+    std::atomic<size_t> done{ 0u };
+    std::vector<std::thread> workers;
+    workers.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; ++i)
+    {
+        workers.emplace_back([&, i]()
+        {
+            while (!start)
+                std::this_thread::yield();
+            auto* slab = pool + i * slots;
+            for (size_t n = 0; n < 10000u; ++n)
+            {
+                AnnotateAlloc(pool, slab + n % slots, 1u);
+                AnnotateFree(pool, slab + n % slots);
+            }
+            AnnotateAlloc(pool, slab, 1u); // leaked
+            ++done;
+            while (!release)            // exit after test, frees thread state
+                std::this_thread::yield();
+        });
+    }
+
+    auto descriptor = []() { return std::string("some_test"); };
+    sut.Start(descriptor);
+    start = true;
+    while (done != thread_count)
+        std::this_thread::yield();
+    sut.End(descriptor, true);          // true: passed
+    const auto leaks = sut.ForEachLeak([](const Leak&) { return true; });
+    release = true;
+    for (auto& worker : workers)
+        worker.join();
+
+    EXPECT_EQ(fail_count, 1u);
+    EXPECT_EQ(leaks, thread_count);
+}
+
+TEST_F(memory_leak_detector_test,
+    annotation_table__should_keep_remaining_blocks__if_blocks_of_probe_sequences_erased)
+{
+    static char pool;
+    const auto address = [](size_t i) { 
+        return reinterpret_cast<const void*>(uintptr_t(16u) * (i + 1u)); };
+    constexpr size_t blocks = 40000u;   // most shards near their max size
+    AnnotationTable table;
+    for (size_t i = 0; i < blocks; ++i)
+        EXPECT_TRUE(table.Insert({ address(i), &pool, 16u, long(i), 0u }));
+    for (size_t i = 0; i < blocks; i += 2u)
+        table.Erase(&pool, address(i));
+    table.Erase(&pool + 1, address(1u)); // other pool, kept
+
+    size_t odd = 0;
+    const auto count = table.ForEach([&](const AnnotationTable::Block& block)
+    {
+        odd += (block.request % 2 == 1) && block.ptr == address(size_t(block.request));
+        return true;
+    });
+    EXPECT_EQ(count, blocks / 2u);
+    EXPECT_EQ(odd, blocks / 2u);
+    for (size_t i = 1u; i < blocks; i += 2u)
+        table.Erase(&pool, address(i));
+    EXPECT_EQ(table.ForEach([](const AnnotationTable::Block&) { return true; }), 0u);
+    EXPECT_EQ(table.Dropped(), 0u);
+}
+
+TEST_F(memory_leak_detector_test,
+    annotation_table__should_count_dropped_blocks__if_shards_full)
+{
+    static char pool;
+    constexpr auto capacity = AnnotationTable::shard_count * AnnotationTable::shard_capacity;
+    AnnotationTable table;
+    for (size_t i = 0; i < capacity; ++i)
+    {
+        (void)table.Insert({ reinterpret_cast<const void*>(uintptr_t(16u) * (i + 1u)), 
+            &pool, 16u, long(i), 0u });
+    }
+    const auto count = table.ForEach([](const AnnotationTable::Block&) { return true; });
+
+    EXPECT_LE(count, AnnotationTable::shard_count * AnnotationTable::max_shard_size);
+    EXPECT_EQ(count + table.Dropped(), capacity);
+    table.Clear();
+    EXPECT_EQ(table.ForEach([](const AnnotationTable::Block&) { return true; }), 0u);
+    EXPECT_EQ(table.Dropped(), 0u);
+}
+
+TEST_F(memory_leak_detector_test,
+    for_each_leak__should_visit_structured_leak_records__if_test_leaked_heap_and_pool_blocks)
+{
+    GivenFailCallbackSet();
+
+    static char pool[64];
+    auto descriptor = []() { return std::string("some_test"); };
+    sut.Start(descriptor);
+    auto* ptr = malloc(24);
+    AnnotateAlloc(pool, pool + 16, 16);
+    sut.End(descriptor, true);          // true: passed
+
+    std::vector<Leak> leaks;
+    EXPECT_EQ(sut.ForEachLeak([&leaks](const Leak& leak) 
+    { 
+        leaks.push_back(leak);
+        return true;
+    }), 2u);
+    long request = 0;
+    EXPECT_TRUE(_CrtIsMemoryBlock(ptr, 24, &request, nullptr, nullptr));
+    free(ptr);                          // cleanup
+
+    EXPECT_EQ(fail_count, 2u);          // pool leak reported in addition
+    ASSERT_EQ(leaks.size(), 2u);
+    EXPECT_EQ(leaks[0].address, ptr);   // heap blocks first
+    EXPECT_EQ(leaks[0].size, 24u);
+    EXPECT_EQ(leaks[0].request, request);
+    EXPECT_EQ(leaks[0].pool, nullptr);
+    EXPECT_EQ(leaks[0].thread, GetCurrentThreadId()); // default identity mode
+    EXPECT_NE(leaks[0].stack, StackSignature::invalid);
+    EXPECT_EQ(leaks[1].address, pool + 16);
+    EXPECT_EQ(leaks[1].size, 16u);
+    EXPECT_EQ(leaks[1].pool, pool);
+    EXPECT_EQ(leaks[1].thread, GetCurrentThreadId());
+    EXPECT_EQ(leaks[1].request, alloc_no); // reported last
+
+    // Enumeration stops when the callback returns false
+    EXPECT_EQ(sut.ForEachLeak([](const Leak&) { return false; }), 1u);
+}
+
+TEST_F(memory_leak_detector_test,
+    scoped_leak_check__should_visit_blocks_leaked_within_scope__if_nested)
+{
+    void* outer_leak = nullptr;
+    void* inner_leak = nullptr;
+    std::vector<const void*> outer;
+    std::vector<const void*> inner;
+    outer.reserve(4);
+    inner.reserve(4);
+    {
+        ScopedLeakCheck outer_check([&outer](const Leak& leak)
+        {
+            outer.push_back(leak.address);
+            return true;
+        });
+        outer_leak = malloc(16);
+        {
+            ScopedLeakCheck inner_check([&inner](const Leak& leak)
+            {
+                inner.push_back(leak.address);
+                return true;
+            });
+            free(malloc(32));
+            inner_leak = malloc(8);
+        }
+    }
+    free(inner_leak);                   // cleanup
+    free(outer_leak);                   // cleanup
+
+    ASSERT_EQ(inner.size(), 1u);
+    EXPECT_EQ(inner[0], inner_leak);
+    ASSERT_EQ(outer.size(), 2u);        // enclosing check includes nested leaks
+    EXPECT_EQ(outer[0], inner_leak);    // most recent first
+    EXPECT_EQ(outer[1], outer_leak);
+}
+
+TEST_F(memory_leak_detector_test,
+    scoped_leak_check__should_not_visit_any_block__if_scope_is_balanced)
+{
+    size_t leaks = 0;
+    for (auto i = 0; i < 1000; ++i)
+    {
+        ScopedLeakCheck check([&leaks](const Leak&) { ++leaks; return true; });
+        free(malloc(16));
+    }
+    EXPECT_EQ(leaks, 0u);
+}
+
+TEST_F(memory_leak_detector_test,
+    diff__should_return_blocks_allocated_between_snapshots__if_still_alive)
+{
+    auto* before = malloc(16);
+    Snapshot first;
+    free(malloc(32));
+    auto* retained = malloc(8);
+    Snapshot last;
+    auto* after = malloc(64);
+
+    const auto blocks = Diff(first, last);
+    const auto reversed = Diff(last, first);
+    free(after);                        // cleanup
+    free(retained);                     // cleanup
+    free(before);                       // cleanup
+
+    ASSERT_EQ(blocks.size(), 1u);
+    EXPECT_EQ(blocks[0].address, retained);
+    EXPECT_EQ(blocks[0].size, 8u);
+    EXPECT_GT(blocks[0].request, first.Epoch());
+    EXPECT_LT(blocks[0].request, last.Epoch());
+    EXPECT_TRUE(reversed.empty());
+}
+
+TEST_F(memory_leak_detector_test,
+    diff__should_not_return_block__if_reallocated_in_place_after_last_snapshot)
+{
+    Snapshot first;
+    auto* retained = malloc(64);
+    Snapshot last;
+    auto* shrunk = _expand(retained, 32); // in place, i.e. not relinked
+
+    const auto blocks = Diff(first, last);
+    free(retained);                     // cleanup
+
+    EXPECT_EQ(shrunk, retained);
+    for (const auto& block : blocks)
+        EXPECT_LT(block.request, last.Epoch());
+}
+
+TEST_F(memory_leak_detector_test,
+    diff__should_only_return_live_blocks__if_other_thread_frees_concurrently)
+{
+    // Blocks are copied with the heap lock held, so blocks freed by other
+    // threads while diffing are never dereferenced
+    std::atomic<bool> stop{ false };
+    std::thread worker([&stop]()
+    {
+        while (!stop.load())
+            free(malloc(16));
+    });
+
+    size_t blocks = 0;
+    for (auto i = 0; i < 1000; ++i)
+    {
+        Snapshot first;
+        auto* retained = malloc(8);
+        Snapshot last;
+        const auto diff = Diff(first, last);
+        blocks += static_cast<size_t>(std::count_if(diff.begin(), diff.end(),
+            [retained](const Leak& leak) { return leak.address == retained; }));
+        free(retained);                 // cleanup
+    }
+    stop.store(true);
+    worker.join();                      // cleanup
+
+    EXPECT_EQ(blocks, 1000u);
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_only_report_leak__if_allocated_within_context_of_running_test)
+{
+    GivenFailCallbackSet();
+
+    auto descriptor = []() { return std::string("some_test"); };
+    sut.Start(descriptor);
+    const auto ended = LeakContext::Capture(); // e.g. captured by a task
+    sut.End(descriptor, true);          // true: passed
+    EXPECT_NE(ended.Test(), 0u);
+
+    sut.Start(descriptor);
+    void* stale = nullptr;
+    {
+        LeakContext::Scope scope(ended); // e.g. on a worker thread
+        EXPECT_EQ(LeakContext::Capture().Test(), ended.Test());
+        stale = malloc(16);
+    }
+    sut.End(descriptor, true);          // true: passed
+    free(stale);                        // cleanup
+    EXPECT_EQ(fail_count, 0u);
+    EXPECT_FALSE(sut.GetContextLeakMessage().empty()); // charged to submitter
+
+    sut.Start(descriptor);
+    const auto running = LeakContext::Capture();
+    void* leak = nullptr;
+    {
+        LeakContext::Scope scope(running);
+        leak = malloc(16);
+    }
+    sut.End(descriptor, true);          // true: passed
+    free(leak);                         // cleanup
+    EXPECT_NE(running.Test(), ended.Test());
+    EXPECT_EQ(fail_count, 1u);
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_not_report_leak__if_background_thread_frees_within_quiescence_timeout)
+{
+    char* args[] = { "test.exe", "--memleak_quiescence=5000" };
+    MemoryLeakDetector detector(2, args);
+    GivenFailCallbackSet(detector);
+    std::atomic<bool> release{ false };
+    std::atomic<bool> ended{ false };
+    void* block = nullptr;
+    std::thread worker([&]()
+    {
+        while (!release)
+            std::this_thread::yield();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        free(block);
+        while (!ended)                  // exit after test, frees thread state
+            std::this_thread::yield();
+    });
+
+    auto descriptor = []() { return std::string("some_test"); };
+    detector.Start(descriptor);
+    block = malloc(16);                 // handed to background thread
+    release = true;
+    detector.End(descriptor, true);     // true: passed
+    ended = true;
+    worker.join();
+
+    EXPECT_EQ(fail_count, 0u);
+    EXPECT_FALSE(detector.GetQuiescence().timed_out);
+    EXPECT_GE(detector.GetQuiescence().milliseconds, 40);
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_end_quiescence_wait_before_window__if_registered_executors_are_idle)
+{
+    char* args[] = { "test.exe", "--memleak_quiescence=5000", 
+        "--memleak_quiescence_window=2000" };
+    MemoryLeakDetector detector(3, args);
+    GivenFailCallbackSet(detector);
+    static const IdleProbe idle = [](void* context)
+    { 
+        return *static_cast<const bool*>(context);
+    };
+    auto executor_idle = true;
+    ASSERT_TRUE(RegisterExecutor(idle, &executor_idle));
+
+    auto descriptor = []() { return std::string("some_test"); };
+    detector.Start(descriptor);
+    auto* ptr = malloc(16);
+    detector.End(descriptor, true);     // true: passed
+    free(ptr);                          // cleanup
+    EXPECT_TRUE(UnregisterExecutor(idle, &executor_idle));
+
+    EXPECT_EQ(fail_count, 1u);
+    EXPECT_FALSE(detector.GetQuiescence().timed_out);
+    EXPECT_LT(detector.GetQuiescence().milliseconds, 2000);
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_wait_for_timeout__if_heap_is_stable_but_executor_busy_with_all_condition)
+{
+    char* args[] = { "test.exe", "--memleak_quiescence=100", 
+        "--memleak_quiescence_condition=all" };
+    MemoryLeakDetector detector(3, args);
+    GivenFailCallbackSet(detector);
+    static const IdleProbe idle = [](void* context)
+    { 
+        return *static_cast<const bool*>(context);
+    };
+    auto executor_idle = false;
+    ASSERT_TRUE(RegisterExecutor(idle, &executor_idle));
+
+    auto descriptor = []() { return std::string("some_test"); };
+    detector.Start(descriptor);
+    auto* ptr = malloc(16);
+    detector.End(descriptor, true);     // true: passed
+    free(ptr);                          // cleanup
+    EXPECT_TRUE(UnregisterExecutor(idle, &executor_idle));
+
+    EXPECT_EQ(fail_count, 1u);
+    EXPECT_TRUE(detector.GetQuiescence().timed_out);
+}
+
+TEST_F(memory_leak_detector_test,
+    register_executor__should_reject_duplicates__if_already_registered)
+{
+    static const IdleProbe idle = [](void* context)
+    { 
+        return *static_cast<const bool*>(context);
+    };
+    auto busy = false;
+    ASSERT_TRUE(RegisterExecutor(idle, &busy));
+    EXPECT_FALSE(RegisterExecutor(idle, &busy));
+    EXPECT_TRUE(UnregisterExecutor(idle, &busy));
+    EXPECT_FALSE(UnregisterExecutor(idle, &busy));
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_charge_leak_to_submitting_test__if_allocated_within_its_context_after_it_ended)
+{
+    GivenFailCallbackSet();
+
+    sut.Start([]() { return std::string("submitter"); });
+    const auto submitted = LeakContext::Capture(); // e.g. captured by a task
+    sut.End([]() { return std::string("submitter"); }, true);
+
+    auto descriptor = []() { return std::string("running"); };
+    sut.Start(descriptor);
+    void* freed = nullptr;
+    void* leaked = nullptr;
+    {
+        LeakContext::Scope scope(submitted);
+        freed = malloc(8);
+        leaked = malloc(16);
+        free(freed);
+    }
+    sut.End(descriptor, true);          // true: passed
+    const std::string message = sut.GetContextLeakMessage().c_str();
+    long request = 0;
+    ASSERT_TRUE(_CrtIsMemoryBlock(leaked, 16, &request, nullptr, nullptr));
+    free(leaked);                       // cleanup
+
+    EXPECT_EQ(fail_count, 0u);
+    EXPECT_EQ(sut.ForeignOverflow(), 0u);
+    EXPECT_EQ(message, MemoryLeakDetector::MakeContextLeakMessage(
+        "submitter", 1u, 16u, request).c_str());
+
+    sut.Start(descriptor);              // no context, no message
+    sut.End(descriptor, true);
+    EXPECT_TRUE(sut.GetContextLeakMessage().empty());
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_count_unrecorded_allocations__if_foreign_log_is_full)
+{
+    GivenFailCallbackSet();
+
+    auto descriptor = []() { return std::string("some_test"); };
+    sut.Start(descriptor);
+    const auto ended = LeakContext::Capture();
+    sut.End(descriptor, true);          // true: passed
+
+    sut.Start(descriptor);
+    {
+        LeakContext::Scope scope(ended);
+        for (size_t i = 0; i < 1024u + 2u; ++i) // log capacity + 2
+            free(malloc(1));            // not leaked
+    }
+    sut.End(descriptor, true);          // true: passed
+
+    EXPECT_EQ(fail_count, 0u);
+    EXPECT_EQ(sut.ForeignOverflow(), 2u);
+    EXPECT_TRUE(sut.GetContextLeakMessage().empty());
+}
+
+TEST_F(memory_leak_detector_test,
+    subscribe__should_dispatch_allocation_events_in_order__until_unsubscribed)
+{
+    struct Subscriber
+    {
+        std::vector<int> calls;         // ids, reserved to not allocate
+        int id;
+        bool fail;
+    };
+    static const AllocationSubscriber subscriber = [](void* context, int type,
+        void*, size_t, int, long, const unsigned char*, int)
+    {
+        auto* self = static_cast<Subscriber*>(context);
+        if (type == _HOOK_ALLOC && self->calls.size() < self->calls.capacity())
+            self->calls.push_back(self->id);
+        return !self->fail;
+    };
+    Subscriber first{ {}, 1, false };
+    Subscriber second{ {}, 2, false };
+    first.calls.reserve(16);
+    second.calls.reserve(16);
+
+    ASSERT_TRUE(Subscribe(subscriber, &first));
+    ASSERT_TRUE(Subscribe(subscriber, &second));
+    EXPECT_FALSE(Subscribe(subscriber, &second)); // already subscribed
+    free(malloc(16));
+    first.fail = true;
+    auto* failed = malloc(16);          // second not invoked
+    first.fail = false;
+    EXPECT_TRUE(Unsubscribe(subscriber, &first));
+    free(malloc(16));                   // first not invoked
+    EXPECT_TRUE(Unsubscribe(subscriber, &second));
+    EXPECT_FALSE(Unsubscribe(subscriber, &second)); // not subscribed
+    free(malloc(16));                   // none invoked
+
+    EXPECT_EQ(failed, nullptr);
+    EXPECT_EQ(first.calls, std::vector<int>({ 1, 1 }));
+    EXPECT_EQ(second.calls, std::vector<int>({ 2, 2 }));
+}
+
+TEST_F(memory_leak_detector_test,
+    child_report__should_merge_results_of_attached_children__if_closed_by_parent)
+{
+    ChildReport parent;
+    ASSERT_TRUE(parent.Create());
+    {   // Children attach via the exported environment variable
+        ChildReport first;
+        ChildReport second;
+        ASSERT_TRUE(first.Attach());
+        ASSERT_TRUE(second.Attach());
+        first.Add(10u, 0u, 0u);
+        first.Add(20u, 2u, 48u);
+        second.Add(5u, 1u, 16u);
+    }
+    const auto totals = parent.Close();
+    ChildReport late;
+
+    EXPECT_FALSE(late.Attach());        // no longer exported
+    EXPECT_EQ(totals.processes, 2u);
+    EXPECT_EQ(totals.tests, 3u);
+    EXPECT_EQ(totals.leaked_tests, 2u);
+    EXPECT_EQ(totals.leaked_blocks, 3u);
+    EXPECT_EQ(totals.leaked_bytes, 64u);
+    EXPECT_EQ(totals.allocations, 35u);
+    EXPECT_STREQ(MemoryLeakDetector::MakeChildLeakMessage(totals).c_str(),
+        "Memory leak detected in 2 of 3 test(s) run by child processes "
+        "(3 blocks, 64 bytes). Run the leaking child process separately to "
+        "obtain stack-trace.");
+}
+
+TEST_F(memory_leak_detector_test,
+    report_process_exit__should_add_interrupted_test_to_parent__if_child_exits_without_end)
+{
+    ChildReport parent;
+    ASSERT_TRUE(parent.Create());
+    void* block = nullptr;
+    {   // Child attaches when constructed and exits within its test
+        char* args[] = { "test.exe" };
+        MemoryLeakDetector child(1, args);
+        auto descriptor = []() { return std::string("death_test"); };
+        child.Start(descriptor);
+        block = malloc(16);
+        MemoryLeakDetector::ReportProcessExit(); // as if exit was called
+        MemoryLeakDetector::ReportProcessExit(); // reported once
+    }
+    const auto totals = parent.Close();
+    free(block);                        // cleanup
+
+    EXPECT_EQ(totals.processes, 1u);
+    EXPECT_EQ(totals.tests, 0u);
+    EXPECT_EQ(totals.leaked_blocks, 0u);
+    EXPECT_EQ(totals.exited_tests, 1u);
+    EXPECT_EQ(totals.exited_blocks, 1u);
+    EXPECT_EQ(totals.exited_bytes, 16u);
+    EXPECT_GE(totals.allocations, 1u);
+}
+
+TEST_F(memory_leak_detector_test,
+    event_recorder__should_write_events_of_all_threads_to_trace_file__if_test_ended)
+{
+    const char* path = "event_recorder_test.gt.memtrace";
+    {
+        EventRecorder recorder;
+        ASSERT_TRUE(recorder.Enable());
+        ASSERT_TRUE(recorder.BeginTest(path, "some_test"));
+        TraceEvent event{};
+        event.request = 1;
+        recorder.Push(event);
+        std::thread([&recorder, event]() { recorder.Push(event); }).join();
+        recorder.EndTest();
+    }
+
+    TraceFileHeader header{};
+    TraceEvent events[3]{};
+    auto* file = fopen(path, "rb");
+    ASSERT_NE(file, nullptr);
+    EXPECT_EQ(fread(&header, sizeof(header), 1, file), 1u);
+    EXPECT_EQ(fread(events, sizeof(TraceEvent), 3, file), 2u);
+    fclose(file);
+    std::remove(path);
+
+    EXPECT_STREQ(header.magic, TraceFileHeader::Magic());
+    EXPECT_STREQ(header.test, "some_test");
+    EXPECT_EQ(header.events, 2u);
+    EXPECT_EQ(header.dropped, 0u);
+    EXPECT_EQ(events[0].GetType(), TraceEvent::Type::Alloc);
+}
+
+TEST_F(memory_leak_detector_test,
+    event_recorder__should_reuse_rings_of_exited_threads__if_more_threads_than_rings)
+{
+    const char* path = "event_recorder_test.gt.memtrace";
+    const auto threads = EventRecorder::max_threads * 2u;
+    size_t dropped_threads = 0;
+    {
+        EventRecorder recorder;
+        ASSERT_TRUE(recorder.Enable());
+        ASSERT_TRUE(recorder.BeginTest(path, "some_test"));
+        TraceEvent event{};
+        event.request = 1;
+        for (size_t i = 0; i < threads; ++i)
+            std::thread([&recorder, event]() { recorder.Push(event); }).join();
+        recorder.EndTest();
+        dropped_threads = recorder.DroppedThreads();
+    }
+
+    TraceFileHeader header{};
+    auto* file = fopen(path, "rb");
+    ASSERT_NE(file, nullptr);
+    EXPECT_EQ(fread(&header, sizeof(header), 1, file), 1u);
+    fclose(file);
+    std::remove(path);
+
+    EXPECT_EQ(header.events, threads);
+    EXPECT_EQ(header.dropped, 0u);
+    EXPECT_EQ(dropped_threads, 0u);
+}
+
+TEST_F(memory_leak_detector_test,
+    event_recorder__should_record_events_of_thread__if_previous_recorder_destroyed)
+{
+    const char* path = "event_recorder_test.gt.memtrace";
+    for (auto i = 0; i < 2; ++i)
+    {   // Likely constructed at the same address each time
+        {
+            EventRecorder recorder;
+            ASSERT_TRUE(recorder.Enable());
+            ASSERT_TRUE(recorder.BeginTest(path, "some_test"));
+            TraceEvent event{};
+            event.request = 1;
+            recorder.Push(event);
+            recorder.EndTest();
+        }
+
+        TraceFileHeader header{};
+        auto* file = fopen(path, "rb");
+        ASSERT_NE(file, nullptr);
+        EXPECT_EQ(fread(&header, sizeof(header), 1, file), 1u);
+        fclose(file);
+        std::remove(path);
+
+        EXPECT_EQ(header.events, 1u);
+        EXPECT_EQ(header.dropped, 0u);
+    }
+}
+
+TEST_F(memory_leak_detector_test,
+    event_recorder_write_workload__should_number_blocks_densely_and_skip_blocks_from_before_test)
+{
+    const char* trace_path = "workload_test.gt.memtrace";
+    const char* workload_path = "workload_test.gt.workload";
+    {
+        EventRecorder recorder;
+        ASSERT_TRUE(recorder.Enable());
+        ASSERT_TRUE(recorder.BeginTest(trace_path, "some_test"));
+        TraceEvent event{};
+        event.timestamp = 1; event.request = 10; event.size = 32;
+        recorder.Push(event);           // alloc slot 0
+        event = TraceEvent{};
+        event.timestamp = 2; event.previous = 5; event.freed = 8;
+        recorder.Push(event);           // free of block allocated before test
+        event = TraceEvent{};
+        event.timestamp = 3; event.request = 11; event.previous = 10; event.size = 64;
+        recorder.Push(event);           // realloc slot 0 into slot 1
+        event = TraceEvent{};
+        event.timestamp = 4; event.previous = 11; event.freed = 64;
+        recorder.Push(event);           // free slot 1
+        recorder.EndTest();
+    }
+    ASSERT_TRUE(EventRecorder::WriteWorkload(trace_path, workload_path));
+
+    WorkloadFileHeader header{};
+    WorkloadOp ops[4]{};
+    auto* file = fopen(workload_path, "rb");
+    ASSERT_NE(file, nullptr);
+    EXPECT_EQ(fread(&header, sizeof(header), 1, file), 1u);
+    EXPECT_EQ(fread(ops, sizeof(WorkloadOp), 4, file), 3u);
+    fclose(file);
+    std::remove(trace_path);
+    std::remove(workload_path);
+
+    EXPECT_STREQ(header.magic, WorkloadFileHeader::Magic());
+    EXPECT_EQ(header.ops, 3u);
+    EXPECT_EQ(header.slots, 2u);
+    EXPECT_EQ(header.threads, 1u);
+    EXPECT_EQ(ops[0].type, WorkloadOp::Alloc);
+    EXPECT_EQ(ops[0].slot, 0u);
+    EXPECT_EQ(ops[0].size, 32u);
+    EXPECT_EQ(ops[1].type, WorkloadOp::Realloc);
+    EXPECT_EQ(ops[1].slot, 1u);
+    EXPECT_EQ(ops[1].previous, 0u);
+    EXPECT_EQ(ops[2].type, WorkloadOp::Free);
+    EXPECT_EQ(ops[2].slot, 1u);
+}
+
+TEST_F(memory_leak_detector_test,
+    end_batch__should_attribute_leak_to_test_and_isolate_it__if_test_within_batch_leaks)
+{
+    char* args[] = { "test.exe", "--memleak_batch=suite" };
+    MemoryLeakDetector detector(2, args);
+    std::string leak_test;
+    size_t batch_tests = 0;
+    detector.SetBatchFailureCallback(
+        [&](const char* test, long n, size_t count)
+    { 
+        ++fail_count;
+        leak_test = test ? test : "";
+        alloc_no = n;
+        batch_tests = count;
+    });
 
+    const char* names[] = { "first", "second", "third" };
+    void* ptr = nullptr;
+    detector.StartBatch();
+    for (auto i = 0; i < 3; ++i)
+    {
+        detector.StartBatchTest(names[i]);
+        if (i == 1)
+            ptr = leaking_test_case(64);
+        else
+            free(malloc(32));
+        EXPECT_FALSE(detector.EndBatchTest(true)); // true: passed
+    }
+    detector.EndBatch([](const void* test) { return std::string(static_cast<const char*>(test)); });
+    free(ptr);                          // cleanup
+
+    ASSERT_EQ(fail_count, 1u);
+    EXPECT_EQ(leak_test, "second");
+    EXPECT_GT(alloc_no, 0);
+    EXPECT_EQ(batch_tests, 3u);
+    EXPECT_TRUE(detector.IsIsolated([]() { return std::string("second"); }));
+    EXPECT_FALSE(detector.IsIsolated([]() { return std::string("first"); }));
+}
+
+TEST_F(memory_leak_detector_test,
+    end_batch__should_not_report__if_batch_is_clean)
+{
+    char* args[] = { "test.exe", "--memleak_batch=2" };
+    MemoryLeakDetector detector(2, args);
+    detector.SetBatchFailureCallback(
+        [this](const char*, long, size_t) { ++fail_count; });
+
+    const char* names[] = { "first", "second" };
+    detector.StartBatch();
+    detector.StartBatchTest(names[0]);
+    free(malloc(32));
+    EXPECT_FALSE(detector.EndBatchTest(true));  // true: passed
+    detector.StartBatchTest(names[1]);
+    EXPECT_TRUE(detector.EndBatchTest(true));   // full since batch of 2
+    detector.EndBatch([](const void* test) { return std::string(static_cast<const char*>(test)); });
+
+    EXPECT_EQ(fail_count, 0u);
+    EXPECT_FALSE(detector.BatchOpen());
+}
+
+TEST_F(memory_leak_detector_test,
+    on_allocation__should_fail_allocation_once__if_given_fail_alloc_option)
+{
+    char* args[] = { "test.exe", "--memleak_fail_alloc=2" };
+    MemoryLeakDetector detector(2, args);
+
+    auto descriptor = []() { return std::string("some_test"); };
+    detector.Start(descriptor);
+    auto* first = malloc(16);
+    auto* second = malloc(16);          // injected failure
+    auto* third = malloc(16);
+    free(first);
+    free(third);
+    detector.End(descriptor, true);     // true: passed
+
+    EXPECT_NE(first, nullptr);
+    EXPECT_EQ(second, nullptr);
+    EXPECT_NE(third, nullptr);
+    EXPECT_EQ(detector.LeakCount(), 0u);
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_report_leak__if_failed_and_given_fail_alloc_option)
+{
+    char* args[] = { "test.exe", "--memleak_fail_alloc=1000" };
+    MemoryLeakDetector detector(2, args);
+    GivenFailCallbackSet(detector);
+
+    auto descriptor = []() { return std::string("some_test"); };
+    void* leak = nullptr;
+    EXPECT_NONFATAL_FAILURE(
+    {
+        detector.Start(descriptor);
+        leak = malloc(16);
+        ADD_FAILURE() << "injected allocation failure not handled";
+        detector.End(descriptor, false); // false: failed
+    }, "injected allocation failure not handled");
+    free(leak); // cleanup
+
+    EXPECT_EQ(fail_count, 1u);
+    EXPECT_EQ(detector.LeakCount(), 1u);
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_not_report_failure_results__if_failed_and_given_fail_alloc_option)
+{
+    char* args[] = { "test.exe", "--memleak_fail_alloc=1000" };
+    MemoryLeakDetector detector(2, args);
+    GivenFailCallbackSet(detector);
+
+    auto descriptor = []() { return std::string("some_test"); };
+    EXPECT_NONFATAL_FAILURE(
+    {
+        detector.Start(descriptor);
+        free(malloc(16));
+        ADD_FAILURE() << "injected allocation failure not handled";
+        detector.End(descriptor, false); // false: failed
+    }, "injected allocation failure not handled");
+
+    EXPECT_EQ(fail_count, 0u);
+    EXPECT_EQ(detector.LeakCount(), 0u);
+}
+
+TEST_F(memory_leak_detector_test,
+    failure_sweep_classify__should_classify_child_exit_codes)
+{
+    EXPECT_EQ(FailureSweep::Classify(0u), FailureSweep::Outcome::Passed);
+    EXPECT_EQ(FailureSweep::Classify(1u), FailureSweep::Outcome::Failed);
+    EXPECT_EQ(FailureSweep::Classify(FailureSweep::leak_exit_code), 
+        FailureSweep::Outcome::Leaked);
+    EXPECT_EQ(FailureSweep::Classify(3u), FailureSweep::Outcome::Crashed); // abort()
+    EXPECT_EQ(FailureSweep::Classify(0xC0000005u), FailureSweep::Outcome::Crashed);
+}
+
+TEST_F(memory_leak_detector_test,
+    failure_sweep_is_forwarded__should_only_forward_flags_not_changing_sweep_children)
+{
+    EXPECT_TRUE(FailureSweep::IsForwarded("--memleak_identity=signature"));
+    EXPECT_TRUE(FailureSweep::IsForwarded("--memleak_quiescence_timeout=100"));
+    EXPECT_TRUE(FailureSweep::IsForwarded("--gtest_also_run_disabled_tests"));
+    EXPECT_TRUE(FailureSweep::IsForwarded("--gtest_filter_unknown"));
+    EXPECT_FALSE(FailureSweep::IsForwarded("--gtest_filter=a.*"));
+    EXPECT_FALSE(FailureSweep::IsForwarded("--gtest_output=xml:out.xml"));
+    EXPECT_FALSE(FailureSweep::IsForwarded("--gtest_repeat=3"));
+    EXPECT_FALSE(FailureSweep::IsForwarded("--memleak_fail_sweep"));
+    EXPECT_FALSE(FailureSweep::IsForwarded("--memleak_fail_sweep_max=10"));
+    EXPECT_FALSE(FailureSweep::IsForwarded("--memleak_fail_alloc=3"));
+    EXPECT_FALSE(FailureSweep::IsForwarded("--memleak_growth"));
+    EXPECT_FALSE(FailureSweep::IsForwarded("--memleak_batch=8"));
+    EXPECT_FALSE(FailureSweep::IsForwarded("--memleak_record"));
+    EXPECT_FALSE(FailureSweep::IsForwarded("input.txt"));
+    EXPECT_FALSE(FailureSweep::IsForwarded(nullptr));
+}
+
+TEST_F(memory_leak_detector_test,
+    make_sweep_messages__should_format_result_without_allocating)
+{
+    FailureSweep::Result result;
+    result.runs = 5;
+    result.passed = 2;
+    result.leaked = 2;
+    result.crashed = 1;
+    result.first_leak = 3;
+    result.first_crash = 4;
+    result.crash_code = 0xC0000005u;
+    EXPECT_STREQ(MemoryLeakDetector::MakeSweepSummary(result).c_str(),
+        "5 runs, 2 passed, 0 failed, 2 leaked, 1 crashed");
+    EXPECT_STREQ(MemoryLeakDetector::MakeSweepLeakMessage(result, "a.b").c_str(),
+        "Memory leak detected when failing allocation 3 of test (2 of 5 injected "
+        "allocation failures leak). Re-run with --gtest_filter=a.b "
+        "--memleak_fail_alloc=3 to obtain stack-trace.");
+    EXPECT_STREQ(MemoryLeakDetector::MakeSweepCrashMessage(result).c_str(),
+        "Test crashed (exit code 0xC0000005) when failing allocation 4 of test "
+        "(1 of 5 injected allocation failures crash).");
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_report_leak__if_strdup_and_aligned_allocations_not_freed)
+{
+    GivenFailCallbackSet();
+
+    auto descriptor = []() { return std::string("some_test"); };
+    sut.Start(descriptor);
+    auto* str = _strdup("leak");
+    sut.End(descriptor, true);          // true: passed
+    free(str);                          // cleanup
+    EXPECT_EQ(fail_count, 1u);
+
+    Reset();
+    sut.Start(descriptor);
+    auto* aligned = _aligned_malloc(64, 64);
+    sut.End(descriptor, true);          // true: passed
+    _aligned_free(aligned);             // cleanup
+    EXPECT_EQ(fail_count, 1u);
+
+    Reset();
+    sut.Start(descriptor);
+    auto* aligned_new = ::operator new(64, std::align_val_t(64));
+    sut.End(descriptor, true);          // true: passed
+    ::operator delete(aligned_new, std::align_val_t(64)); // cleanup
+    EXPECT_EQ(fail_count, 1u);
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_report_virtual_memory_leak__if_reserved_region_not_released_and_tracking_enabled)
+{
+    char* args[] = { "test.exe", "--memleak_track_virtual_memory" };
+    MemoryLeakDetector detector(2, args);
+    GivenFailCallbackSet(detector);
+
+    auto descriptor = []() { return std::string("some_test"); };
+    detector.Start(descriptor);
+    auto* region = VirtualAlloc(nullptr, 1, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    detector.End(descriptor, true);     // true: passed
+    VirtualFree(region, 0, MEM_RELEASE); // cleanup
+
+    ASSERT_EQ(fail_count, 1u);
+    EXPECT_EQ(alloc_no, 1);             // first annotated allocation
+}
+
+TEST_F(memory_leak_detector_test,
+    end__should_not_report_leak__if_virtual_memory_released_and_tracking_enabled)
+{
+    char* args[] = { "test.exe", "--memleak_track_virtual_memory" };
+    MemoryLeakDetector detector(2, args);
+    GivenFailCallbackSet(detector);
+
+    auto descriptor = []() { return std::string("some_test"); };
+    detector.Start(descriptor);
+    auto* region = VirtualAlloc(nullptr, 1, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    VirtualFree(region, 0, MEM_RELEASE);
+    detector.End(descriptor, true);     // true: passed
+
+    EXPECT_EQ(fail_count, 0u);
+}
+
+#endif // GTEST_MEMLEAK_DETECTOR_IMPL_AVAILABLE
@@ -0,0 +1,333 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+// Offline analyzer for allocation trace files recorded with --memleak_record.
+//
+// Usage: gtest_memleak_detector_trace_analyzer [--threads=N] [--top=N] file...
+//
+// Reports leaks, peak usage, a histogram of block lifetimes and the hottest
+// allocation call-sites of each trace. Events are partitioned by block over
+// worker threads so that each pass over the trace is parallel.
+
+#include "memory_leak_detector_trace.h"
+
+#include <algorithm>     // std::sort, std::inplace_merge
+#include <cinttypes>     // PRIu64
+#include <cstddef>       // ptrdiff_t
+#include <cstdio>        // fopen, printf
+#include <cstdlib>       // strtoul
+#include <cstring>       // strncmp
+#include <thread>        // std::thread
+#include <unordered_map> // std::unordered_map
+#include <vector>        // std::vector
+
+using gtest_memleak_detector::TraceEvent;
+using gtest_memleak_detector::TraceFileHeader;
+
+namespace {
+
+constexpr size_t lifetime_buckets = 40u; // log2 of nanoseconds
+
+struct Trace
+{
+    TraceFileHeader         header;
+    std::vector<TraceEvent> events;
+};
+
+struct Block
+{
+    uint64_t    timestamp;
+    uint64_t    size;
+    uint32_t    thread;
+    uint32_t    stack;
+};
+
+struct Site
+{
+    uint64_t    allocations;
+    uint64_t    bytes;
+};
+
+// Result of a single worker, merged after all workers completed
+struct Partition
+{
+    std::unordered_map<int32_t, Block> live;
+    std::unordered_map<uint32_t, Site> sites;
+    uint64_t    lifetimes[lifetime_buckets];
+};
+
+struct Usage
+{
+    int64_t     total;
+    int64_t     peak;
+    size_t      peak_index;
+};
+
+bool Load(const char* path, Trace& trace)
+{
+    auto* file = fopen(path, "rb");
+    if (file == nullptr)
+        return false;
+    auto valid = fread(&trace.header, sizeof(trace.header), 1, file) == 1 &&
+        strncmp(trace.header.magic, TraceFileHeader::Magic(), sizeof(trace.header.magic)) == 0 &&
+        trace.header.version == TraceFileHeader::current_version &&
+        trace.header.event_size == sizeof(TraceEvent);
+    if (valid)
+    {
+        trace.events.resize(static_cast<size_t>(trace.header.events));
+        valid = fread(trace.events.data(), sizeof(TraceEvent), 
+            trace.events.size(), file) == trace.events.size();
+    }
+    fclose(file);
+    return valid;
+}
+
+template<class Function>
+void Parallel(unsigned threads, Function&& function)
+{
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+    for (auto i = 0u; i < threads; ++i)
+        workers.emplace_back([&function, i]() { function(i); });
+    for (auto& worker : workers)
+        worker.join();
+}
+
+size_t ChunkBegin(size_t size, unsigned chunks, unsigned chunk) noexcept
+{
+    return size * chunk / chunks;
+}
+
+void SortByTimestamp(std::vector<TraceEvent>& events, unsigned threads)
+{
+    // Events are flushed in per-thread chunks, sort chunks in parallel and
+    // merge them pairwise.
+    const auto before = [](const TraceEvent& lhs, const TraceEvent& rhs) {
+        return lhs.timestamp < rhs.timestamp;
+    };
+    const auto size = events.size();
+    Parallel(threads, [&](unsigned chunk) {
+        std::sort(events.begin() + static_cast<ptrdiff_t>(ChunkBegin(size, threads, chunk)),
+            events.begin() + static_cast<ptrdiff_t>(ChunkBegin(size, threads, chunk + 1u)),
+            before);
+    });
+    for (auto width = 1u; width < threads; width *= 2u)
+    {
+        for (auto chunk = 0u; chunk + width < threads; chunk += 2u * width)
+        {
+            const auto last = (std::min)(chunk + 2u * width, threads);
+            std::inplace_merge(
+                events.begin() + static_cast<ptrdiff_t>(ChunkBegin(size, threads, chunk)),
+                events.begin() + static_cast<ptrdiff_t>(ChunkBegin(size, threads, chunk + width)),
+                events.begin() + static_cast<ptrdiff_t>(ChunkBegin(size, threads, last)),
+                before);
+        }
+    }
+}
+
+size_t Bucket(uint64_t nanoseconds) noexcept
+{
+    size_t bucket = 0;
+    while (nanoseconds > 1u && bucket + 1u < lifetime_buckets)
+    {
+        nanoseconds >>= 1u;
+        ++bucket;
+    }
+    return bucket;
+}
+
+uint64_t ToNanoseconds(uint64_t ticks, uint64_t frequency) noexcept
+{
+    return (frequency == 0u) ? ticks :
+        (ticks / frequency) * 1000000000u + (ticks % frequency) * 1000000000u / frequency;
+}
+
+void Analyze(const Trace& trace, unsigned threads, Partition& partition, unsigned index)
+{
+    // Blocks are partitioned by request no so that the allocation and the
+    // free of a block are always seen by the same worker.
+    const auto owns = [threads, index](int32_t request) {
+        return static_cast<unsigned>(request) % threads == index;
+    };
+    for (const auto& event : trace.events)
+    {
+        if (event.previous != 0 && owns(event.previous))
+        {
+            const auto it = partition.live.find(event.previous);
+            if (it != partition.live.end()) // else allocated before the test
+            {
+                const auto lifetime = ToNanoseconds(
+                    event.timestamp - it->second.timestamp, trace.header.frequency);
+                ++partition.lifetimes[Bucket(lifetime)];
+                partition.live.erase(it);
+            }
+        }
+        if (event.request != 0 && owns(event.request))
+        {
+            partition.live[event.request] = Block{ 
+                event.timestamp, event.size, event.thread, event.stack };
+            auto& site = partition.sites[event.stack];
+            ++site.allocations;
+            site.bytes += event.size;
+        }
+    }
+}
+
+Usage Accumulate(const std::vector<TraceEvent>& events, size_t first, size_t last)
+{
+    Usage usage{ 0, 0, first };
+    for (auto i = first; i < last; ++i)
+    {
+        usage.total += static_cast<int64_t>(events[i].size) - 
+            static_cast<int64_t>(events[i].freed);
+        if (usage.total > usage.peak)
+        {
+            usage.peak = usage.total;
+            usage.peak_index = i;
+        }
+    }
+    return usage;
+}
+
+Usage Peak(const std::vector<TraceEvent>& events, unsigned threads)
+{
+    // Parallel prefix: peak of each chunk relative to its start, then offset
+    // by the total of all preceding chunks.
+    std::vector<Usage> chunks(threads);
+    Parallel(threads, [&](unsigned chunk) {
+        chunks[chunk] = Accumulate(events, ChunkBegin(events.size(), threads, chunk),
+            ChunkBegin(events.size(), threads, chunk + 1u));
+    });
+    Usage result{ 0, 0, 0 };
+    for (const auto& chunk : chunks)
+    {
+        if (result.total + chunk.peak > result.peak)
+        {
+            result.peak = result.total + chunk.peak;
+            result.peak_index = chunk.peak_index;
+        }
+        result.total += chunk.total;
+    }
+    return result;
+}
+
+void Report(const char* path, Trace& trace, unsigned threads, size_t top)
+{
+    auto& events = trace.events;
+    SortByTimestamp(events, threads);
+
+    std::vector<Partition> partitions(threads);
+    Parallel(threads, [&](unsigned index) {
+        Analyze(trace, threads, partitions[index], index);
+    });
+    const auto usage = Peak(events, threads);
+
+    // Merge partitions
+    std::vector<std::pair<int32_t, Block>> leaks;
+    std::unordered_map<uint32_t, Site> sites;
+    uint64_t lifetimes[lifetime_buckets] = {};
+    for (const auto& partition : partitions)
+    {
+        leaks.insert(leaks.end(), partition.live.begin(), partition.live.end());
+        for (const auto& kvp : partition.sites)
+        {
+            auto& site = sites[kvp.first];
+            site.allocations += kvp.second.allocations;
+            site.bytes += kvp.second.bytes;
+        }
+        for (size_t i = 0; i < lifetime_buckets; ++i)
+            lifetimes[i] += partition.lifetimes[i];
+    }
+    std::sort(leaks.begin(), leaks.end(), 
+        [](const std::pair<int32_t, Block>& lhs, const std::pair<int32_t, Block>& rhs) {
+            return lhs.first < rhs.first; 
+        });
+
+    const auto frequency = trace.header.frequency;
+    const auto since_start = [&](size_t index) {
+        return events.empty() ? 0u : 
+            ToNanoseconds(events[index].timestamp - trace.header.start, frequency) / 1000u;
+    };
+
+    printf("trace: %s\n", path);
+    printf("test: %s\n", trace.header.test);
+    printf("events: %zu (%" PRIu64 " dropped)\n", events.size(), trace.header.dropped);
+    if (trace.header.dropped != 0u)
+        printf("warning: events were dropped, results are incomplete\n");
+    printf("peak: %lld bytes at +%" PRIu64 " us\n", 
+        static_cast<long long>(usage.peak), since_start(usage.peak_index));
+
+    uint64_t leaked_bytes = 0;
+    for (const auto& leak : leaks)
+        leaked_bytes += leak.second.size;
+    printf("leaks: %zu blocks, %" PRIu64 " bytes\n", leaks.size(), leaked_bytes);
+    for (size_t i = 0; i < leaks.size() && i < top; ++i)
+    {
+        const auto& block = leaks[i].second;
+        printf("  request %ld: %" PRIu64 " bytes, thread %lu, stack 0x%08lx\n",
+            static_cast<long>(leaks[i].first), block.size,
+            static_cast<unsigned long>(block.thread), static_cast<unsigned long>(block.stack));
+    }
+
+    printf("lifetimes:\n");
+    for (size_t i = 0; i < lifetime_buckets; ++i)
+    {
+        if (lifetimes[i] != 0u)
+            printf("  < %" PRIu64 " ns: %" PRIu64 "\n", uint64_t(2) << i, lifetimes[i]);
+    }
+
+    std::vector<std::pair<uint32_t, Site>> hot(sites.begin(), sites.end());
+    std::sort(hot.begin(), hot.end(), 
+        [](const std::pair<uint32_t, Site>& lhs, const std::pair<uint32_t, Site>& rhs) {
+            return lhs.second.allocations > rhs.second.allocations;
+        });
+    printf("hot sites:\n");
+    for (size_t i = 0; i < hot.size() && i < top; ++i)
+    {
+        printf("  stack 0x%08lx: %" PRIu64 " allocations, %" PRIu64 " bytes\n",
+            static_cast<unsigned long>(hot[i].first), hot[i].second.allocations, 
+            hot[i].second.bytes);
+    }
+    printf("\n");
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    auto threads = (std::max)(std::thread::hardware_concurrency(), 1u);
+    size_t top = 10;
+    auto files = 0;
+    auto failed = 0;
+    for (auto i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            threads = (std::max)(static_cast<unsigned>(strtoul(argv[i] + 10, nullptr, 10)), 1u);
+            continue;
+        }
+        if (strncmp(argv[i], "--top=", 6) == 0)
+        {
+            top = static_cast<size_t>(strtoul(argv[i] + 6, nullptr, 10));
+            continue;
+        }
+
+        ++files;
+        Trace trace;
+        if (!Load(argv[i], trace))
+        {
+            fprintf(stderr, "error: invalid trace file: %s\n", argv[i]);
+            ++failed;
+            continue;
+        }
+        Report(argv[i], trace, threads, top);
+    }
+    if (files == 0)
+    {
+        fprintf(stderr, 
+            "usage: %s [--threads=N] [--top=N] file...\n", argv[0]);
+        return 2;
+    }
+    return (failed != 0) ? 1 : 0;
+}
@@ -0,0 +1,193 @@
+// Copyright(C) 2019 - 2020 Hkan Sidenvall <ekcoh.git@gmail.com>.
+// This file is subject to the license terms in the LICENSE file
+// found in the root directory of this distribution.
+
+// Replays workloads recorded with --memleak_workload against the allocator
+// linked into this executable, e.g. link jemalloc, tcmalloc or mimalloc via
+// GTEST_MEMLEAK_DETECTOR_REPLAY_ALLOCATOR to compare them.
+//
+// Usage: gtest_memleak_detector_workload_replay [--iterations=N] file...
+//
+// Each recorded thread is replayed by a separate thread. A thread freeing a 
+// block allocated by another thread waits until that block is allocated.
+
+#include "memory_leak_detector_trace.h"
+
+#include <algorithm>     // std::max
+#include <atomic>        // std::atomic
+#include <chrono>        // std::chrono::steady_clock
+#include <cinttypes>     // PRIu64
+#include <cstdio>        // fopen, printf
+#include <cstdlib>       // malloc, realloc, free
+#include <cstring>       // strncmp
+#include <memory>        // std::unique_ptr
+#include <thread>        // std::thread
+#include <vector>        // std::vector
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <psapi.h>       // GetProcessMemoryInfo
+#else
+#include <sys/resource.h> // getrusage
+#endif
+
+using gtest_memleak_detector::WorkloadFileHeader;
+using gtest_memleak_detector::WorkloadOp;
+
+namespace {
+
+struct Workload
+{
+    WorkloadFileHeader                   header;
+    std::vector<std::vector<WorkloadOp>> threads;
+    uint64_t                             bytes;
+};
+
+bool Load(const char* path, Workload& workload)
+{
+    auto* file = fopen(path, "rb");
+    if (file == nullptr)
+        return false;
+    auto& header = workload.header;
+    auto valid = fread(&header, sizeof(header), 1, file) == 1 &&
+        strncmp(header.magic, WorkloadFileHeader::Magic(), sizeof(header.magic)) == 0 &&
+        header.version == WorkloadFileHeader::current_version &&
+        header.op_size == sizeof(WorkloadOp);
+    
+    // Split operations by thread preserving their order
+    workload.threads.assign(valid ? header.threads : 0u, std::vector<WorkloadOp>());
+    workload.bytes = 0;
+    WorkloadOp op;
+    for (uint64_t i = 0; valid && i < header.ops; ++i)
+    {
+        valid = fread(&op, sizeof(op), 1, file) == 1 && 
+            op.thread < header.threads && op.slot < header.slots &&
+            (op.type != WorkloadOp::Realloc || op.previous < header.slots);
+        if (valid)
+        {
+            workload.threads[op.thread].push_back(op);
+            workload.bytes += op.size;
+        }
+    }
+    fclose(file);
+    return valid;
+}
+
+void* WaitFor(std::atomic<void*>& slot) noexcept
+{
+    void* ptr;
+    while ((ptr = slot.exchange(nullptr, std::memory_order_acquire)) == nullptr)
+        std::this_thread::yield();
+    return ptr;
+}
+
+void Replay(const std::vector<WorkloadOp>& ops, std::atomic<void*>* slots) noexcept
+{
+    for (const auto& op : ops)
+    {
+        void* ptr = nullptr;
+        switch (op.type)
+        {
+        case WorkloadOp::Alloc:
+            ptr = malloc((std::max)(op.size, 1u));
+            break;
+        case WorkloadOp::Realloc:
+            ptr = realloc(WaitFor(slots[op.previous]), (std::max)(op.size, 1u));
+            break;
+        case WorkloadOp::Free:
+        default:
+            free(WaitFor(slots[op.slot]));
+            continue;
+        }
+        if (ptr == nullptr)
+            abort(); // out of memory, results would be meaningless
+        static_cast<volatile char*>(ptr)[0] = 1; // touch like the real code
+        slots[op.slot].store(ptr, std::memory_order_release);
+    }
+}
+
+uint64_t PeakResidentBytes() noexcept
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0u;
+    return static_cast<uint64_t>(counters.PeakWorkingSetSize);
+#else
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0u;
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024u; // kilobytes
+#endif
+}
+
+void Run(const char* path, const Workload& workload, unsigned iterations)
+{
+    const auto& header = workload.header;
+    std::unique_ptr<std::atomic<void*>[]> slots(new std::atomic<void*>[header.slots]);
+
+    std::chrono::steady_clock::duration elapsed{};
+    for (auto iteration = 0u; iteration < iterations; ++iteration)
+    {
+        for (uint32_t i = 0; i < header.slots; ++i)
+            slots[i].store(nullptr, std::memory_order_relaxed);
+
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        threads.reserve(workload.threads.size());
+        for (const auto& ops : workload.threads)
+            threads.emplace_back([&ops, &slots]() { Replay(ops, slots.get()); });
+        for (auto& thread : threads)
+            thread.join();
+        elapsed += std::chrono::steady_clock::now() - start;
+
+        // Blocks leaked by the test are released outside of the measurement
+        for (uint32_t i = 0; i < header.slots; ++i)
+            free(slots[i].exchange(nullptr, std::memory_order_relaxed));
+    }
+
+    const auto seconds = std::chrono::duration<double>(elapsed).count();
+    const auto ops = static_cast<double>(header.ops) * iterations;
+    printf("workload: %s\n", path);
+    printf("test: %s\n", header.test);
+    printf("operations: %" PRIu64 " (%u threads, %u blocks, %" PRIu64 " bytes)\n",
+        header.ops, header.threads, header.slots, workload.bytes);
+    printf("iterations: %u\n", iterations);
+    printf("time: %.3f ms\n", seconds * 1000.0);
+    printf("throughput: %.3f Mops/s\n", (seconds > 0.0) ? ops / seconds / 1e6 : 0.0);
+    printf("peak rss: %" PRIu64 " bytes\n\n", PeakResidentBytes());
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    auto iterations = 1u;
+    auto files = 0;
+    auto failed = 0;
+    for (auto i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--iterations=", 13) == 0)
+        {
+            iterations = (std::max)(static_cast<unsigned>(strtoul(argv[i] + 13, nullptr, 10)), 1u);
+            continue;
+        }
+
+        ++files;
+        Workload workload;
+        if (!Load(argv[i], workload))
+        {
+            fprintf(stderr, "error: invalid workload file: %s\n", argv[i]);
+            ++failed;
+            continue;
+        }
+        Run(argv[i], workload, iterations);
+    }
+    if (files == 0)
+    {
+        fprintf(stderr, "usage: %s [--iterations=N] file...\n", argv[0]);
+        return 2;
+    }
+    return (failed != 0) ? 1 : 0;
+}